@@ -0,0 +1,48 @@
+#include "arena.h"
+
+#include <esp_log.h>
+
+#define LOG_TAG "arena"
+
+#define ARENA_ALIGNMENT 8
+
+int lk_arena_init(lk_arena *arena, size_t size, lk_mem_tag tag) {
+  arena->tag = tag;
+  arena->base = (uint8_t *)lk_mem_alloc(tag, size);
+  if (arena->base == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate %d byte arena", (int)size);
+    return -1;
+  }
+
+  arena->size = size;
+  arena->used = 0;
+  arena->high_water = 0;
+  arena->overflows = 0;
+  return 0;
+}
+
+void *lk_arena_alloc(lk_arena *arena, size_t size) {
+  auto aligned = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (arena->base == NULL || arena->size - arena->used < aligned) {
+    arena->overflows++;
+    return lk_mem_alloc(arena->tag, size);
+  }
+
+  auto pointer = arena->base + arena->used;
+  arena->used += aligned;
+  if (arena->used > arena->high_water) {
+    arena->high_water = arena->used;
+  }
+  return pointer;
+}
+
+void lk_arena_free(lk_arena *arena, void *pointer) {
+  auto p = (uint8_t *)pointer;
+  if (p < arena->base || p >= arena->base + arena->size) {
+    lk_mem_free(arena->tag, pointer);
+  }
+}
+
+void lk_arena_reset(lk_arena *arena) {
+  arena->used = 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem_budget.h"
+
+// lk_arena is a bump allocator for short lived, all-at-once allocations like
+// an unpacked protobuf message. Allocations are never freed individually, the
+// whole arena is reset once the message has been handled. Requests that don't
+// fit fall back to the heap so a large message still decodes.
+typedef struct {
+  lk_mem_tag tag;  // of the arena and of every overflow
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  size_t high_water;
+  uint32_t overflows;
+} lk_arena;
+
+int lk_arena_init(lk_arena *arena, size_t size, lk_mem_tag tag);
+void *lk_arena_alloc(lk_arena *arena, size_t size);
+void lk_arena_free(lk_arena *arena, void *pointer);
+void lk_arena_reset(lk_arena *arena);
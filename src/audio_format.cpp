@@ -0,0 +1,185 @@
+#include "audio_format.h"
+
+#include <esp_log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LINUX_BUILD
+#include <dsps_dotprod.h>
+#endif
+
+#include "mem_budget.h"
+
+#define LOG_TAG "audio_format"
+
+// Zero crossings of the windowed sinc on each side, sets the filter length
+// relative to the narrower of the two bandwidths
+#define RESAMPLER_ZERO_CROSSINGS 8
+
+// Passband edge relative to the lower Nyquist frequency
+#define RESAMPLER_CUTOFF 0.9f
+
+static uint32_t lk_gcd(uint32_t a, uint32_t b) {
+  while (b != 0) {
+    auto t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static int16_t lk_saturate_q15(int32_t value) {
+  if (value > INT16_MAX) {
+    return INT16_MAX;
+  } else if (value < INT16_MIN) {
+    return INT16_MIN;
+  }
+  return (int16_t)value;
+}
+
+static inline int16_t lk_dot_q15(const int16_t *x, const int16_t *h,
+                                 uint32_t taps) {
+#ifdef LINUX_BUILD
+  int32_t acc = 1 << 14;
+  for (uint32_t i = 0; i < taps; i++) {
+    acc += (int32_t)x[i] * h[i];
+  }
+  return lk_saturate_q15(acc >> 15);
+#else
+  int16_t result = 0;
+  dsps_dotprod_s16(x, h, &result, taps, 0);
+  return result;
+#endif
+}
+
+int lk_resampler_init(lk_resampler *resampler, uint32_t in_rate,
+                      uint32_t out_rate, size_t max_input) {
+  memset(resampler, 0, sizeof(*resampler));
+  auto gcd = lk_gcd(in_rate, out_rate);
+  resampler->up = out_rate / gcd;
+  resampler->down = in_rate / gcd;
+  resampler->max_input = max_input;
+  if (resampler->up == 1 && resampler->down == 1) {
+    return 0;
+  }
+
+  auto ratio = resampler->up > resampler->down ? resampler->up
+                                               : resampler->down;
+  auto taps = 2 * RESAMPLER_ZERO_CROSSINGS * ratio / resampler->up;
+  resampler->taps = (taps + 7) & ~7u;
+
+  auto length = resampler->up * resampler->taps;
+  resampler->coefficients =
+      (int16_t *)lk_mem_alloc(LK_MEM_AUDIO, length * sizeof(int16_t));
+  resampler->buffer = (int16_t *)lk_mem_alloc(
+      LK_MEM_AUDIO, (resampler->taps - 1 + max_input) * sizeof(int16_t));
+  if (resampler->coefficients == NULL || resampler->buffer == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate %lu -> %lu Hz resampler",
+             (unsigned long)in_rate, (unsigned long)out_rate);
+    lk_mem_free(LK_MEM_AUDIO, resampler->coefficients);
+    lk_mem_free(LK_MEM_AUDIO, resampler->buffer);
+    resampler->coefficients = NULL;
+    resampler->buffer = NULL;
+    return -1;
+  }
+  memset(resampler->buffer, 0, (resampler->taps - 1) * sizeof(int16_t));
+
+  // Blackman windowed sinc at the upsampled rate, gain up so every phase sums
+  // to unity
+  auto cutoff = RESAMPLER_CUTOFF * 0.5f / ratio;
+  auto center = (length - 1) / 2.0f;
+  for (uint32_t n = 0; n < length; n++) {
+    auto t = n - center;
+    auto sinc = t == 0 ? 2 * cutoff
+                       : sinf(2 * (float)M_PI * cutoff * t) / ((float)M_PI * t);
+    auto window = 0.42f - 0.5f * cosf(2 * (float)M_PI * n / (length - 1)) +
+                  0.08f * cosf(4 * (float)M_PI * n / (length - 1));
+    auto value = sinc * window * resampler->up * 32768.0f;
+
+    // Tap n belongs to phase n % up, reversed so a phase is a plain dot
+    // product with the oldest sample first
+    auto phase = n % resampler->up;
+    auto tap = resampler->taps - 1 - n / resampler->up;
+    resampler->coefficients[phase * resampler->taps + tap] =
+        lk_saturate_q15((int32_t)lrintf(value));
+  }
+
+  ESP_LOGI(LOG_TAG, "%lu -> %lu Hz, %lu taps per phase", (unsigned long)in_rate,
+           (unsigned long)out_rate, (unsigned long)resampler->taps);
+  return 0;
+}
+
+size_t lk_resampler_process(lk_resampler *resampler, const int16_t *in,
+                            size_t in_samples, int16_t *out) {
+  if (resampler->coefficients == NULL) {
+    if (in != out) {
+      memmove(out, in, in_samples * sizeof(int16_t));
+    }
+    return in_samples;
+  }
+
+  if (in_samples > resampler->max_input) {
+    in_samples = resampler->max_input;
+  }
+
+  auto history = resampler->taps - 1;
+  memcpy(resampler->buffer + history, in, in_samples * sizeof(int16_t));
+
+  auto out_samples = in_samples * resampler->up / resampler->down;
+  for (size_t n = 0; n < out_samples; n++) {
+    auto t = n * resampler->down;
+    auto phase = t % resampler->up;
+    out[n] = lk_dot_q15(resampler->buffer + t / resampler->up,
+                        resampler->coefficients + phase * resampler->taps,
+                        resampler->taps);
+  }
+
+  memmove(resampler->buffer, resampler->buffer + in_samples,
+          history * sizeof(int16_t));
+  return out_samples;
+}
+
+void lk_audio_mono_to_stereo(const int16_t *in, int16_t *out, size_t samples) {
+  // Back to front so the conversion can be done in place
+  for (size_t i = samples; i-- > 0;) {
+    out[2 * i] = in[i];
+    out[2 * i + 1] = in[i];
+  }
+}
+
+void lk_audio_stereo_to_mono(const int16_t *in, int16_t *out, size_t samples) {
+  for (size_t i = 0; i < samples; i++) {
+    out[i] = (int16_t)(((int32_t)in[2 * i] + in[2 * i + 1]) >> 1);
+  }
+}
+
+void lk_audio_apply_gain(int16_t *samples, size_t count, int32_t gain) {
+  if (gain == AUDIO_GAIN_UNITY) {
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    samples[i] = lk_saturate_q15((samples[i] * gain + (1 << 11)) >> 12);
+  }
+}
+
+void lk_audio_mix_add(int32_t *mix, const int16_t *in, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    mix[i] += in[i];
+  }
+}
+
+void lk_audio_mix_saturate(const int32_t *mix, int16_t *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = lk_saturate_q15(mix[i]);
+  }
+}
+
+bool lk_audio_is_silent(const int16_t *samples, size_t count) {
+  int16_t any = 0;
+  for (size_t i = 0; i < count; i++) {
+    any |= samples[i];
+  }
+  return any == 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Format conversion between the codec and the audio HAL: sample rate
+// conversion between 8, 16, 24 and 48 kHz, mono/stereo mapping and gain. All
+// kernels are Q15 fixed point. The FIR dot product uses esp-dsp on target,
+// which picks the PIE (SIMD) implementation on the ESP32-S3, and a plain loop
+// the compiler vectorizes on Linux.
+
+// Gain is Q12, this is 0 dB
+#define AUDIO_GAIN_UNITY 4096
+
+// Polyphase FIR resampler for a rational ratio. Every call converts a whole
+// number of frames, so the filter phase restarts at 0 on every call and only
+// the input history is carried over.
+typedef struct {
+  uint32_t up;    // interpolation factor
+  uint32_t down;  // decimation factor
+  uint32_t taps;  // per phase, a multiple of 8
+  size_t max_input;
+  int16_t *coefficients;  // up phases of taps, each reversed
+  int16_t *buffer;        // taps - 1 samples of history, then the input
+} lk_resampler;
+
+int lk_resampler_init(lk_resampler *resampler, uint32_t in_rate,
+                      uint32_t out_rate, size_t max_input);
+
+// in_samples must be a multiple of the ratio's denominator, which holds for
+// any whole number of 10ms frames. Returns the number of samples written to
+// out. Safe to call with in == out when the rates are equal
+size_t lk_resampler_process(lk_resampler *resampler, const int16_t *in,
+                            size_t in_samples, int16_t *out);
+
+// in and out may be the same buffer
+void lk_audio_mono_to_stereo(const int16_t *in, int16_t *out, size_t samples);
+void lk_audio_stereo_to_mono(const int16_t *in, int16_t *out, size_t samples);
+
+// Saturating, gain is Q12
+void lk_audio_apply_gain(int16_t *samples, size_t count, int32_t gain);
+
+// Mixing sums into a 32 bit accumulator, so any number of streams add up
+// without intermediate clipping, and saturates once at the end. Both are
+// plain loops the compiler vectorizes.
+void lk_audio_mix_add(int32_t *mix, const int16_t *in, size_t count);
+void lk_audio_mix_saturate(const int32_t *mix, int16_t *out, size_t count);
+
+// Whether every sample is 0
+bool lk_audio_is_silent(const int16_t *samples, size_t count);
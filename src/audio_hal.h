@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Audio HAL used by media.cpp. Exactly one implementation is linked per
+// target: audio_hal_i2s.cpp drives the I2S microphone and speaker,
+// audio_hal_linux.cpp reads and writes WAV files paced by a wall clock.
+//
+// Frames are AUDIO_HAL_FRAME_SAMPLES at AUDIO_HAL_SAMPLE_RATE and are handed
+// out in place, on target they are the I2S DMA buffers themselves. Both
+// acquire calls block until the next frame period, the HAL is the media frame
+// clock.
+
+void lk_audio_hal_init(void);
+
+// Returns the oldest captured mono frame, or NULL on error. It may be
+// modified in place and is valid until the HAL captures
+// AUDIO_HAL_INPUT_FRAMES - 1 more frames, so it must be consumed promptly.
+int16_t *lk_audio_hal_acquire_input(void);
+
+// Returns the next interleaved stereo frame to be played. It is handed out
+// silent, fill it then call lk_audio_hal_commit_output. A silent frame can be
+// committed as is, and one that isn't committed in time plays as silence.
+int16_t *lk_audio_hal_acquire_output(void);
+void lk_audio_hal_commit_output(void);
+
+// Captured frames the HAL buffers for a late consumer. Adds no latency, they
+// are handed out as soon as they are complete
+#ifndef AUDIO_HAL_INPUT_FRAMES
+#define AUDIO_HAL_INPUT_FRAMES 6
+#endif
+
+// Playout latency of the HAL, a frame is played this long after it was
+// committed. A whole number of frames, at least two
+#ifndef AUDIO_HAL_OUTPUT_LATENCY_MS
+#define AUDIO_HAL_OUTPUT_LATENCY_MS 40
+#endif
+#define AUDIO_HAL_OUTPUT_FRAMES \
+  (AUDIO_HAL_OUTPUT_LATENCY_MS / AUDIO_FRAME_DURATION_MS + 1)
@@ -0,0 +1,247 @@
+#include "audio_hal.h"
+#include "driver/i2s_common.h"
+#include "driver/i2s_std.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "main.h"
+#include "metrics.h"
+
+static const char *TAG = "audio_hal";
+static i2s_chan_handle_t rx_chan;        // I2S rx channel handler
+static i2s_chan_handle_t tx_chan;        // I2S tx channel handler
+
+// Every DMA descriptor holds exactly one frame. The ISR callbacks pass
+// completed RX buffers and just-sent TX buffers to the media tasks, which
+// work on them in place instead of going through i2s_channel_read/write.
+//
+// The queues are one shorter than their ring, so a buffer in a queue is never
+// the one DMA is currently working on.
+static QueueHandle_t rx_frames;
+static QueueHandle_t tx_frames;
+static int16_t *tx_frame = NULL;
+
+// Frames the rx callback dropped. Only the ISR writes it, metrics aren't ISR
+// safe so lk_audio_hal_acquire_input folds the difference in from task context
+static volatile uint32_t capture_dropped = 0;
+static uint32_t capture_dropped_counted = 0;
+
+// Drops the oldest entry to make room, a late consumer loses the oldest
+// frame rather than the newest. Returns whether a task was woken
+static bool IRAM_ATTR lk_audio_hal_queue_from_isr(QueueHandle_t queue,
+                                                  void *dma_buf,
+                                                  bool *dropped) {
+  BaseType_t woken = pdFALSE;
+  void *oldest = NULL;
+  *dropped = xQueueIsQueueFullFromISR(queue) &&
+             xQueueReceiveFromISR(queue, &oldest, &woken) == pdTRUE;
+
+  xQueueSendFromISR(queue, &dma_buf, &woken);
+  return woken == pdTRUE;
+}
+
+static bool IRAM_ATTR lk_audio_hal_on_recv(i2s_chan_handle_t handle,
+                                           i2s_event_data_t *event,
+                                           void *user_ctx) {
+  bool dropped = false;
+  auto woken = lk_audio_hal_queue_from_isr(rx_frames, event->dma_buf, &dropped);
+  if (dropped) {
+    capture_dropped = capture_dropped + 1;
+  }
+  return woken;
+}
+
+// auto_clear zeroes the buffer after this returns, so a frame the playout
+// task doesn't fill in time is silence rather than a repeat
+static bool IRAM_ATTR lk_audio_hal_on_sent(i2s_chan_handle_t handle,
+                                           i2s_event_data_t *event,
+                                           void *user_ctx) {
+  bool dropped = false;
+  return lk_audio_hal_queue_from_isr(tx_frames, event->dma_buf, &dropped);
+}
+
+// Creates the queue the callbacks fill before registering them. A channel
+// without one is left disabled and its acquire call returns NULL
+static bool lk_audio_hal_register_callbacks(
+    i2s_chan_handle_t chan, QueueHandle_t *frames, UBaseType_t depth,
+    const i2s_event_callbacks_t *callbacks) {
+  *frames = xQueueCreate(depth, sizeof(int16_t *));
+  if (*frames == NULL) {
+    ESP_LOGE(TAG, "Failed to create frame queue");
+    return false;
+  }
+
+  ESP_ERROR_CHECK(i2s_channel_register_event_callback(chan, callbacks, NULL));
+  return true;
+}
+
+static void init_microphone_i2s(void)
+{
+    /* Configure I2S channel using settings from main.c */
+    i2s_chan_config_t chan_cfg = {
+        .id = I2S_NUM_1,
+        .role = I2S_ROLE_MASTER,
+        .dma_desc_num = AUDIO_HAL_INPUT_FRAMES,
+        .dma_frame_num = AUDIO_HAL_FRAME_SAMPLES,
+        .auto_clear = false,      // Match main.c (auto_clear = false)
+    };
+    
+    esp_err_t ret = i2s_new_channel(&chan_cfg, NULL, &rx_chan);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create I2S channel: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    /* Configure I2S standard mode using settings from main.c */
+    i2s_std_config_t std_cfg = {
+        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(AUDIO_HAL_SAMPLE_RATE),
+        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_MONO),
+        .gpio_cfg = {
+            .mclk = I2S_GPIO_UNUSED,
+            .bclk = GPIO_NUM_2,
+            .ws = GPIO_NUM_3,
+            .dout = I2S_GPIO_UNUSED,
+            .din = GPIO_NUM_5,
+            .invert_flags = {
+                .mclk_inv = false,
+                .bclk_inv = false,
+                .ws_inv = false,
+            },
+        },
+    };
+    
+    std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
+    
+    ret = i2s_channel_init_std_mode(rx_chan, &std_cfg);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize I2S channel in standard mode: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    i2s_event_callbacks_t callbacks = {
+        .on_recv = lk_audio_hal_on_recv,
+        .on_recv_q_ovf = NULL,
+        .on_sent = NULL,
+        .on_send_q_ovf = NULL,
+    };
+    if (!lk_audio_hal_register_callbacks(rx_chan, &rx_frames,
+                                         AUDIO_HAL_INPUT_FRAMES - 1,
+                                         &callbacks)) {
+        return;
+    }
+
+    /* Enable the RX channel */
+    ESP_ERROR_CHECK(i2s_channel_enable(rx_chan));
+    
+    ESP_LOGI(TAG, "I2S microphone initialized successfully");
+}
+
+static void init_speaker_i2s(void)
+{
+    i2s_chan_config_t chan_cfg = {
+        .id = I2S_NUM_0,
+        .role = I2S_ROLE_MASTER,
+        // A frame is filled in the buffer that was just sent, so the ring
+        // minus one frame is the playout latency on top of the jitter buffer
+        .dma_desc_num = AUDIO_HAL_OUTPUT_FRAMES,
+        .dma_frame_num = AUDIO_HAL_FRAME_SAMPLES,
+        .auto_clear = true,
+    };
+
+    esp_err_t ret = i2s_new_channel(&chan_cfg, &tx_chan, NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create I2S channel: %s", esp_err_to_name(ret));
+        return;
+    } 
+
+    /* Configure I2S standard mode using settings from main.c */
+    i2s_std_config_t std_cfg = {
+        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(AUDIO_HAL_SAMPLE_RATE),
+        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO),
+        .gpio_cfg = { 
+            .mclk = I2S_GPIO_UNUSED,
+            .bclk = GPIO_NUM_9,
+            .ws = GPIO_NUM_10,
+            .dout = GPIO_NUM_8,
+            .din = I2S_GPIO_UNUSED,
+            .invert_flags = {
+                .mclk_inv = false,
+                .bclk_inv = false,
+                .ws_inv = false,
+            },
+        },
+    };
+    
+    // Enable APLL for better audio quality if available
+    // Check header files for correct values before enabling
+#if defined(I2S_CLK_SRC_APLL)
+    std_cfg.clk_cfg.clk_src = I2S_CLK_SRC_APLL;
+#endif
+    
+    ret = i2s_channel_init_std_mode(tx_chan, &std_cfg);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize I2S channel in standard mode: %s", esp_err_to_name(ret)); 
+        return;
+    }
+
+    i2s_event_callbacks_t callbacks = {
+        .on_recv = NULL,
+        .on_recv_q_ovf = NULL,
+        .on_sent = lk_audio_hal_on_sent,
+        .on_send_q_ovf = NULL,
+    };
+    if (!lk_audio_hal_register_callbacks(tx_chan, &tx_frames,
+                                         AUDIO_HAL_OUTPUT_FRAMES - 1,
+                                         &callbacks)) {
+        return;
+    }
+
+    /* Enable the TX channel */
+    ESP_ERROR_CHECK(i2s_channel_enable(tx_chan)); 
+
+    ESP_LOGI(TAG, "I2S speaker initialized successfully");
+}
+
+void lk_audio_hal_init() {
+  init_microphone_i2s();
+  init_speaker_i2s();
+}
+
+int16_t *lk_audio_hal_acquire_input() {
+  // The channel failed to start, still keep the caller at the frame rate
+  if (rx_frames == NULL) {
+    vTaskDelay(pdMS_TO_TICKS(AUDIO_FRAME_DURATION_MS));
+    return NULL;
+  }
+
+  int16_t *frame = NULL;
+  if (xQueueReceive(rx_frames, &frame, portMAX_DELAY) != pdTRUE) {
+    return NULL;
+  }
+
+  uint32_t dropped = capture_dropped;
+  if (dropped != capture_dropped_counted) {
+    lk_metrics_count(LK_COUNTER_FRAMES_CAPTURE_DROPPED,
+                     dropped - capture_dropped_counted);
+    capture_dropped_counted = dropped;
+  }
+  lk_metrics_gauge_set(LK_GAUGE_CAPTURE_BACKLOG,
+                       uxQueueMessagesWaiting(rx_frames));
+  return frame;
+}
+
+int16_t *lk_audio_hal_acquire_output() {
+  if (tx_frames == NULL) {
+    vTaskDelay(pdMS_TO_TICKS(AUDIO_FRAME_DURATION_MS));
+    return NULL;
+  }
+  if (xQueueReceive(tx_frames, &tx_frame, portMAX_DELAY) != pdTRUE) {
+    return NULL;
+  }
+  return tx_frame;
+}
+
+// DMA picks the frame up from the ring on its own
+void lk_audio_hal_commit_output() {
+  tx_frame = NULL;
+}
@@ -0,0 +1,239 @@
+#include <esp_log.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio_hal.h"
+#include "main.h"
+
+#define LOG_TAG "audio_hal"
+
+// Without LK_AUDIO_INPUT the microphone is a tone, so the encoder does real
+// work
+#define TONE_FREQUENCY 440
+#define TONE_AMPLITUDE 8000
+
+#define WAV_HEADER_SIZE 44
+
+// The output WAV's sizes are patched about once a second and at exit, the
+// process is usually killed rather than shut down
+#define WAV_HEADER_UPDATE_FRAMES (1000 / AUDIO_FRAME_DURATION_MS)
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+static FILE *input_file = NULL;
+static long input_data_start = 0;
+static int input_channels = 1;
+static uint32_t tone_phase = 0;
+
+static FILE *output_file = NULL;
+static uint32_t output_data_size = 0;
+static int output_frames_unpatched = 0;
+
+// Input and output share an epoch, so the output WAV is sample aligned with
+// the input. Against a loopback peer the offset between the two is the end to
+// end latency
+static struct timespec capture_deadline;
+static struct timespec playout_deadline;
+
+static uint32_t read_le(const uint8_t *data, int size) {
+  uint32_t value = 0;
+  for (int i = size - 1; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static void write_le(uint8_t *data, uint32_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    data[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+// Positions file at the start of the samples of a 16 bit PCM WAV
+static int lk_wav_open_input(const char *path) {
+  input_file = fopen(path, "rb");
+  if (input_file == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to open %s", path);
+    return -1;
+  }
+
+  uint8_t header[12];
+  if (fread(header, 1, sizeof(header), input_file) != sizeof(header) ||
+      memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+    ESP_LOGE(LOG_TAG, "%s is not a WAV file", path);
+    return -1;
+  }
+
+  uint8_t chunk[8];
+  while (fread(chunk, 1, sizeof(chunk), input_file) == sizeof(chunk)) {
+    auto chunk_size = read_le(chunk + 4, 4);
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      uint8_t fmt[16];
+      if (chunk_size < sizeof(fmt) ||
+          fread(fmt, 1, sizeof(fmt), input_file) != sizeof(fmt)) {
+        break;
+      }
+      input_channels = read_le(fmt + 2, 2);
+      auto sample_rate = read_le(fmt + 4, 4);
+      auto bits_per_sample = read_le(fmt + 14, 2);
+      if (read_le(fmt, 2) != 1 || bits_per_sample != 16 ||
+          (input_channels != 1 && input_channels != 2)) {
+        ESP_LOGE(LOG_TAG, "%s must be 16 bit mono or stereo PCM", path);
+        return -1;
+      }
+      if (sample_rate != AUDIO_HAL_SAMPLE_RATE) {
+        ESP_LOGW(LOG_TAG, "%s is %d Hz, played as %d Hz", path,
+                 (int)sample_rate, AUDIO_HAL_SAMPLE_RATE);
+      }
+      fseek(input_file, chunk_size - sizeof(fmt) + (chunk_size & 1),
+            SEEK_CUR);
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      input_data_start = ftell(input_file);
+      return 0;
+    } else {
+      fseek(input_file, chunk_size + (chunk_size & 1), SEEK_CUR);
+    }
+  }
+
+  ESP_LOGE(LOG_TAG, "%s has no data chunk", path);
+  return -1;
+}
+
+static int lk_wav_open_output(const char *path) {
+  output_file = fopen(path, "wb");
+  if (output_file == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to open %s", path);
+    return -1;
+  }
+
+  uint8_t header[WAV_HEADER_SIZE] = {0};
+  memcpy(header, "RIFF", 4);
+  write_le(header + 4, WAV_HEADER_SIZE - 8, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  write_le(header + 16, 16, 4);
+  write_le(header + 20, 1, 2);  // PCM
+  write_le(header + 22, 2, 2);  // Stereo
+  write_le(header + 24, AUDIO_HAL_SAMPLE_RATE, 4);
+  write_le(header + 28, AUDIO_HAL_SAMPLE_RATE * 2 * sizeof(int16_t), 4);
+  write_le(header + 32, 2 * sizeof(int16_t), 2);
+  write_le(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  fwrite(header, 1, sizeof(header), output_file);
+  return 0;
+}
+
+static void lk_wav_update_output_sizes() {
+  uint8_t size[4];
+  write_le(size, WAV_HEADER_SIZE - 8 + output_data_size, 4);
+  fseek(output_file, 4, SEEK_SET);
+  fwrite(size, 1, sizeof(size), output_file);
+
+  write_le(size, output_data_size, 4);
+  fseek(output_file, WAV_HEADER_SIZE - 4, SEEK_SET);
+  fwrite(size, 1, sizeof(size), output_file);
+
+  fseek(output_file, 0, SEEK_END);
+  fflush(output_file);
+  output_frames_unpatched = 0;
+}
+
+static void lk_wav_close_output() {
+  if (output_file != NULL) {
+    lk_wav_update_output_sizes();
+    fclose(output_file);
+    output_file = NULL;
+  }
+}
+
+// Sleeps until the end of the period covered by samples
+static void lk_audio_hal_wait(struct timespec *deadline, size_t samples) {
+  deadline->tv_nsec += samples * NANOSECONDS_PER_SECOND / AUDIO_HAL_SAMPLE_RATE;
+  while (deadline->tv_nsec >= NANOSECONDS_PER_SECOND) {
+    deadline->tv_nsec -= NANOSECONDS_PER_SECOND;
+    deadline->tv_sec++;
+  }
+
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+}
+
+void lk_audio_hal_init() {
+  auto input_path = getenv("LK_AUDIO_INPUT");
+  if (input_path != NULL && lk_wav_open_input(input_path) != 0) {
+    if (input_file != NULL) {
+      fclose(input_file);
+      input_file = NULL;
+    }
+  }
+
+  auto output_path = getenv("LK_AUDIO_OUTPUT");
+  if (output_path != NULL && lk_wav_open_output(output_path) == 0) {
+    atexit(lk_wav_close_output);
+  }
+
+  ESP_LOGI(LOG_TAG, "Audio input: %s, output: %s",
+           input_file != NULL ? input_path : "tone",
+           output_file != NULL ? output_path : "discarded");
+
+  clock_gettime(CLOCK_MONOTONIC, &capture_deadline);
+  playout_deadline = capture_deadline;
+}
+
+int16_t *lk_audio_hal_acquire_input() {
+  // Handed out round robin, so like the DMA ring on target a frame stays
+  // valid for AUDIO_HAL_INPUT_FRAMES acquires
+  static int16_t frames[AUDIO_HAL_INPUT_FRAMES][AUDIO_HAL_FRAME_SAMPLES];
+  static int next_frame = 0;
+
+  auto frame = frames[next_frame];
+  next_frame = (next_frame + 1) % AUDIO_HAL_INPUT_FRAMES;
+  lk_audio_hal_wait(&capture_deadline, AUDIO_HAL_FRAME_SAMPLES);
+
+  if (input_file == NULL) {
+    for (size_t i = 0; i < AUDIO_HAL_FRAME_SAMPLES; i++, tone_phase++) {
+      frame[i] = (int16_t)(TONE_AMPLITUDE *
+                           sinf(2 * M_PI * TONE_FREQUENCY * tone_phase /
+                                AUDIO_HAL_SAMPLE_RATE));
+    }
+    tone_phase %= AUDIO_HAL_SAMPLE_RATE;
+    return frame;
+  }
+
+  int16_t sample[2];
+  for (size_t i = 0; i < AUDIO_HAL_FRAME_SAMPLES; i++) {
+    if (fread(sample, sizeof(int16_t), input_channels, input_file) !=
+        (size_t)input_channels) {
+      // Loop the file
+      fseek(input_file, input_data_start, SEEK_SET);
+      if (fread(sample, sizeof(int16_t), input_channels, input_file) !=
+          (size_t)input_channels) {
+        return NULL;
+      }
+    }
+
+    frame[i] = input_channels == 2 ? (sample[0] + sample[1]) / 2 : sample[0];
+  }
+
+  return frame;
+}
+
+static int16_t output_frame[AUDIO_HAL_FRAME_SAMPLES * 2];
+
+int16_t *lk_audio_hal_acquire_output() {
+  return output_frame;
+}
+
+void lk_audio_hal_commit_output() {
+  if (output_file != NULL) {
+    fwrite(output_frame, 2 * sizeof(int16_t), AUDIO_HAL_FRAME_SAMPLES,
+           output_file);
+    output_data_size += AUDIO_HAL_FRAME_SAMPLES * 2 * sizeof(int16_t);
+    if (++output_frames_unpatched >= WAV_HEADER_UPDATE_FRAMES) {
+      lk_wav_update_output_sizes();
+    }
+  }
+
+  memset(output_frame, 0, sizeof(output_frame));
+  lk_audio_hal_wait(&playout_deadline, AUDIO_HAL_FRAME_SAMPLES);
+}
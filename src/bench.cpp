@@ -0,0 +1,663 @@
+// Microbenchmarks of the hot paths, run with `src.elf bench` or the bench
+// build target. Every case is timed in batches of BENCH_BATCH operations and
+// reported as the fastest ns/op of BENCH_REPEATS runs, which is the least
+// disturbed by whatever else the machine is doing.
+//
+// Results are written as JSON. Given a baseline, which is the output of an
+// earlier run, a case slower than baseline * (1 + threshold) is a regression
+// and the exit status is 1.
+
+#include <cJSON.h>
+#include <esp_log.h>
+#include <livekit_rtc.pb-c.h>
+#include <math.h>
+#include <opus.h>
+#include <srtp2/srtp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "opus_profile.h"
+#include "session.h"
+#include "srtp_crypto.h"
+
+#define LOG_TAG "bench"
+
+#define BENCH_BATCH 1024
+#define BENCH_REPEATS 5
+#define BENCH_MIN_TIME_NS 100000000LL
+#define BENCH_MAX_CASES 16
+#define BENCH_DEFAULT_THRESHOLD 0.25
+
+// One second of audio is encoded in a loop, and its packets decoded
+#define BENCH_AUDIO_FRAMES (1000 / AUDIO_FRAME_DURATION_MS)
+#define BENCH_AUDIO_SAMPLES (BENCH_AUDIO_FRAMES * AUDIO_FRAME_SAMPLES)
+#define BENCH_OPUS_PACKET_SIZE 1276
+
+// An Opus packet of the voice profile behind an RTP header
+#define BENCH_RTP_HEADER_SIZE 12
+#define BENCH_RTP_PAYLOAD_SIZE 80
+#define BENCH_RTP_SIZE (BENCH_RTP_HEADER_SIZE + BENCH_RTP_PAYLOAD_SIZE)
+#define BENCH_SRTP_SIZE (BENCH_RTP_SIZE + SRTP_MAX_TRAILER_LEN)
+
+// What LiveKit offers the subscriber once a remote participant publishes a
+// microphone, and what libpeer generates as its local description
+static const char *bench_remote_offer =
+    "v=0\r\n"
+    "o=- 4215775240449105457 1700000000 IN IP4 0.0.0.0\r\n"
+    "s=-\r\n"
+    "t=0 0\r\n"
+    "a=msid-semantic:WMS*\r\n"
+    "a=fingerprint:sha-256 "
+    "1B:4E:6C:A2:31:9F:77:D0:5A:E8:13:C4:92:0B:6F:3D:"
+    "88:A1:5C:E7:24:90:FB:36:0D:C9:72:4A:BE:11:65:F3\r\n"
+    "a=ice-lite\r\n"
+    "a=extmap-allow-mixed\r\n"
+    "a=group:BUNDLE 0 1\r\n"
+    "m=audio 9 UDP/TLS/RTP/SAVPF 111 63\r\n"
+    "c=IN IP4 0.0.0.0\r\n"
+    "a=setup:actpass\r\n"
+    "a=mid:0\r\n"
+    "a=ice-ufrag:vQhGxJrPaTcKdWsE\r\n"
+    "a=ice-pwd:TnMfKqZbXwLrYcVdHsJgPeAuBiOkNm\r\n"
+    "a=rtcp-mux\r\n"
+    "a=rtcp-rsize\r\n"
+    "a=rtpmap:111 opus/48000/2\r\n"
+    "a=fmtp:111 minptime=10;useinbandfec=1\r\n"
+    "a=rtcp-fb:111 transport-cc\r\n"
+    "a=rtpmap:63 red/48000/2\r\n"
+    "a=fmtp:63 111/111\r\n"
+    "a=extmap:1 urn:ietf:params:rtp-hdrext:ssrc-audio-level\r\n"
+    "a=extmap:3 http://www.ietf.org/id/"
+    "draft-holmer-rmcat-transport-wide-cc-extensions-01\r\n"
+    "a=ssrc:3735928559 cname:PA_8xKq2mZ\r\n"
+    "a=ssrc:3735928559 msid:PA_8xKq2mZ TR_AMx3Rk7wQ\r\n"
+    "a=msid:PA_8xKq2mZ TR_AMx3Rk7wQ\r\n"
+    "a=sendonly\r\n"
+    "a=candidate:1028483921 1 udp 2130706431 203.0.113.10 7882 typ host\r\n"
+    "a=candidate:2443162843 1 tcp 1671430143 203.0.113.10 7881 typ host "
+    "tcptype passive\r\n"
+    "a=end-of-candidates\r\n"
+    "m=application 9 UDP/DTLS/SCTP webrtc-datachannel\r\n"
+    "c=IN IP4 0.0.0.0\r\n"
+    "a=setup:actpass\r\n"
+    "a=mid:1\r\n"
+    "a=sendrecv\r\n"
+    "a=sctp-port:5000\r\n"
+    "a=ice-ufrag:vQhGxJrPaTcKdWsE\r\n"
+    "a=ice-pwd:TnMfKqZbXwLrYcVdHsJgPeAuBiOkNm\r\n";
+
+static const char *bench_local_description =
+    "v=0\r\n"
+    "o=- 1495799811084970 1495799811084970 IN IP4 0.0.0.0\r\n"
+    "s=-\r\n"
+    "t=0 0\r\n"
+    "a=group:BUNDLE datachannel\r\n"
+    "m=application 50712 UDP/DTLS/SCTP webrtc-datachannel\r\n"
+    "c=IN IP4 0.0.0.0\r\n"
+    "a=ice-ufrag:h3Kp\r\n"
+    "a=ice-pwd:Qz8vR2mXc5LbN7tYw1EoUa\r\n"
+    "a=fingerprint:sha-256 "
+    "C4:07:5E:92:AB:3F:68:D1:20:7C:E5:49:B3:0A:F6:18:"
+    "5D:E2:94:6B:C0:37:8F:A4:11:D9:62:2E:B7:05:7A:CC\r\n"
+    "a=setup:passive\r\n"
+    "a=mid:datachannel\r\n"
+    "a=sctp-port:5000\r\n"
+    "a=max-message-size:262144\r\n"
+    "a=candidate:1 1 UDP 2130706431 192.168.1.20 50712 typ host\r\n";
+
+typedef struct {
+  const char *name;
+  // Untimed, runs before every batch
+  void (*prepare)(void *arg);
+  // Operation i of the batch. Returns 0 on success
+  int (*run)(void *arg, int i);
+  void *arg;
+} lk_bench_case;
+
+typedef struct {
+  const lk_opus_profile *profile;
+  OpusEncoder *encoder;
+  OpusDecoder *decoder;
+  int packet_samples;
+  int packet_count;
+  uint8_t packets[BENCH_AUDIO_FRAMES][BENCH_OPUS_PACKET_SIZE];
+  opus_int32 packet_sizes[BENCH_AUDIO_FRAMES];
+} lk_bench_opus;
+
+static lk_bench_case bench_cases[BENCH_MAX_CASES];
+static int bench_case_count = 0;
+
+static opus_int16 bench_pcm[BENCH_AUDIO_SAMPLES];
+static opus_int16 bench_decoded[AUDIO_MAX_PACKET_SAMPLES];
+static uint8_t bench_encoded[BENCH_OPUS_PACKET_SIZE];
+static lk_bench_opus bench_opus[LK_OPUS_PROFILE_COUNT];
+
+static lk_session *bench_session;
+static uint8_t *bench_signal_response;
+static size_t bench_signal_response_size;
+static Livekit__SignalRequest bench_signal_request;
+static Livekit__SessionDescription bench_answer;
+
+// The same packets protected and unprotected by each SRTP crypto
+typedef struct {
+  const char *name;
+  lk_srtp_crypto crypto;
+  srtp_t sender;
+  srtp_t receiver;
+  uint16_t sequence;
+} lk_bench_srtp;
+
+static lk_bench_srtp bench_srtp[] = {
+    {"software", LK_SRTP_CRYPTO_SOFTWARE},
+    {"mbedtls", LK_SRTP_CRYPTO_MBEDTLS},
+};
+
+#define BENCH_SRTP_COUNT (int)(sizeof(bench_srtp) / sizeof(bench_srtp[0]))
+
+static unsigned char bench_srtp_key[SRTP_MASTER_KEY_LEN];
+static uint8_t bench_rtp[BENCH_RTP_SIZE];
+static uint8_t bench_srtp_packet[BENCH_SRTP_SIZE];
+static uint8_t bench_srtp_protected[BENCH_BATCH][BENCH_SRTP_SIZE];
+static int bench_srtp_protected_sizes[BENCH_BATCH];
+static uint8_t bench_srtp_packets[BENCH_BATCH][BENCH_SRTP_SIZE];
+
+static int64_t lk_bench_clock_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int64_t lk_bench_now_ns() {
+  return lk_bench_clock_ns(CLOCK_MONOTONIC);
+}
+
+static void lk_bench_add(const char *name, void (*prepare)(void *),
+                         int (*run)(void *, int), void *arg) {
+  if (bench_case_count < BENCH_MAX_CASES) {
+    bench_cases[bench_case_count++] = {name, prepare, run, arg};
+  }
+}
+
+// Voiced speech stand-in: harmonics of a 140Hz pitch, amplitude modulated at
+// syllable rate, over a little noise. Silence would let DTX skip the encoder
+static void lk_bench_generate_pcm() {
+  uint32_t noise = 1;
+  for (int i = 0; i < BENCH_AUDIO_SAMPLES; i++) {
+    auto t = (float)i / SAMPLE_RATE;
+    auto envelope = 0.55f + 0.45f * sinf(2 * (float)M_PI * 4 * t);
+    float sample = 0;
+    for (int harmonic = 1; harmonic <= 8; harmonic++) {
+      sample += sinf(2 * (float)M_PI * 140 * harmonic * t) / harmonic;
+    }
+    noise = noise * 1664525 + 1013904223;
+    sample = sample * envelope * 6000 + (int16_t)(noise >> 16) / 64;
+    bench_pcm[i] = (opus_int16)sample;
+  }
+}
+
+static int lk_bench_opus_init(lk_bench_opus *opus,
+                              const lk_opus_profile *profile) {
+  int error = OPUS_OK;
+  opus->profile = profile;
+  opus->encoder =
+      opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &error);
+  if (error != OPUS_OK) {
+    return -1;
+  }
+  // Configured like lk_init_audio_encoder
+  opus_encoder_ctl(opus->encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+  if (lk_opus_profile_apply(opus->encoder, profile) != 0) {
+    return -1;
+  }
+
+  opus->decoder = opus_decoder_create(SAMPLE_RATE, 1, &error);
+  if (error != OPUS_OK) {
+    return -1;
+  }
+
+  // The decode case replays what this encoder produces for the signal
+  opus->packet_samples = AUDIO_FRAME_SAMPLES;
+  opus->packet_count = BENCH_AUDIO_SAMPLES / opus->packet_samples;
+  for (int i = 0; i < opus->packet_count; i++) {
+    opus->packet_sizes[i] =
+        opus_encode(opus->encoder, bench_pcm + i * opus->packet_samples,
+                    opus->packet_samples, opus->packets[i],
+                    BENCH_OPUS_PACKET_SIZE);
+    if (opus->packet_sizes[i] < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int lk_bench_opus_encode(void *arg, int i) {
+  auto opus = (lk_bench_opus *)arg;
+  auto offset = (i % opus->packet_count) * opus->packet_samples;
+  return opus_encode(opus->encoder, bench_pcm + offset, opus->packet_samples,
+                     bench_encoded, BENCH_OPUS_PACKET_SIZE) < 0;
+}
+
+static int lk_bench_opus_decode(void *arg, int i) {
+  auto opus = (lk_bench_opus *)arg;
+  auto packet = i % opus->packet_count;
+  return opus_decode(opus->decoder, opus->packets[packet],
+                     opus->packet_sizes[packet], bench_decoded,
+                     AUDIO_MAX_PACKET_SAMPLES, 0) < 0;
+}
+
+// The same path the websocket handler takes for every message
+static int lk_bench_signal_response_unpack(void *arg, int i) {
+  auto response = livekit__signal_response__unpack(
+      &bench_session->signal_response_allocator, bench_signal_response_size,
+      bench_signal_response);
+  if (response == NULL) {
+    return -1;
+  }
+  livekit__signal_response__free_unpacked(
+      response, &bench_session->signal_response_allocator);
+  lk_arena_reset(&bench_session->signal_response_arena);
+  return 0;
+}
+
+static int lk_bench_signal_request_pack(void *arg, int i) {
+  return lk_pack_signal_request(bench_session, &bench_signal_request) == 0;
+}
+
+static int lk_bench_populate_answer(void *arg, int i) {
+  return lk_populate_answer(bench_session) < 0;
+}
+
+static int lk_bench_signaling_init() {
+  bench_session = lk_session_create("", "", /* media */ false);
+  if (bench_session == NULL) {
+    return -1;
+  }
+  bench_session->subscriber_remote_offer = (char *)bench_remote_offer;
+  bench_session->subscriber_local_description =
+      (char *)bench_local_description;
+  if (lk_populate_answer(bench_session) < 0) {
+    return -1;
+  }
+
+  Livekit__SessionDescription offer = LIVEKIT__SESSION_DESCRIPTION__INIT;
+  offer.type = (char *)"offer";
+  offer.sdp = (char *)bench_remote_offer;
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_OFFER;
+  response.offer = &offer;
+  bench_signal_response_size =
+      livekit__signal_response__get_packed_size(&response);
+  bench_signal_response = (uint8_t *)malloc(bench_signal_response_size);
+  if (bench_signal_response == NULL) {
+    return -1;
+  }
+  livekit__signal_response__pack(&response, bench_signal_response);
+
+  bench_answer = LIVEKIT__SESSION_DESCRIPTION__INIT;
+  bench_answer.type = (char *)"answer";
+  bench_answer.sdp = bench_session->answer_buffer;
+  bench_signal_request = LIVEKIT__SIGNAL_REQUEST__INIT;
+  bench_signal_request.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_ANSWER;
+  bench_signal_request.answer = &bench_answer;
+  return 0;
+}
+
+// Sessions keep the crypto they were created with
+static int lk_bench_srtp_create(lk_srtp_crypto crypto, srtp_t *srtp,
+                                srtp_ssrc_type_t type) {
+  if (lk_srtp_crypto_use(crypto) != 0) {
+    return -1;
+  }
+
+  srtp_policy_t policy = {};
+  srtp_crypto_policy_set_rtp_default(&policy.rtp);
+  srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+  policy.ssrc.type = type;
+  policy.key = bench_srtp_key;
+  return srtp_create(srtp, &policy) == srtp_err_status_ok ? 0 : -1;
+}
+
+static void lk_bench_rtp_sequence(uint8_t *rtp, uint16_t sequence) {
+  rtp[2] = sequence >> 8;
+  rtp[3] = sequence & 0xff;
+}
+
+// Protecting checks the sequence number against replay, so every packet is
+// the next one. Copying the packet in is part of the timed operation
+static int lk_bench_srtp_protect(void *arg, int i) {
+  auto srtp = (lk_bench_srtp *)arg;
+  memcpy(bench_srtp_packet, bench_rtp, BENCH_RTP_SIZE);
+  lk_bench_rtp_sequence(bench_srtp_packet, srtp->sequence++);
+  int size = BENCH_RTP_SIZE;
+  return srtp_protect(srtp->sender, bench_srtp_packet, &size) !=
+         srtp_err_status_ok;
+}
+
+// A new receiver for every batch, it would reject the replayed packets
+static void lk_bench_srtp_unprotect_prepare(void *arg) {
+  auto srtp = (lk_bench_srtp *)arg;
+  if (srtp->receiver != NULL) {
+    srtp_dealloc(srtp->receiver);
+    srtp->receiver = NULL;
+  }
+  lk_bench_srtp_create(srtp->crypto, &srtp->receiver, ssrc_any_inbound);
+  memcpy(bench_srtp_packets, bench_srtp_protected,
+         sizeof(bench_srtp_packets));
+}
+
+static int lk_bench_srtp_unprotect(void *arg, int i) {
+  auto srtp = (lk_bench_srtp *)arg;
+  int size = bench_srtp_protected_sizes[i];
+  return srtp->receiver == NULL ||
+         srtp_unprotect(srtp->receiver, bench_srtp_packets[i], &size) !=
+             srtp_err_status_ok;
+}
+
+// Protects the batch of consecutive packets the unprotect case replays, each
+// crypto must produce the same bytes
+static int lk_bench_srtp_protect_batch(lk_srtp_crypto crypto) {
+  srtp_t sender;
+  if (lk_bench_srtp_create(crypto, &sender, ssrc_any_outbound) != 0) {
+    return -1;
+  }
+
+  auto software = crypto == LK_SRTP_CRYPTO_SOFTWARE;
+  int failed = 0;
+  for (int i = 0; i < BENCH_BATCH && !failed; i++) {
+    memcpy(bench_srtp_packet, bench_rtp, BENCH_RTP_SIZE);
+    lk_bench_rtp_sequence(bench_srtp_packet, i);
+    int size = BENCH_RTP_SIZE;
+    failed = srtp_protect(sender, bench_srtp_packet, &size) !=
+             srtp_err_status_ok;
+    if (software) {
+      memcpy(bench_srtp_protected[i], bench_srtp_packet, size);
+      bench_srtp_protected_sizes[i] = size;
+    } else if (!failed) {
+      failed = size != bench_srtp_protected_sizes[i] ||
+               memcmp(bench_srtp_protected[i], bench_srtp_packet, size) != 0;
+    }
+  }
+  srtp_dealloc(sender);
+  return failed ? -1 : 0;
+}
+
+static int lk_bench_srtp_init() {
+  for (size_t i = 0; i < sizeof(bench_srtp_key); i++) {
+    bench_srtp_key[i] = (unsigned char)(i * 7 + 1);
+  }
+
+  // RTP version 2, Opus payload type 111, then the payload
+  bench_rtp[0] = 0x80;
+  bench_rtp[1] = 111;
+  bench_rtp[8] = 0xde;
+  bench_rtp[9] = 0xad;
+  bench_rtp[10] = 0xbe;
+  bench_rtp[11] = 0xef;
+  for (int i = BENCH_RTP_HEADER_SIZE; i < BENCH_RTP_SIZE; i++) {
+    bench_rtp[i] = (uint8_t)(i * 31);
+  }
+
+  if (srtp_init() != srtp_err_status_ok) {
+    return -1;
+  }
+  for (int i = 0; i < BENCH_SRTP_COUNT; i++) {
+    if (lk_bench_srtp_protect_batch(bench_srtp[i].crypto) != 0) {
+      ESP_LOGE(LOG_TAG, "SRTP %s doesn't match", bench_srtp[i].name);
+      return -1;
+    }
+    if (lk_bench_srtp_create(bench_srtp[i].crypto, &bench_srtp[i].sender,
+                             ssrc_any_outbound) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int lk_bench_init() {
+  lk_bench_generate_pcm();
+  for (int i = 0; i < LK_OPUS_PROFILE_COUNT; i++) {
+    auto profile = lk_opus_profile_get((lk_opus_profile_id)i);
+    if (lk_bench_opus_init(&bench_opus[i], profile) != 0) {
+      ESP_LOGE(LOG_TAG, "Failed to set up Opus %s", profile->name);
+      return -1;
+    }
+  }
+  if (lk_bench_signaling_init() != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to set up signaling");
+    return -1;
+  }
+  if (lk_bench_srtp_init() != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to set up SRTP");
+    return -1;
+  }
+
+  // Names are kept for the lifetime of the process
+  for (int i = 0; i < LK_OPUS_PROFILE_COUNT; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "opus_encode/%s", bench_opus[i].profile->name);
+    lk_bench_add(strdup(name), NULL, lk_bench_opus_encode, &bench_opus[i]);
+  }
+  for (int i = 0; i < LK_OPUS_PROFILE_COUNT; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "opus_decode/%s", bench_opus[i].profile->name);
+    lk_bench_add(strdup(name), NULL, lk_bench_opus_decode, &bench_opus[i]);
+  }
+  lk_bench_add("signal_response_unpack/offer", NULL,
+               lk_bench_signal_response_unpack, NULL);
+  lk_bench_add("signal_request_pack/answer", NULL,
+               lk_bench_signal_request_pack, NULL);
+  lk_bench_add("populate_answer", NULL, lk_bench_populate_answer, NULL);
+  for (int i = 0; i < BENCH_SRTP_COUNT; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "srtp_protect/%s", bench_srtp[i].name);
+    lk_bench_add(strdup(name), NULL, lk_bench_srtp_protect, &bench_srtp[i]);
+  }
+  for (int i = 0; i < BENCH_SRTP_COUNT; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "srtp_unprotect/%s", bench_srtp[i].name);
+    lk_bench_add(strdup(name), lk_bench_srtp_unprotect_prepare,
+                 lk_bench_srtp_unprotect, &bench_srtp[i]);
+  }
+  return 0;
+}
+
+// Returns the fastest ns/op of BENCH_REPEATS runs, or -1 if an operation
+// failed. cpu_ns_per_op is the CPU time of that run, which includes prepare
+static double lk_bench_measure(const lk_bench_case *bench_case,
+                               double *cpu_ns_per_op) {
+  auto batch = [&]() -> int64_t {
+    if (bench_case->prepare != NULL) {
+      bench_case->prepare(bench_case->arg);
+    }
+    int failed = 0;
+    auto start = lk_bench_now_ns();
+    for (int i = 0; i < BENCH_BATCH; i++) {
+      failed |= bench_case->run(bench_case->arg, i);
+    }
+    auto elapsed = lk_bench_now_ns() - start;
+    return failed ? -1 : elapsed;
+  };
+
+  // Warm up caches and branch predictors
+  if (batch() < 0) {
+    return -1;
+  }
+
+  double fastest = 0;
+  for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+    int64_t elapsed = 0;
+    int64_t operations = 0;
+    auto cpu_start = lk_bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    while (elapsed < BENCH_MIN_TIME_NS) {
+      auto batch_elapsed = batch();
+      if (batch_elapsed < 0) {
+        return -1;
+      }
+      elapsed += batch_elapsed;
+      operations += BENCH_BATCH;
+    }
+
+    auto cpu = lk_bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    auto ns_per_op = (double)elapsed / operations;
+    if (repeat == 0 || ns_per_op < fastest) {
+      fastest = ns_per_op;
+      *cpu_ns_per_op = (double)cpu / operations;
+    }
+  }
+  return fastest;
+}
+
+// Caller frees. NULL if the file can't be read
+static char *lk_bench_read_file(const char *path) {
+  auto file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  char *content = NULL;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    auto size = ftell(file);
+    content = size >= 0 ? (char *)malloc(size + 1) : NULL;
+    if (content != NULL) {
+      rewind(file);
+      content[fread(content, 1, size, file)] = '\0';
+    }
+  }
+  fclose(file);
+  return content;
+}
+
+static double lk_bench_baseline(const cJSON *baseline, const char *name) {
+  auto benchmarks = cJSON_GetObjectItem(baseline, "benchmarks");
+  if (!cJSON_IsArray(benchmarks)) {
+    return 0;
+  }
+
+  const cJSON *benchmark;
+  cJSON_ArrayForEach(benchmark, benchmarks) {
+    auto benchmark_name = cJSON_GetObjectItem(benchmark, "name");
+    auto ns_per_op = cJSON_GetObjectItem(benchmark, "ns_per_op");
+    if (cJSON_IsString(benchmark_name) && cJSON_IsNumber(ns_per_op) &&
+        strcmp(benchmark_name->valuestring, name) == 0) {
+      return ns_per_op->valuedouble;
+    }
+  }
+  return 0;
+}
+
+static void lk_bench_usage() {
+  fprintf(stderr,
+          "usage: src.elf bench [--baseline FILE] [--output FILE] "
+          "[--threshold RATIO] [--filter SUBSTRING]\n");
+}
+
+int lk_bench_main(int argc, char **argv) {
+  const char *baseline_path = NULL;
+  const char *output_path = NULL;
+  const char *filter = NULL;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 == argc) {
+      lk_bench_usage();
+      return 2;
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--output") == 0) {
+      output_path = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      threshold = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0) {
+      filter = argv[++i];
+    } else {
+      lk_bench_usage();
+      return 2;
+    }
+  }
+
+  // Building an answer logs every media section
+  esp_log_level_set("*", ESP_LOG_WARN);
+
+  cJSON *baseline = NULL;
+  if (baseline_path != NULL) {
+    auto content = lk_bench_read_file(baseline_path);
+    baseline = content != NULL ? cJSON_Parse(content) : NULL;
+    free(content);
+    if (baseline == NULL) {
+      ESP_LOGW(LOG_TAG, "No baseline in %s, nothing is compared",
+               baseline_path);
+    }
+  }
+
+  if (lk_bench_init() != 0) {
+    return 2;
+  }
+
+  auto results = cJSON_CreateObject();
+  cJSON_AddNumberToObject(results, "threshold", threshold);
+  auto benchmarks = cJSON_AddArrayToObject(results, "benchmarks");
+  int regressions = 0;
+  int failures = 0;
+
+  for (int i = 0; i < bench_case_count; i++) {
+    auto bench_case = &bench_cases[i];
+    if (filter != NULL && strstr(bench_case->name, filter) == NULL) {
+      continue;
+    }
+
+    double cpu_ns_per_op = 0;
+    auto ns_per_op = lk_bench_measure(bench_case, &cpu_ns_per_op);
+    if (ns_per_op < 0) {
+      ESP_LOGE(LOG_TAG, "%s failed", bench_case->name);
+      failures++;
+      continue;
+    }
+
+    auto result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "name", bench_case->name);
+    cJSON_AddNumberToObject(result, "ns_per_op", ns_per_op);
+    cJSON_AddNumberToObject(result, "ops_per_second", 1e9 / ns_per_op);
+    cJSON_AddNumberToObject(result, "cpu_ns_per_op", cpu_ns_per_op);
+
+    printf("%-32s %12.1f ns/op %12.1f cpu", bench_case->name, ns_per_op,
+           cpu_ns_per_op);
+    auto baseline_ns_per_op = lk_bench_baseline(baseline, bench_case->name);
+    if (baseline_ns_per_op > 0) {
+      auto ratio = ns_per_op / baseline_ns_per_op;
+      auto regressed = ratio > 1 + threshold;
+      regressions += regressed;
+      cJSON_AddNumberToObject(result, "baseline_ns_per_op", baseline_ns_per_op);
+      cJSON_AddNumberToObject(result, "ratio", ratio);
+      cJSON_AddBoolToObject(result, "regressed", regressed);
+      printf(" %12.1f baseline %6.2fx%s", baseline_ns_per_op, ratio,
+             regressed ? "  REGRESSED" : "");
+    }
+    printf("\n");
+    cJSON_AddItemToArray(benchmarks, result);
+  }
+
+  auto json = cJSON_Print(results);
+  if (output_path != NULL && json != NULL) {
+    auto file = fopen(output_path, "w");
+    if (file == NULL || fputs(json, file) < 0) {
+      ESP_LOGE(LOG_TAG, "Failed to write %s", output_path);
+      failures++;
+    }
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+  free(json);
+  cJSON_Delete(results);
+  cJSON_Delete(baseline);
+
+  if (regressions > 0) {
+    ESP_LOGE(LOG_TAG, "%d benchmarks regressed more than %.0f%%", regressions,
+             threshold * 100);
+    return 1;
+  }
+  return failures > 0 ? 2 : 0;
+}
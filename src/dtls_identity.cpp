@@ -0,0 +1,198 @@
+#include "dtls_identity.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <mbedtls/ecp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+
+#ifdef LINUX_BUILD
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <nvs.h>
+#endif
+
+#define LOG_TAG "dtls_identity"
+
+// The link wraps the key generation (-Wl,--wrap=mbedtls_ecp_gen_key, see
+// CMakeLists.txt) so that one P-256 key is generated once, persisted, and
+// reused by both PeerConnections and across boots. libpeer still self signs a
+// fresh certificate for it every time, that is a single ECDSA signature.
+//
+// The wrap covers the whole link, so it only substitutes the key inside an
+// lk_dtls_identity_begin scope. Anything else, ECDHE in particular, must get a
+// fresh key or it loses forward secrecy.
+
+// Boots a key is reused for before a new one is generated
+#ifndef LK_DTLS_IDENTITY_ROTATE_BOOTS
+#define LK_DTLS_IDENTITY_ROTATE_BOOTS 100
+#endif
+
+#define DTLS_IDENTITY_VERSION 1
+#define DTLS_IDENTITY_KEY_SIZE 32
+
+#define DTLS_IDENTITY_NVS_NAMESPACE "lk_dtls"
+#define DTLS_IDENTITY_NVS_KEY "identity"
+
+// On Linux the identity is kept in this file, LK_DTLS_IDENTITY overrides it
+#define DTLS_IDENTITY_FILE "dtls_identity.bin"
+
+typedef struct {
+  uint32_t version;
+  uint32_t boots;        // since the key was generated
+  uint32_t generate_ms;  // what generating it cost, reported when reused
+  uint8_t key[DTLS_IDENTITY_KEY_SIZE];
+} lk_dtls_identity;
+
+// Every session creates PeerConnections on its own thread, the identity and
+// its file or NVS entry are only touched with identity_mutex held
+static std::mutex identity_mutex;
+static lk_dtls_identity identity;
+static bool identity_loaded = false;
+static thread_local bool identity_scope = false;
+
+extern "C" int __real_mbedtls_ecp_gen_key(
+    mbedtls_ecp_group_id grp_id, mbedtls_ecp_keypair *key,
+    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+
+#ifdef LINUX_BUILD
+static const char *lk_dtls_identity_path() {
+  auto path = getenv("LK_DTLS_IDENTITY");
+  return path != NULL ? path : DTLS_IDENTITY_FILE;
+}
+
+static bool lk_dtls_identity_read(lk_dtls_identity *out) {
+  auto file = fopen(lk_dtls_identity_path(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+
+  auto read = fread(out, 1, sizeof(*out), file);
+  fclose(file);
+  return read == sizeof(*out);
+}
+
+// It holds the private key, only the owner may read it
+static void lk_dtls_identity_write(const lk_dtls_identity *in) {
+  auto fd = open(lk_dtls_identity_path(), O_CREAT | O_WRONLY | O_TRUNC, 0600);
+  if (fd < 0 || fchmod(fd, 0600) != 0 ||
+      write(fd, in, sizeof(*in)) != (ssize_t)sizeof(*in)) {
+    ESP_LOGW(LOG_TAG, "Failed to write %s", lk_dtls_identity_path());
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+#else
+static bool lk_dtls_identity_read(lk_dtls_identity *out) {
+  nvs_handle_t handle;
+  if (nvs_open(DTLS_IDENTITY_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+
+  size_t size = sizeof(*out);
+  auto err = nvs_get_blob(handle, DTLS_IDENTITY_NVS_KEY, out, &size);
+  nvs_close(handle);
+  return err == ESP_OK && size == sizeof(*out);
+}
+
+static void lk_dtls_identity_write(const lk_dtls_identity *in) {
+  nvs_handle_t handle;
+  if (nvs_open(DTLS_IDENTITY_NVS_NAMESPACE, NVS_READWRITE, &handle) !=
+      ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to open NVS, identity not persisted");
+    return;
+  }
+
+  if (nvs_set_blob(handle, DTLS_IDENTITY_NVS_KEY, in, sizeof(*in)) !=
+          ESP_OK ||
+      nvs_commit(handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to persist identity");
+  }
+  nvs_close(handle);
+}
+#endif
+
+// Loads the persisted key once per boot and counts the boot against it
+static bool lk_dtls_identity_load() {
+  if (identity_loaded) {
+    return true;
+  }
+
+  if (!lk_dtls_identity_read(&identity) ||
+      identity.version != DTLS_IDENTITY_VERSION) {
+    return false;
+  }
+
+  if (++identity.boots > LK_DTLS_IDENTITY_ROTATE_BOOTS) {
+    ESP_LOGI(LOG_TAG, "Rotating identity after %lu boots",
+             (unsigned long)identity.boots - 1);
+    return false;
+  }
+
+  lk_dtls_identity_write(&identity);
+  identity_loaded = true;
+  return true;
+}
+
+void lk_dtls_identity_begin(void) {
+  identity_scope = true;
+}
+
+void lk_dtls_identity_end(void) {
+  identity_scope = false;
+}
+
+extern "C" int __wrap_mbedtls_ecp_gen_key(
+    mbedtls_ecp_group_id grp_id, mbedtls_ecp_keypair *key,
+    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng) {
+  if (!identity_scope || grp_id != MBEDTLS_ECP_DP_SECP256R1) {
+    return __real_mbedtls_ecp_gen_key(grp_id, key, f_rng, p_rng);
+  }
+
+  // A second session waits for the first one's key instead of generating
+  std::lock_guard<std::mutex> lock(identity_mutex);
+  if (lk_dtls_identity_load()) {
+    auto start_us = esp_timer_get_time();
+    if (mbedtls_ecp_read_key(grp_id, key, identity.key,
+                             sizeof(identity.key)) == 0 &&
+        mbedtls_ecp_keypair_calc_public(key, f_rng, p_rng) == 0) {
+      ESP_LOGI(LOG_TAG, "Reused identity in %lld ms, saved %lu ms",
+               (long long)(esp_timer_get_time() - start_us) / 1000,
+               (unsigned long)identity.generate_ms);
+      return 0;
+    }
+
+    ESP_LOGW(LOG_TAG, "Persisted identity is invalid, generating");
+    identity_loaded = false;
+  }
+
+  auto start_us = esp_timer_get_time();
+  auto ret = __real_mbedtls_ecp_gen_key(grp_id, key, f_rng, p_rng);
+  if (ret != 0) {
+    return ret;
+  }
+
+  size_t length = 0;
+  memset(&identity, 0, sizeof(identity));
+  identity.version = DTLS_IDENTITY_VERSION;
+  identity.boots = 1;
+  identity.generate_ms = (esp_timer_get_time() - start_us) / 1000;
+  if (mbedtls_ecp_write_key_ext(key, &length, identity.key,
+                                sizeof(identity.key)) != 0 ||
+      length != sizeof(identity.key)) {
+    ESP_LOGW(LOG_TAG, "Failed to export identity, not persisted");
+    return 0;
+  }
+
+  ESP_LOGI(LOG_TAG, "Generated identity in %lu ms",
+           (unsigned long)identity.generate_ms);
+  lk_dtls_identity_write(&identity);
+  identity_loaded = true;
+  return 0;
+}
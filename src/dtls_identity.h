@@ -0,0 +1,9 @@
+#pragma once
+
+// libpeer generates a new DTLS key for every PeerConnection it creates. Key
+// generation between lk_dtls_identity_begin and lk_dtls_identity_end on the
+// same thread reuses one persisted P-256 key instead, see dtls_identity.cpp.
+// Every other key, such as TLS ECDHE for the signaling websocket, is generated
+// as usual.
+void lk_dtls_identity_begin(void);
+void lk_dtls_identity_end(void);
@@ -0,0 +1,75 @@
+#include "frame_queue.h"
+
+#include <esp_log.h>
+
+#include "mem_budget.h"
+
+#define LOG_TAG "frame_queue"
+
+int lk_frame_queue_init(lk_frame_queue *q, uint32_t capacity,
+                        uint32_t frame_size) {
+  // Power of two capacity keeps slot indices continuous across head/tail
+  // wraparound
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    ESP_LOGE(LOG_TAG, "Capacity %lu is not a power of two",
+             (unsigned long)capacity);
+    return -1;
+  }
+
+  // Written and read every frame
+  q->frames = (uint8_t *)lk_mem_alloc(LK_MEM_AUDIO, capacity * frame_size);
+  q->sizes =
+      (uint16_t *)lk_mem_calloc(LK_MEM_AUDIO, capacity, sizeof(uint16_t));
+  if (q->frames == NULL || q->sizes == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate %lu frames of %lu bytes",
+             (unsigned long)capacity, (unsigned long)frame_size);
+    lk_mem_free(LK_MEM_AUDIO, q->frames);
+    lk_mem_free(LK_MEM_AUDIO, q->sizes);
+    q->frames = NULL;
+    q->sizes = NULL;
+    return -1;
+  }
+
+  q->capacity = capacity;
+  q->frame_size = frame_size;
+  q->head.store(0, std::memory_order_relaxed);
+  q->tail.store(0, std::memory_order_relaxed);
+  q->dropped.store(0, std::memory_order_relaxed);
+  return 0;
+}
+
+uint8_t *lk_frame_queue_acquire(lk_frame_queue *q) {
+  auto head = q->head.load(std::memory_order_relaxed);
+  if (head - q->tail.load(std::memory_order_acquire) >= q->capacity) {
+    q->dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+
+  return q->frames + (head & (q->capacity - 1)) * q->frame_size;
+}
+
+void lk_frame_queue_commit(lk_frame_queue *q, size_t size) {
+  auto head = q->head.load(std::memory_order_relaxed);
+  q->sizes[head & (q->capacity - 1)] = (uint16_t)size;
+  q->head.store(head + 1, std::memory_order_release);
+}
+
+uint8_t *lk_frame_queue_peek(lk_frame_queue *q, size_t *size) {
+  auto tail = q->tail.load(std::memory_order_relaxed);
+  if (tail == q->head.load(std::memory_order_acquire)) {
+    return NULL;
+  }
+
+  *size = q->sizes[tail & (q->capacity - 1)];
+  return q->frames + (tail & (q->capacity - 1)) * q->frame_size;
+}
+
+void lk_frame_queue_release(lk_frame_queue *q) {
+  q->tail.store(q->tail.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+}
+
+uint32_t lk_frame_queue_depth(lk_frame_queue *q) {
+  return q->head.load(std::memory_order_acquire) -
+         q->tail.load(std::memory_order_acquire);
+}
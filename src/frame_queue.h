@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// lk_frame_queue is a bounded single-producer/single-consumer ring of
+// fixed-size frames. Producer and consumer never block each other, slots are
+// written and read in place so a frame is only copied by whoever fills it.
+//
+// Producer: lk_frame_queue_acquire -> fill -> lk_frame_queue_commit
+// Consumer: lk_frame_queue_peek -> use -> lk_frame_queue_release
+typedef struct {
+  uint8_t *frames;
+  uint16_t *sizes;
+  uint32_t capacity;
+  uint32_t frame_size;
+  std::atomic<uint32_t> head;  // next slot to write, owned by producer
+  std::atomic<uint32_t> tail;  // next slot to read, owned by consumer
+  std::atomic<uint32_t> dropped;
+} lk_frame_queue;
+
+// capacity must be a power of two
+int lk_frame_queue_init(lk_frame_queue *q, uint32_t capacity,
+                        uint32_t frame_size);
+
+// Returns a writable slot of q->frame_size bytes, or NULL if the queue is full
+uint8_t *lk_frame_queue_acquire(lk_frame_queue *q);
+void lk_frame_queue_commit(lk_frame_queue *q, size_t size);
+
+// Returns the oldest committed frame, or NULL if the queue is empty
+uint8_t *lk_frame_queue_peek(lk_frame_queue *q, size_t *size);
+void lk_frame_queue_release(lk_frame_queue *q);
+
+uint32_t lk_frame_queue_depth(lk_frame_queue *q);
@@ -0,0 +1,180 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+
+#define LOG_TAG "jitter_buffer"
+
+#define JITTER_BUFFER_MASK (JITTER_BUFFER_SLOTS - 1)
+
+// Packets beyond target_depth + JITTER_BUFFER_SLACK are dropped to bring
+// latency back down after a burst
+#define JITTER_BUFFER_SLACK 2
+
+static void lk_jitter_buffer_reset(lk_jitter_buffer *jb) {
+  for (int i = 0; i < JITTER_BUFFER_SLOTS; i++) {
+    jb->slots[i].filled = false;
+  }
+  jb->buffered = 0;
+  jb->misses = 0;
+  jb->playing = false;
+}
+
+int lk_jitter_buffer_init(lk_jitter_buffer *jb, uint32_t clock_rate,
+                          uint32_t frame_duration_ms) {
+  memset(jb, 0, sizeof(*jb));
+  jb->mutex = xSemaphoreCreateMutex();
+  if (jb->mutex == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to create mutex");
+    return -1;
+  }
+
+  jb->clock_rate = clock_rate;
+  jb->frame_ts = clock_rate * frame_duration_ms / 1000;
+  jb->target_depth = JITTER_BUFFER_MIN_DEPTH;
+  return 0;
+}
+
+void lk_jitter_buffer_flush(lk_jitter_buffer *jb) {
+  if (xSemaphoreTake(jb->mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  lk_jitter_buffer_reset(jb);
+  jb->jitter = 0;
+  jb->last_transit = 0;
+  jb->target_depth = JITTER_BUFFER_MIN_DEPTH;
+  xSemaphoreGive(jb->mutex);
+}
+
+// Playout delay is two times the jitter, rounded up to whole frames
+static void lk_jitter_buffer_update_jitter(lk_jitter_buffer *jb,
+                                           uint32_t timestamp) {
+  auto arrival =
+      (uint32_t)(esp_timer_get_time() * (int64_t)jb->clock_rate / 1000000);
+  int64_t transit = (int32_t)(arrival - timestamp);
+
+  if (jb->last_transit != 0) {
+    auto d = transit - jb->last_transit;
+    if (d < 0) {
+      d = -d;
+    }
+    jb->jitter += (uint32_t)d - ((jb->jitter + 8) >> 4);
+  }
+  jb->last_transit = transit;
+
+  auto depth = 1 + (2 * (jb->jitter >> 4) + jb->frame_ts - 1) / jb->frame_ts;
+  if (depth < JITTER_BUFFER_MIN_DEPTH) {
+    depth = JITTER_BUFFER_MIN_DEPTH;
+  } else if (depth > JITTER_BUFFER_MAX_DEPTH) {
+    depth = JITTER_BUFFER_MAX_DEPTH;
+  }
+  jb->target_depth = depth;
+}
+
+void lk_jitter_buffer_push(lk_jitter_buffer *jb, uint16_t seq,
+                           uint32_t timestamp, const uint8_t *data,
+                           size_t size) {
+  if (size > JITTER_BUFFER_MAX_PACKET_SIZE) {
+    ESP_LOGW(LOG_TAG, "Dropping %d byte packet", (int)size);
+    return;
+  }
+
+  if (xSemaphoreTake(jb->mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  lk_jitter_buffer_update_jitter(jb, timestamp);
+
+  // Until playout starts, the oldest buffered packet is the first one played
+  if (!jb->playing &&
+      (jb->buffered == 0 || (int16_t)(seq - jb->next_seq) < 0)) {
+    jb->next_seq = seq;
+  }
+
+  auto ahead = (int16_t)(seq - jb->next_seq);
+  if (ahead < 0) {
+    jb->late++;
+  } else if (ahead >= JITTER_BUFFER_SLOTS) {
+    // Sender jumped ahead (restart, long outage). Start over from this packet
+    ESP_LOGI(LOG_TAG, "Resync %d -> %d", jb->next_seq, seq);
+    lk_jitter_buffer_reset(jb);
+    jb->next_seq = seq;
+    ahead = 0;
+  }
+
+  auto slot = &jb->slots[seq & JITTER_BUFFER_MASK];
+  if (ahead >= 0 && !(slot->filled && slot->seq == seq)) {
+    if (!slot->filled) {
+      jb->buffered++;
+    }
+    memcpy(slot->data, data, size);
+    slot->size = size;
+    slot->seq = seq;
+    slot->filled = true;
+  }
+
+  xSemaphoreGive(jb->mutex);
+}
+
+lk_jitter_result lk_jitter_buffer_pop(lk_jitter_buffer *jb, uint8_t *out,
+                                      size_t *size) {
+  lk_jitter_result result = LK_JITTER_EMPTY;
+  if (xSemaphoreTake(jb->mutex, portMAX_DELAY) != pdTRUE) {
+    return result;
+  }
+
+  if (!jb->playing && jb->buffered >= jb->target_depth) {
+    jb->playing = true;
+    jb->misses = 0;
+  }
+
+  if (!jb->playing) {
+    xSemaphoreGive(jb->mutex);
+    return result;
+  }
+
+  // Too far behind real time, skip a frame to catch up
+  if (jb->buffered > jb->target_depth + JITTER_BUFFER_SLACK) {
+    auto slot = &jb->slots[jb->next_seq & JITTER_BUFFER_MASK];
+    if (slot->filled) {
+      slot->filled = false;
+      jb->buffered--;
+    }
+    jb->next_seq++;
+  }
+
+  auto slot = &jb->slots[jb->next_seq & JITTER_BUFFER_MASK];
+  auto next = &jb->slots[(jb->next_seq + 1) & JITTER_BUFFER_MASK];
+  if (slot->filled && slot->seq == jb->next_seq) {
+    memcpy(out, slot->data, slot->size);
+    *size = slot->size;
+    slot->filled = false;
+    jb->buffered--;
+    jb->misses = 0;
+    result = LK_JITTER_PACKET;
+  } else if (next->filled && next->seq == (uint16_t)(jb->next_seq + 1)) {
+    // Leave the packet in place, it is still played normally next frame
+    memcpy(out, next->data, next->size);
+    *size = next->size;
+    jb->lost++;
+    jb->recovered++;
+    jb->misses++;
+    result = LK_JITTER_FEC;
+  } else {
+    jb->lost++;
+    jb->misses++;
+    result = LK_JITTER_LOST;
+  }
+  jb->next_seq++;
+
+  // Stream stopped, stop concealing and wait for the buffer to refill
+  if (jb->buffered == 0 && jb->misses > JITTER_BUFFER_MAX_DEPTH) {
+    lk_jitter_buffer_reset(jb);
+    result = LK_JITTER_EMPTY;
+  }
+
+  xSemaphoreGive(jb->mutex);
+  return result;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of packets the jitter buffer can hold, must be a power of two
+#define JITTER_BUFFER_SLOTS 16
+#define JITTER_BUFFER_MAX_PACKET_SIZE 512
+
+// Bounds for the adaptive playout delay, in packets
+#define JITTER_BUFFER_MIN_DEPTH 1
+#define JITTER_BUFFER_MAX_DEPTH (JITTER_BUFFER_SLOTS / 2)
+
+typedef enum {
+  // No packet to play, the buffer is (re)filling. Output silence
+  LK_JITTER_EMPTY = 0,
+  // Play the returned packet
+  LK_JITTER_PACKET,
+  // Next packet is missing but the one after it arrived. Decode the returned
+  // packet with decode_fec=1 to recover it
+  LK_JITTER_FEC,
+  // Next packet is missing. Conceal with opus_decode(NULL)
+  LK_JITTER_LOST,
+} lk_jitter_result;
+
+typedef struct {
+  uint8_t data[JITTER_BUFFER_MAX_PACKET_SIZE];
+  uint16_t size;
+  uint16_t seq;
+  bool filled;
+} lk_jitter_slot;
+
+// lk_jitter_buffer reorders incoming RTP packets by sequence number and
+// releases them at a fixed rate. Playout delay adapts to the interarrival
+// jitter measured from RTP timestamps (RFC 3550 6.4.1).
+typedef struct {
+  SemaphoreHandle_t mutex;
+  lk_jitter_slot slots[JITTER_BUFFER_SLOTS];
+
+  bool playing;
+  uint16_t next_seq;   // next sequence number to play
+  uint32_t buffered;   // filled slots
+  uint32_t misses;     // consecutive pops without a packet
+  uint32_t clock_rate;
+  uint32_t frame_ts;   // RTP timestamp units per frame
+
+  // Interarrival jitter, in RTP timestamp units scaled by 16
+  uint32_t jitter;
+  int64_t last_transit;
+  uint32_t target_depth;
+
+  uint32_t late;
+  uint32_t lost;
+  uint32_t recovered;
+} lk_jitter_buffer;
+
+int lk_jitter_buffer_init(lk_jitter_buffer *jb, uint32_t clock_rate,
+                          uint32_t frame_duration_ms);
+
+// Drops everything buffered and the jitter estimate, for reusing the buffer
+// for a new stream
+void lk_jitter_buffer_flush(lk_jitter_buffer *jb);
+
+// Called for every received RTP packet
+void lk_jitter_buffer_push(lk_jitter_buffer *jb, uint16_t seq,
+                           uint32_t timestamp, const uint8_t *data,
+                           size_t size);
+
+// Called once per frame by the playout clock. out must hold
+// JITTER_BUFFER_MAX_PACKET_SIZE bytes
+lk_jitter_result lk_jitter_buffer_pop(lk_jitter_buffer *jb, uint8_t *out,
+                                      size_t *size);
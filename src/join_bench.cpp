@@ -0,0 +1,278 @@
+// Times joins against the mock SFU, run with `src.elf join-bench` or the
+// join_bench build target. Every run is a fresh process, forked before
+// anything is started, with the mock and one session joining it over
+// loopback. The session has no media, so nothing depends on audio devices.
+//
+// Scripted, a run lasts until the publisher is connected. Replaying a
+// recording only signaling is exercised, PeerConnections can't connect to
+// the recorded candidates, so a run lasts until the subscriber answer is sent.
+
+#include <cJSON.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <peer.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "mock_sfu.h"
+#include "session.h"
+
+#define LOG_TAG "join_bench"
+
+#define JOIN_BENCH_DEFAULT_RUNS 10
+#define JOIN_BENCH_DEFAULT_TIMEOUT_MS 10000
+#define JOIN_BENCH_MAX_RUNS 1000
+
+// Join milestones reported, in the order they are reached
+static const char *join_milestones[] = {
+    "websocket connected",     "subscriber offer received",
+    "subscriber answer sent",  "subscriber connected",
+    "publisher offer sent",    "publisher answer received",
+    "publisher connected",
+};
+
+#define JOIN_MILESTONE_COUNT \
+  (int)(sizeof(join_milestones) / sizeof(join_milestones[0]))
+
+typedef struct {
+  // Since lk_websocket was called, -1 if it wasn't reached
+  int64_t elapsed_us[JOIN_MILESTONE_COUNT];
+} lk_join_bench_result;
+
+// State of the forked run
+static pthread_mutex_t run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static lk_join_bench_result run_result;
+static const char *run_last_milestone;
+static lk_mock_sfu *run_mock;
+
+static int lk_join_bench_milestone(const char *milestone) {
+  for (int i = 0; i < JOIN_MILESTONE_COUNT; i++) {
+    if (strcmp(join_milestones[i], milestone) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Subscriber answer sent is reached with the session mutex held, the local
+// description it was built from is still set
+static void lk_join_bench_observer(lk_session *session, const char *milestone,
+                                   int64_t elapsed_us) {
+  if (strcmp(milestone, "subscriber answer sent") == 0 &&
+      session->subscriber_local_description != NULL) {
+    lk_mock_sfu_set_subscriber_candidates(
+        run_mock, session->subscriber_local_description);
+  }
+
+  auto index = lk_join_bench_milestone(milestone);
+  pthread_mutex_lock(&run_mutex);
+  if (index >= 0 && run_result.elapsed_us[index] < 0) {
+    run_result.elapsed_us[index] = elapsed_us;
+  }
+  pthread_cond_signal(&run_cond);
+  pthread_mutex_unlock(&run_mutex);
+}
+
+// Runs in the forked process
+static void lk_join_bench_run(const char *replay_path, int timeout_ms) {
+  for (int i = 0; i < JOIN_MILESTONE_COUNT; i++) {
+    run_result.elapsed_us[i] = -1;
+  }
+  run_last_milestone = replay_path != NULL ? "subscriber answer sent"
+                                           : "publisher connected";
+
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  peer_init();
+
+  lk_mock_sfu_config config = {};
+  config.replay_path = replay_path;
+  config.subscriber_candidates = true;
+  run_mock = lk_mock_sfu_start(&config);
+  if (run_mock == NULL) {
+    return;
+  }
+
+  // Kept for the lifetime of the process, like the session
+  static char url[64];
+  snprintf(url, sizeof(url), "ws://127.0.0.1:%d", lk_mock_sfu_port(run_mock));
+  auto session = lk_session_create(url, "mock", /* media */ false);
+  if (session == NULL) {
+    return;
+  }
+  session->join_milestone_observer = lk_join_bench_observer;
+
+  pthread_t thread_handle;
+  pthread_create(
+      &thread_handle, NULL,
+      [](void *session) -> void * {
+        lk_websocket((lk_session *)session);
+        return NULL;
+      },
+      session);
+  pthread_detach(thread_handle);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  auto last = lk_join_bench_milestone(run_last_milestone);
+  pthread_mutex_lock(&run_mutex);
+  while (run_result.elapsed_us[last] < 0 &&
+         pthread_cond_timedwait(&run_cond, &run_mutex, &deadline) == 0) {
+  }
+  pthread_mutex_unlock(&run_mutex);
+}
+
+// Returns 0 with the result of one run in its own process
+static int lk_join_bench_fork(const char *replay_path, int timeout_ms,
+                              lk_join_bench_result *result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+
+  auto pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    lk_join_bench_run(replay_path, timeout_ms);
+    pthread_mutex_lock(&run_mutex);
+    auto written = write(fds[1], &run_result, sizeof(run_result));
+    pthread_mutex_unlock(&run_mutex);
+    // The session's threads are never joined, skip every destructor
+    _exit(written == sizeof(run_result) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  auto read_size = read(fds[0], result, sizeof(*result));
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return read_size == sizeof(*result) ? 0 : -1;
+}
+
+static int lk_join_bench_compare(const void *a, const void *b) {
+  auto x = *(const int64_t *)a;
+  auto y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void lk_join_bench_usage() {
+  fprintf(stderr,
+          "usage: src.elf join-bench [--runs N] [--replay FILE] "
+          "[--timeout-ms MS] [--output FILE]\n");
+}
+
+int lk_join_bench_main(int argc, char **argv) {
+  int runs = JOIN_BENCH_DEFAULT_RUNS;
+  int timeout_ms = JOIN_BENCH_DEFAULT_TIMEOUT_MS;
+  const char *replay_path = NULL;
+  const char *output_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 == argc) {
+      lk_join_bench_usage();
+      return 2;
+    } else if (strcmp(argv[i], "--runs") == 0) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--replay") == 0) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--timeout-ms") == 0) {
+      timeout_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--output") == 0) {
+      output_path = argv[++i];
+    } else {
+      lk_join_bench_usage();
+      return 2;
+    }
+  }
+  if (runs < 1 || runs > JOIN_BENCH_MAX_RUNS || timeout_ms < 1) {
+    lk_join_bench_usage();
+    return 2;
+  }
+
+  // Every milestone is logged, the run is summarized instead
+  esp_log_level_set("*", ESP_LOG_WARN);
+
+  static lk_join_bench_result results[JOIN_BENCH_MAX_RUNS];
+  int incomplete = 0;
+  for (int run = 0; run < runs; run++) {
+    if (lk_join_bench_fork(replay_path, timeout_ms, &results[run]) != 0) {
+      ESP_LOGE(LOG_TAG, "Run %d failed", run);
+      return 2;
+    }
+  }
+
+  auto output = cJSON_CreateObject();
+  cJSON_AddNumberToObject(output, "runs", runs);
+  auto milestones = cJSON_AddArrayToObject(output, "milestones");
+  auto last = lk_join_bench_milestone(replay_path != NULL
+                                          ? "subscriber answer sent"
+                                          : "publisher connected");
+  for (int i = 0; i <= last; i++) {
+    static int64_t elapsed_us[JOIN_BENCH_MAX_RUNS];
+    int completed = 0;
+    for (int run = 0; run < runs; run++) {
+      if (results[run].elapsed_us[i] >= 0) {
+        elapsed_us[completed++] = results[run].elapsed_us[i];
+      }
+    }
+    if (i == last) {
+      incomplete = runs - completed;
+    }
+
+    auto milestone = cJSON_CreateObject();
+    cJSON_AddStringToObject(milestone, "name", join_milestones[i]);
+    cJSON_AddNumberToObject(milestone, "completed", completed);
+    if (completed == 0) {
+      printf("%-28s never reached\n", join_milestones[i]);
+      cJSON_AddItemToArray(milestones, milestone);
+      continue;
+    }
+
+    qsort(elapsed_us, completed, sizeof(int64_t), lk_join_bench_compare);
+    auto min_ms = elapsed_us[0] / 1000.0;
+    auto median_ms = elapsed_us[completed / 2] / 1000.0;
+    auto max_ms = elapsed_us[completed - 1] / 1000.0;
+    cJSON_AddNumberToObject(milestone, "min_ms", min_ms);
+    cJSON_AddNumberToObject(milestone, "median_ms", median_ms);
+    cJSON_AddNumberToObject(milestone, "max_ms", max_ms);
+    cJSON_AddItemToArray(milestones, milestone);
+    printf("%-28s %4d/%d  min %8.1f  median %8.1f  max %8.1f ms\n",
+           join_milestones[i], completed, runs, min_ms, median_ms, max_ms);
+  }
+
+  auto json = cJSON_Print(output);
+  if (output_path != NULL && json != NULL) {
+    auto file = fopen(output_path, "w");
+    if (file == NULL || fputs(json, file) < 0) {
+      ESP_LOGE(LOG_TAG, "Failed to write %s", output_path);
+    }
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+  free(json);
+  cJSON_Delete(output);
+
+  if (incomplete > 0) {
+    ESP_LOGE(LOG_TAG, "%d of %d joins did not complete", incomplete, runs);
+    return 1;
+  }
+  return 0;
+}
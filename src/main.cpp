@@ -1,4 +1,8 @@
 #include "main.h"
+#include "metrics.h"
+#include "power.h"
+#include "session.h"
+#include "srtp_crypto.h"
 
 #include <esp_event.h>
 #include <esp_log.h>
@@ -18,15 +22,175 @@ extern "C" void app_main(void) {
 
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   peer_init();
+  lk_srtp_crypto_init();
+  auto session = lk_session_create(LIVEKIT_URL, LIVEKIT_TOKEN,
+                                   /* media */ true);
+  if (session == NULL) {
+    return;
+  }
+  lk_metrics_init();
   lk_init_audio_capture();
   lk_init_audio_decoder();
   lk_wifi();
-  lk_websocket(LIVEKIT_URL, LIVEKIT_TOKEN);
+  lk_power_init();
+  lk_websocket(session);
 }
 #else
-int main(void) {
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define LOG_TAG "main"
+
+// Load test mode. LK_SESSIONS participants join the room from this process,
+// only the first one is attached to the WAV microphone and speaker. Each
+// session needs its own identity, LK_SESSION_TOKENS is a file with one token
+// per line
+#define LOAD_REPORT_INTERVAL_MS 10000
+#define LOAD_RAMP_INTERVAL_MS 100
+#define LOAD_TOKEN_SIZE 2048
+
+// Bytes allocated from the heap, in every arena and mmapped
+static size_t lk_heap_in_use() {
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// Also counts thread stacks and libraries, which the heap doesn't
+static size_t lk_resident_set() {
+  auto file = fopen("/proc/self/statm", "r");
+  unsigned long pages = 0;
+  if (file != NULL) {
+    if (fscanf(file, "%*lu %lu", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(file);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+static int64_t lk_cpu_time_us() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Returns how many tokens were read, tokens are kept for the process lifetime
+static int lk_read_tokens(const char *path, const char **tokens, int max) {
+  auto file = fopen(path, "r");
+  if (file == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to open %s", path);
+    return 0;
+  }
+
+  static char line[LOAD_TOKEN_SIZE];
+  int count = 0;
+  while (count < max && fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '\0') {
+      tokens[count++] = strdup(line);
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+static void lk_run_sessions(int count) {
+  auto tokens = (const char **)calloc(count, sizeof(char *));
+  auto token_count = 0;
+  auto tokens_path = getenv("LK_SESSION_TOKENS");
+  if (tokens_path != NULL) {
+    token_count = lk_read_tokens(tokens_path, tokens, count);
+  }
+  if (token_count < count) {
+    ESP_LOGW(LOG_TAG, "%d tokens for %d sessions, identities are reused",
+             token_count, count);
+  }
+
+  auto heap_start = lk_heap_in_use();
+  auto resident_start = lk_resident_set();
+  int started = 0;
+  lk_metrics_init();
+  for (int i = 0; i < count; i++) {
+    auto token = token_count > 0 ? tokens[i % token_count] : LIVEKIT_TOKEN;
+    auto session = lk_session_create(LIVEKIT_URL, token, /* media */ i == 0);
+    if (session == NULL) {
+      ESP_LOGE(LOG_TAG, "Stopped at %d sessions", i);
+      break;
+    }
+
+    pthread_t thread_handle;
+    pthread_create(
+        &thread_handle, NULL,
+        [](void *session) -> void * {
+          lk_websocket((lk_session *)session);
+          return NULL;
+        },
+        session);
+    pthread_detach(thread_handle);
+    started++;
+
+    // Joins are spread out, the SFU rate limits a burst of them
+    usleep(LOAD_RAMP_INTERVAL_MS * 1000);
+  }
+
+  if (started == 0) {
+    return;
+  }
+
+  auto cpu_start_us = lk_cpu_time_us();
+  while (true) {
+    usleep(LOAD_REPORT_INTERVAL_MS * 1000);
+
+    // Everything since the first session was created is charged to the
+    // sessions, CPU as a percentage of one core
+    auto heap = lk_heap_in_use() - heap_start;
+    auto resident = lk_resident_set() - resident_start;
+    auto cpu_us = lk_cpu_time_us() - cpu_start_us;
+    cpu_start_us += cpu_us;
+    auto cpu = cpu_us * 100.0 / (LOAD_REPORT_INTERVAL_MS * 1000);
+    ESP_LOGI(LOG_TAG,
+             "%d sessions: heap %lu KB (%lu KB each), resident %lu KB "
+             "(%lu KB each), CPU %.1f%% (%.2f%% each)",
+             started, (unsigned long)heap / 1024,
+             (unsigned long)heap / 1024 / started,
+             (unsigned long)resident / 1024,
+             (unsigned long)resident / 1024 / started, cpu, cpu / started);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return lk_bench_main(argc - 1, argv + 1);
+  } else if (argc > 1 && strcmp(argv[1], "mock-sfu") == 0) {
+    return lk_mock_sfu_main(argc - 1, argv + 1);
+  } else if (argc > 1 && strcmp(argv[1], "join-bench") == 0) {
+    return lk_join_bench_main(argc - 1, argv + 1);
+  }
+
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   peer_init();
-  lk_websocket(LIVEKIT_URL, LIVEKIT_TOKEN);
+  lk_srtp_crypto_init();
+  lk_init_audio_capture();
+  lk_init_audio_decoder();
+
+  auto sessions = getenv("LK_SESSIONS");
+  if (sessions != NULL && atoi(sessions) > 1) {
+    lk_run_sessions(atoi(sessions));
+    return 0;
+  }
+
+  auto session = lk_session_create(LIVEKIT_URL, LIVEKIT_TOKEN,
+                                   /* media */ true);
+  if (session == NULL) {
+    return 1;
+  }
+  lk_metrics_init();
+  lk_websocket(session);
 }
 #endif
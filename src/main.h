@@ -1,17 +1,66 @@
 #include <peer.h>
 
-#define BUFFER_SAMPLES 320
+// Rate audio is encoded and decoded at
+#ifndef SAMPLE_RATE
 #define SAMPLE_RATE 8000
+#endif
 
-PeerConnection *lk_create_peer_connection(int isPublisher);
-void lk_websocket(const char *url, const char *token);
+// Rate the microphone and speaker run at, media.cpp converts between the two
+#ifndef AUDIO_HAL_SAMPLE_RATE
+#define AUDIO_HAL_SAMPLE_RATE SAMPLE_RATE
+#endif
+
+// Audio is captured, encoded and sent in fixed 20ms frames
+#define AUDIO_FRAME_DURATION_MS 20
+#define AUDIO_FRAME_SAMPLES (SAMPLE_RATE * AUDIO_FRAME_DURATION_MS / 1000)
+#define AUDIO_FRAME_BYTES (AUDIO_FRAME_SAMPLES * sizeof(int16_t))
+#define AUDIO_HAL_FRAME_SAMPLES \
+  (AUDIO_HAL_SAMPLE_RATE * AUDIO_FRAME_DURATION_MS / 1000)
+
+// Longest Opus packet the decoder accepts, 60ms
+#define AUDIO_MAX_PACKET_SAMPLES (SAMPLE_RATE * 60 / 1000)
+
+// Remote audio tracks decoded and mixed at once. Streams are pooled and
+// allocated up front, a track beyond this is not played
+#ifndef LK_AUDIO_MAX_STREAMS
+#define LK_AUDIO_MAX_STREAMS 3
+#endif
+
+typedef struct lk_session lk_session;
+
+PeerConnection *lk_create_peer_connection(lk_session *session,
+                                          int isPublisher);
+void lk_websocket(lk_session *session);
+void lk_signaling_notify(lk_session *session);
+void lk_request_reconnect(lk_session *session, const char *reason,
+                          int rejoin);
+void lk_set_microphone_muted(lk_session *session, bool muted);
+void lk_reset_signaling_state(lk_session *session);
+void lk_reset_subscriber_answer(lk_session *session);
+void lk_join_milestone(lk_session *session, const char *milestone);
+int get_publisher_status(lk_session *session);
+void set_publisher_status(lk_session *session, int status);
 void lk_wifi(void);
 void lk_init_audio_capture(void);
 void lk_init_audio_decoder(void);
-void lk_populate_answer(char *answer, size_t answer_size, int include_audio);
+void lk_queue_ice_candidate(lk_session *session, int is_publisher,
+                            const char *candidate);
+int lk_populate_answer(lk_session *session);
 void lk_publisher_peer_connection_task(void *user_data);
 void lk_subscriber_peer_connection_task(void *user_data);
 void lk_audio_encoder_task(void *arg);
-void lk_audio_decode(uint8_t *data, size_t size);
+void lk_audio_receive(lk_session *session, uint8_t *data, size_t size);
+void lk_audio_playout_task(void *arg);
 void lk_init_audio_encoder();
+void lk_start_audio_pipeline(lk_session *session);
 void lk_send_audio(PeerConnection *peer_connection);
+void lk_wait_for_audio_frame(uint32_t timeout_ms);
+
+#ifdef LINUX_BUILD
+// `src.elf bench`, see bench.cpp
+int lk_bench_main(int argc, char **argv);
+// `src.elf mock-sfu`, see mock_sfu.h
+int lk_mock_sfu_main(int argc, char **argv);
+// `src.elf join-bench`, see join_bench.cpp
+int lk_join_bench_main(int argc, char **argv);
+#endif
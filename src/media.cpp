@@ -1,174 +1,352 @@
 #include <opus.h>
-#include "driver/i2s_std.h"
-#include "driver/i2s_common.h"
+#include <string.h>
+
+#include "audio_format.h"
+#include "audio_hal.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "main.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "frame_queue.h"
+#include "jitter_buffer.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "opus_profile.h"
+#include "power.h"
+#include "trace.h"
+#include "vad.h"
 
 #define OPUS_OUT_BUFFER_SIZE 1276  // 1276 bytes is recommended by opus_encode
 
-#define OPUS_ENCODER_BITRATE 30000
-#define OPUS_ENCODER_COMPLEXITY 0
+// Opus DTX encodes silence as packets of at most this size. They are still
+// sent, every packet advances the RTP timestamp by one frame
+#define OPUS_DTX_PACKET_SIZE 2
+
+#define AUDIO_OPUS_QUEUE_DEPTH 4
+#define AUDIO_ENCODER_STACK_SIZE 20000
+#define AUDIO_PLAYOUT_STACK_SIZE 16384
+
+// Q12, AUDIO_GAIN_UNITY is 0 dB
+#ifndef AUDIO_CAPTURE_GAIN
+#define AUDIO_CAPTURE_GAIN AUDIO_GAIN_UNITY
+#endif
+#ifndef AUDIO_PLAYOUT_GAIN
+#define AUDIO_PLAYOUT_GAIN AUDIO_GAIN_UNITY
+#endif
+
+#define RTP_HEADER_SIZE 12
+#define OPUS_RTP_CLOCK_RATE 48000
 
 static const char *TAG = "media";
-static i2s_chan_handle_t rx_chan;        // I2S rx channel handler
-static i2s_chan_handle_t tx_chan;        // I2S tx channel handler
-
-static void init_microphone_i2s(void)
-{
-    /* Configure I2S channel using settings from main.c */
-    i2s_chan_config_t chan_cfg = {
-        .id = I2S_NUM_1,
-        .role = I2S_ROLE_MASTER,
-        .dma_desc_num = 8,      // Increased from 4 to 8
-        .dma_frame_num = 2048,    // Increased from 1024 to 2048
-        .auto_clear = false,      // Match main.c (auto_clear = false)
-    };
-    
-    esp_err_t ret = i2s_new_channel(&chan_cfg, NULL, &rx_chan);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create I2S channel: %s", esp_err_to_name(ret));
-        return;
+
+void lk_init_audio_capture() {
+  lk_audio_hal_init();
+}
+
+// A stream without packets for this long can be taken over by a new SSRC
+#define AUDIO_STREAM_IDLE_MS 5000
+
+// Every remote track (SSRC) has its own jitter buffer and decoder, Opus
+// decoders carry state between packets and can't be shared between senders.
+// ssrc, in_use, reset and last_packet_us are guarded by streams_mutex. The
+// decoder and pcm are only touched by the playout task.
+typedef struct {
+  uint32_t ssrc;
+  bool in_use;
+  bool reset;  // claimed for a new SSRC, the playout task resets the decoder
+  int64_t last_packet_us;
+  lk_jitter_buffer jitter_buffer;
+  OpusDecoder *decoder;
+
+  // Decoded packet, played out one frame per tick
+  opus_int16 pcm[AUDIO_MAX_PACKET_SAMPLES];
+  int pcm_samples;
+  int pcm_offset;
+} lk_audio_stream;
+
+static lk_audio_stream *audio_streams = NULL;
+static SemaphoreHandle_t streams_mutex = NULL;
+
+// The decoder runs at SAMPLE_RATE and decodes mono, the speaker is stereo at
+// AUDIO_HAL_SAMPLE_RATE
+static lk_resampler playout_resampler;
+
+// Incoming packets are reordered and paced by the jitter buffers. The playout
+// task is the only user of the decoders and of the audio output, so a late or
+// lost packet never blocks the subscriber PeerConnection.
+void lk_init_audio_decoder() {
+  audio_streams = (lk_audio_stream *)lk_mem_calloc(
+      LK_MEM_CODEC, LK_AUDIO_MAX_STREAMS, sizeof(lk_audio_stream));
+  streams_mutex = xSemaphoreCreateMutex();
+  if (audio_streams == NULL || streams_mutex == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate audio streams");
+    return;
+  }
+
+  for (int i = 0; i < LK_AUDIO_MAX_STREAMS; i++) {
+    auto decoder =
+        (OpusDecoder *)lk_mem_alloc(LK_MEM_CODEC, opus_decoder_get_size(1));
+    if (decoder == NULL ||
+        opus_decoder_init(decoder, SAMPLE_RATE, 1) != OPUS_OK) {
+      ESP_LOGE(TAG, "Failed to create OPUS decoder");
+      return;
     }
+    audio_streams[i].decoder = decoder;
 
-    /* Configure I2S standard mode using settings from main.c */
-    i2s_std_config_t std_cfg = {
-        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE),
-        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_MONO),
-        .gpio_cfg = {
-            .mclk = I2S_GPIO_UNUSED,
-            .bclk = GPIO_NUM_2,
-            .ws = GPIO_NUM_3,
-            .dout = I2S_GPIO_UNUSED,
-            .din = GPIO_NUM_5,
-            .invert_flags = {
-                .mclk_inv = false,
-                .bclk_inv = false,
-                .ws_inv = false,
-            },
-        },
-    };
-    
-    std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
-    
-    ret = i2s_channel_init_std_mode(rx_chan, &std_cfg);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize I2S channel in standard mode: %s", esp_err_to_name(ret));
-        return;
+    if (lk_jitter_buffer_init(&audio_streams[i].jitter_buffer,
+                              OPUS_RTP_CLOCK_RATE,
+                              AUDIO_FRAME_DURATION_MS) != 0) {
+      return;
     }
+  }
+
+  if (lk_resampler_init(&playout_resampler, SAMPLE_RATE, AUDIO_HAL_SAMPLE_RATE,
+                        AUDIO_FRAME_SAMPLES) != 0) {
+    return;
+  }
 
-    /* Enable the RX channel */
-    ESP_ERROR_CHECK(i2s_channel_enable(rx_chan));
-    
-    ESP_LOGI(TAG, "I2S microphone initialized successfully");
+  lk_mem_create_task(LK_MEM_STACK, lk_audio_playout_task, "lk_audio_playout",
+                     AUDIO_PLAYOUT_STACK_SIZE, NULL, 6, 1);
 }
 
-static void init_speaker_i2s(void)
-{
-    i2s_chan_config_t chan_cfg = {
-        .id = I2S_NUM_0,
-        .role = I2S_ROLE_MASTER,
-        .dma_desc_num = 16,
-        .dma_frame_num = BUFFER_SAMPLES,
-        .auto_clear = true,
-    };
-
-    esp_err_t ret = i2s_new_channel(&chan_cfg, &tx_chan, NULL);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create I2S channel: %s", esp_err_to_name(ret));
-        return;
-    } 
-
-    /* Configure I2S standard mode using settings from main.c */
-    i2s_std_config_t std_cfg = {
-        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE),
-        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO),
-        .gpio_cfg = { 
-            .mclk = I2S_GPIO_UNUSED,
-            .bclk = GPIO_NUM_9,
-            .ws = GPIO_NUM_10,
-            .dout = GPIO_NUM_8,
-            .din = I2S_GPIO_UNUSED,
-            .invert_flags = {
-                .mclk_inv = false,
-                .bclk_inv = false,
-                .ws_inv = false,
-            },
-        },
-    };
-    
-    // Enable APLL for better audio quality if available
-    // Check header files for correct values before enabling
-#if defined(I2S_CLK_SRC_APLL)
-    std_cfg.clk_cfg.clk_src = I2S_CLK_SRC_APLL;
-#endif
-    
-    ret = i2s_channel_init_std_mode(tx_chan, &std_cfg);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize I2S channel in standard mode: %s", esp_err_to_name(ret)); 
-        return;
+// Returns the stream of ssrc, claiming a free or idle one for a new SSRC.
+// Called with streams_mutex held
+static lk_audio_stream *lk_audio_stream_for(uint32_t ssrc, int64_t now_us) {
+  lk_audio_stream *claim = NULL;
+  for (int i = 0; i < LK_AUDIO_MAX_STREAMS; i++) {
+    auto stream = &audio_streams[i];
+    if (stream->in_use && stream->ssrc == ssrc) {
+      return stream;
     }
 
-    /* Enable the TX channel */
-    ESP_ERROR_CHECK(i2s_channel_enable(tx_chan)); 
+    if (!stream->in_use ||
+        now_us - stream->last_packet_us > AUDIO_STREAM_IDLE_MS * 1000LL) {
+      if (claim == NULL || !stream->in_use ||
+          stream->last_packet_us < claim->last_packet_us) {
+        claim = stream;
+      }
+    }
+  }
 
-    ESP_LOGI(TAG, "I2S speaker initialized successfully");
+  if (claim != NULL) {
+    ESP_LOGI(TAG, "Playing SSRC %lu", (unsigned long)ssrc);
+    lk_jitter_buffer_flush(&claim->jitter_buffer);
+    claim->ssrc = ssrc;
+    claim->in_use = true;
+    claim->reset = true;
+  }
+  return claim;
 }
 
+// libpeer passes onaudiotrack the RTP payload, which directly follows the
+// fixed RTP header. The answer negotiates no header extensions and the SFU
+// sends no CSRCs, so the header is always RTP_HEADER_SIZE bytes before data.
+void lk_audio_receive(lk_session *session, uint8_t *data, size_t size) {
+  static bool first_packet = true;
+  if (first_packet) {
+    first_packet = false;
+    lk_join_milestone(session, "first audio received");
+  }
 
-void lk_init_audio_capture() {
-  init_microphone_i2s();
-  init_speaker_i2s();
+  lk_metrics_count(LK_COUNTER_PACKETS_RECEIVED);
+
+  auto header = data - RTP_HEADER_SIZE;
+  uint16_t seq = (header[2] << 8) | header[3];
+  uint32_t timestamp = ((uint32_t)header[4] << 24) |
+                       ((uint32_t)header[5] << 16) |
+                       ((uint32_t)header[6] << 8) | header[7];
+  uint32_t ssrc = ((uint32_t)header[8] << 24) | ((uint32_t)header[9] << 16) |
+                  ((uint32_t)header[10] << 8) | header[11];
+
+  if (audio_streams == NULL ||
+      xSemaphoreTake(streams_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  auto now_us = esp_timer_get_time();
+  auto stream = lk_audio_stream_for(ssrc, now_us);
+  if (stream != NULL) {
+    stream->last_packet_us = now_us;
+  }
+  xSemaphoreGive(streams_mutex);
+
+  if (stream == NULL) {
+    lk_metrics_count(LK_COUNTER_PACKETS_NO_STREAM);
+    return;
+  }
+
+  // A stream is only claimed for another SSRC once idle, nothing else pushes
+  // to this jitter buffer meanwhile
+  lk_jitter_buffer_push(&stream->jitter_buffer, seq, timestamp, data, size);
 }
 
-opus_int16 *output_buffer = NULL;
-OpusDecoder *opus_decoder = NULL;
+// Decodes into stream->pcm and returns the number of samples.
+// data == NULL conceals one lost frame, decode_fec recovers the frame before
+// data from its inband FEC.
+static int lk_audio_decode(lk_audio_stream *stream, const uint8_t *data,
+                           size_t size, int decode_fec) {
+  LK_TRACE_SCOPE(LK_TRACE_AUDIO_DECODE);
+  lk_power_acquire(LK_POWER_LOCK_DECODE);
+  auto start_us = esp_timer_get_time();
+  int frame_size = (data == NULL || decode_fec) ? AUDIO_FRAME_SAMPLES
+                                                : AUDIO_MAX_PACKET_SAMPLES;
+  auto decoded_size = opus_decode(stream->decoder, data, size, stream->pcm,
+                                  frame_size, decode_fec);
+  lk_metrics_record(LK_HISTOGRAM_DECODE_US, start_us);
+  lk_power_release(LK_POWER_LOCK_DECODE);
+  return decoded_size;
+}
 
-void lk_init_audio_decoder() {
-  int decoder_error = 0;
-  opus_decoder = opus_decoder_create(SAMPLE_RATE, 2, &decoder_error);
-  if (decoder_error != OPUS_OK) {
-    printf("Failed to create OPUS decoder");
+// Returns the stream's next frame, decoding a packet from its jitter buffer
+// when the previous one has been played. NULL when there is nothing to play
+static opus_int16 *lk_audio_stream_next_frame(lk_audio_stream *stream) {
+  static uint8_t packet[JITTER_BUFFER_MAX_PACKET_SIZE];
+  size_t packet_size = 0;
+
+  xSemaphoreTake(streams_mutex, portMAX_DELAY);
+  auto in_use = stream->in_use;
+  auto reset = stream->reset;
+  stream->reset = false;
+  xSemaphoreGive(streams_mutex);
+
+  if (reset) {
+    opus_decoder_ctl(stream->decoder, OPUS_RESET_STATE);
+    stream->pcm_samples = 0;
+    stream->pcm_offset = 0;
+  }
+  if (!in_use) {
+    return NULL;
+  }
+
+  if (stream->pcm_offset + AUDIO_FRAME_SAMPLES > stream->pcm_samples) {
+    int decoded_size = 0;
+    switch (lk_jitter_buffer_pop(&stream->jitter_buffer, packet,
+                                 &packet_size)) {
+      case LK_JITTER_PACKET:
+        decoded_size = lk_audio_decode(stream, packet, packet_size, 0);
+        lk_metrics_count(LK_COUNTER_FRAMES_DECODED);
+        break;
+      case LK_JITTER_FEC:
+        decoded_size = lk_audio_decode(stream, packet, packet_size, 1);
+        lk_metrics_count(LK_COUNTER_FRAMES_RECOVERED);
+        break;
+      case LK_JITTER_LOST:
+        decoded_size = lk_audio_decode(stream, NULL, 0, 0);
+        lk_metrics_count(LK_COUNTER_FRAMES_CONCEALED);
+        break;
+      case LK_JITTER_EMPTY:
+        lk_metrics_count(LK_COUNTER_FRAMES_SILENCE);
+        break;
+    }
+    lk_metrics_gauge_set(LK_GAUGE_JITTER_BUFFER_DEPTH,
+                         stream->jitter_buffer.buffered);
+    lk_metrics_gauge_set(LK_GAUGE_JITTER_BUFFER_TARGET,
+                         stream->jitter_buffer.target_depth);
+
+    stream->pcm_samples = decoded_size > 0 ? decoded_size : 0;
+    stream->pcm_offset = 0;
+    if (stream->pcm_samples < AUDIO_FRAME_SAMPLES) {
+      return NULL;
+    }
+  }
+
+  auto frame = stream->pcm + stream->pcm_offset;
+  stream->pcm_offset += AUDIO_FRAME_SAMPLES;
+  return frame;
+}
+
+// Converts one decoded frame straight into the next output frame of the HAL.
+// Silence is committed as handed out, pcm == NULL plays silence
+static void lk_audio_play_frame(opus_int16 *pcm) {
+  auto start_us = esp_timer_get_time();
+  auto frame = lk_audio_hal_acquire_output();
+  lk_metrics_record(LK_HISTOGRAM_AUDIO_WRITE_US, start_us);
+  if (frame == NULL) {
     return;
   }
 
-  // Allocate a stereo buffer (2 channels)
-  output_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES * 2 * sizeof(opus_int16));
-  if (output_buffer == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate stereo output buffer");
+  if (pcm == NULL || lk_audio_is_silent(pcm, AUDIO_FRAME_SAMPLES)) {
+    lk_metrics_count(LK_COUNTER_FRAMES_PLAYOUT_SILENT);
+    lk_audio_hal_commit_output();
     return;
   }
+
+  // Gain is applied before the stereo expansion, on half the samples. At
+  // equal rates the expansion reads the decoder output directly
+  auto mono = pcm;
+  if (AUDIO_HAL_SAMPLE_RATE != SAMPLE_RATE) {
+    mono = frame;
+    lk_resampler_process(&playout_resampler, pcm, AUDIO_FRAME_SAMPLES, mono);
+  }
+  lk_audio_apply_gain(mono, AUDIO_HAL_FRAME_SAMPLES, AUDIO_PLAYOUT_GAIN);
+  lk_audio_mono_to_stereo(mono, frame, AUDIO_HAL_FRAME_SAMPLES);
+  lk_audio_hal_commit_output();
 }
 
-void lk_audio_decode(uint8_t *data, size_t size) {
-  int decoded_size =
-      opus_decode(opus_decoder, data, size, output_buffer, BUFFER_SAMPLES, 0);
-
-  if (decoded_size > 0) {
-    size_t bytes_written = 0;
-    // Calculate the actual size to write based on the decoded samples
-    // For stereo, each sample consists of 2 channels × 2 bytes per sample (16-bit)
-    size_t write_size = decoded_size * 2 * sizeof(int16_t);
-    
-    ESP_LOGD(TAG, "Decoded %d samples, writing %d bytes", decoded_size, write_size);
-    
-    esp_err_t ret = i2s_channel_write(tx_chan, output_buffer, write_size, 
-                                      &bytes_written, portMAX_DELAY);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to write audio data: %s", esp_err_to_name(ret));
+// Acquiring output frames paces this task at the speaker's sample rate. Every
+// tick takes one frame from each stream and plays their mix.
+void lk_audio_playout_task(void *arg) {
+  static int32_t mix[AUDIO_FRAME_SAMPLES];
+  static opus_int16 mixed[AUDIO_FRAME_SAMPLES];
+
+  while (1) {
+    auto start_us = esp_timer_get_time();
+    opus_int16 *frames[LK_AUDIO_MAX_STREAMS];
+    int playing = 0;
+    for (int i = 0; i < LK_AUDIO_MAX_STREAMS; i++) {
+      auto frame = lk_audio_stream_next_frame(&audio_streams[i]);
+      if (frame != NULL) {
+        frames[playing++] = frame;
+      }
+    }
+    lk_metrics_gauge_set(LK_GAUGE_PLAYING_STREAMS, playing);
+    lk_power_set_receiving(playing > 0);
+
+    // A single stream is played as is, the common case costs no mixing
+    auto pcm = playing == 1 ? frames[0] : NULL;
+    if (playing > 1) {
+      memset(mix, 0, sizeof(mix));
+      for (int i = 0; i < playing; i++) {
+        lk_audio_mix_add(mix, frames[i], AUDIO_FRAME_SAMPLES);
+      }
+      lk_audio_mix_saturate(mix, mixed, AUDIO_FRAME_SAMPLES);
+      pcm = mixed;
     }
+    lk_power_frame_done(start_us, AUDIO_FRAME_DURATION_MS * 1000);
+    lk_audio_play_frame(pcm);
   }
 }
 
 OpusEncoder *opus_encoder = NULL;
-opus_int16 *encoder_input_buffer = NULL;
-uint8_t *encoder_output_buffer = NULL;
+
+// Capture -> encode -> send pipeline. The encoder takes captured frames from
+// the HAL's DMA ring, which keeps filling while it works, and hands packets to
+// the publisher through a bounded SPSC queue, so a slow encode never holds up
+// peer_connection_loop and a slow network never holds up the mic.
+static lk_frame_queue opus_queue;
+static SemaphoreHandle_t opus_ready = NULL;
+
+// The microphone runs at AUDIO_HAL_SAMPLE_RATE, the encoder at SAMPLE_RATE
+static lk_resampler capture_resampler;
+
+// Frames without voice activity are not encoded. Each is sent as an empty Opus
+// frame, the TOC byte alone, which the far end conceals like DTX silence. The
+// hangover frames carry the background noise its decoder keeps playing, and the
+// RTP timestamp still advances one frame per packet
+static lk_vad capture_vad;
+
+// TOC of the last encoded packet with a single frame, initially SILK
+// narrowband 20 ms
+static uint8_t silent_frame_toc = 0x08;
+
+// The session the microphone is published on, mute requests go to it
+static lk_session *media_session = NULL;
 
 void lk_init_audio_encoder() {
-  int encoder_error;
-  opus_encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP,
-                                     &encoder_error);
-  if (encoder_error != OPUS_OK) {
+  opus_encoder =
+      (OpusEncoder *)lk_mem_alloc(LK_MEM_CODEC, opus_encoder_get_size(1));
+  if (opus_encoder == NULL) {
     printf("Failed to create OPUS encoder");
     return;
   }
@@ -179,23 +357,165 @@ void lk_init_audio_encoder() {
     return;
   }
 
-  opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(OPUS_ENCODER_BITRATE));
-  opus_encoder_ctl(opus_encoder, OPUS_SET_COMPLEXITY(OPUS_ENCODER_COMPLEXITY));
   opus_encoder_ctl(opus_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
-  encoder_input_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES);
-  encoder_output_buffer = (uint8_t *)malloc(OPUS_OUT_BUFFER_SIZE);
 }
 
+// Frames captured at another rate are resampled into this
+static opus_int16 resampled_pcm[AUDIO_FRAME_SAMPLES];
+
+static void lk_audio_encode_packet(const opus_int16 *pcm) {
+  auto packet = lk_frame_queue_acquire(&opus_queue);
+  if (packet == NULL) {
+    lk_metrics_count(LK_COUNTER_FRAMES_ENCODE_DROPPED);
+    return;
+  }
+
+  LK_TRACE_BEGIN(LK_TRACE_AUDIO_ENCODE);
+  lk_power_acquire(LK_POWER_LOCK_ENCODE);
+  auto start_us = esp_timer_get_time();
+  auto encoded_size = opus_encode(opus_encoder, pcm, AUDIO_FRAME_SAMPLES,
+                                  packet, OPUS_OUT_BUFFER_SIZE);
+  lk_metrics_record(LK_HISTOGRAM_ENCODE_US, start_us);
+  lk_power_release(LK_POWER_LOCK_ENCODE);
+  LK_TRACE_END(LK_TRACE_AUDIO_ENCODE);
+
+  if (encoded_size <= 0) {
+    ESP_LOGE(TAG, "Failed to encode audio frame: %d", encoded_size);
+    return;
+  }
+
+  // Silence, the decoder plays comfort noise
+  lk_metrics_count(encoded_size <= OPUS_DTX_PACKET_SIZE
+                       ? LK_COUNTER_FRAMES_DTX
+                       : LK_COUNTER_FRAMES_ENCODED);
+  silent_frame_toc = packet[0] & ~0x03;
+  lk_frame_queue_commit(&opus_queue, encoded_size);
+  xSemaphoreGive(opus_ready);
+}
+
+static void lk_audio_send_silent_frame() {
+  auto packet = lk_frame_queue_acquire(&opus_queue);
+  if (packet == NULL) {
+    lk_metrics_count(LK_COUNTER_FRAMES_ENCODE_DROPPED);
+    return;
+  }
+
+  packet[0] = silent_frame_toc;
+  lk_metrics_count(LK_COUNTER_FRAMES_VAD_SKIPPED);
+  lk_frame_queue_commit(&opus_queue, 1);
+  xSemaphoreGive(opus_ready);
+}
+
+// Define to send a MuteTrackRequest after this much silence, and unmute on
+// the next voiced frame. Other participants then see the device as muted,
+// but the SFU may drop the first packets after unmuting, so keep it long
+// #define LK_VAD_MUTE_AFTER_MS 30000
+
+// The audio input is the frame clock, every acquire returns exactly one
+// AUDIO_FRAME_DURATION_MS frame.
+void lk_audio_encoder_task(void *arg) {
+  auto applied_profile = LK_OPUS_PROFILE_COUNT;
+#ifdef LK_VAD_MUTE_AFTER_MS
+  uint32_t silent_ms = 0;
+#endif
+
+  while (1) {
+    auto start_us = esp_timer_get_time();
+    auto input = lk_audio_hal_acquire_input();
+    if (input == NULL) {
+      continue;
+    }
+    lk_metrics_record(LK_HISTOGRAM_AUDIO_READ_US, start_us);
+    lk_metrics_count(LK_COUNTER_FRAMES_CAPTURED);
+    auto captured_us = esp_timer_get_time();
+
+    // Profiles are switched between packets
+    auto requested_profile = lk_opus_profile_requested();
+    if (requested_profile != applied_profile) {
+      lk_opus_profile_apply(opus_encoder,
+                            lk_opus_profile_get(requested_profile));
+      applied_profile = requested_profile;
+    }
+
+    // At the codec rate the frame is encoded straight from DMA memory
+    auto pcm = input;
+    if (AUDIO_HAL_SAMPLE_RATE != SAMPLE_RATE) {
+      pcm = resampled_pcm;
+      lk_resampler_process(&capture_resampler, input, AUDIO_HAL_FRAME_SAMPLES,
+                           pcm);
+    }
+    lk_audio_apply_gain(pcm, AUDIO_FRAME_SAMPLES, AUDIO_CAPTURE_GAIN);
+    auto active = lk_vad_process(&capture_vad, pcm, AUDIO_FRAME_SAMPLES);
+
+    if (active) {
+      lk_audio_encode_packet(pcm);
+    } else {
+      lk_audio_send_silent_frame();
+    }
+    lk_power_frame_done(captured_us, AUDIO_FRAME_DURATION_MS * 1000);
+
+#ifdef LK_VAD_MUTE_AFTER_MS
+    if (active) {
+      silent_ms = 0;
+      lk_set_microphone_muted(media_session, false);
+    } else if (silent_ms < LK_VAD_MUTE_AFTER_MS) {
+      silent_ms += AUDIO_FRAME_DURATION_MS;
+      if (silent_ms >= LK_VAD_MUTE_AFTER_MS) {
+        lk_set_microphone_muted(media_session, true);
+      }
+    }
+#endif
+  }
+}
+
+void lk_start_audio_pipeline(lk_session *session) {
+  media_session = session;
+  lk_init_audio_encoder();
+
+  if (lk_frame_queue_init(&opus_queue, AUDIO_OPUS_QUEUE_DEPTH,
+                          OPUS_OUT_BUFFER_SIZE) != 0) {
+    ESP_LOGE(TAG, "Failed to allocate audio frame queue");
+    return;
+  }
+
+  if (lk_resampler_init(&capture_resampler, AUDIO_HAL_SAMPLE_RATE,
+                        SAMPLE_RATE, AUDIO_HAL_FRAME_SAMPLES) != 0) {
+    return;
+  }
+
+  lk_vad_init(&capture_vad, AUDIO_FRAME_DURATION_MS);
+
+  opus_ready = xSemaphoreCreateBinary();
+
+  // Encoding is the expensive stage and runs below the subscriber so that it
+  // can't delay incoming packets. The DMA ring covers
+  // AUDIO_HAL_INPUT_FRAMES - 1 frames of it falling behind before frames are
+  // dropped.
+  lk_mem_create_task(LK_MEM_STACK, lk_audio_encoder_task, "lk_audio_encoder",
+                     AUDIO_ENCODER_STACK_SIZE, NULL, 4, 1);
+}
+
+// Send stage, runs on the publisher task. Drains every encoded frame since the
+// last call.
 void lk_send_audio(PeerConnection *peer_connection) {
-  size_t bytes_read = 0;
+  LK_TRACE_SCOPE(LK_TRACE_SEND_AUDIO);
+  size_t packet_size = 0;
+  uint8_t *packet = NULL;
 
-  i2s_channel_read(rx_chan, encoder_input_buffer, BUFFER_SAMPLES, &bytes_read,
-           portMAX_DELAY);
+  lk_metrics_gauge_set(LK_GAUGE_OPUS_QUEUE_DEPTH,
+                       lk_frame_queue_depth(&opus_queue));
+  while ((packet = lk_frame_queue_peek(&opus_queue, &packet_size)) != NULL) {
+    peer_connection_send_audio(peer_connection, packet, packet_size);
+    lk_frame_queue_release(&opus_queue);
+    lk_metrics_count(LK_COUNTER_FRAMES_SENT);
+  }
+}
 
-  auto encoded_size =
-      opus_encode(opus_encoder, encoder_input_buffer, BUFFER_SAMPLES / 2,
-                  encoder_output_buffer, OPUS_OUT_BUFFER_SIZE);
+void lk_wait_for_audio_frame(uint32_t timeout_ms) {
+  if (opus_ready == NULL) {
+    vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+    return;
+  }
 
-  peer_connection_send_audio(peer_connection, encoder_output_buffer,
-                             encoded_size);
+  xSemaphoreTake(opus_ready, pdMS_TO_TICKS(timeout_ms));
 }
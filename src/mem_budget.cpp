@@ -0,0 +1,288 @@
+#include "mem_budget.h"
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#ifdef LINUX_BUILD
+#include <malloc.h>
+#include <pthread.h>
+#else
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#endif
+
+#include "text_buffer.h"
+
+#define LOG_TAG "mem_budget"
+
+typedef struct {
+  const char *name;
+#ifndef LINUX_BUILD
+  uint32_t caps;
+  uint32_t fallback_caps;
+#endif
+} lk_mem_placement;
+
+#define MEM_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define MEM_PSRAM MALLOC_CAP_SPIRAM
+
+#ifdef LINUX_BUILD
+#define LK_MEM_PLACEMENT(name, caps, fallback_caps) {name}
+#else
+#define LK_MEM_PLACEMENT(name, caps, fallback_caps) {name, caps, fallback_caps}
+#endif
+
+// Hot data in internal RAM, it is faster and doesn't contend with the PSRAM
+// cache
+static const lk_mem_placement placements[LK_MEM_TAG_COUNT] = {
+    LK_MEM_PLACEMENT("signaling", MEM_PSRAM, MEM_INTERNAL),
+    LK_MEM_PLACEMENT("codec", MEM_INTERNAL, MEM_PSRAM),
+    LK_MEM_PLACEMENT("tls", MEM_INTERNAL, MEM_PSRAM),
+    LK_MEM_PLACEMENT("audio", MEM_INTERNAL, MEM_PSRAM),
+    LK_MEM_PLACEMENT("stack", MEM_INTERNAL, MEM_PSRAM),
+    LK_MEM_PLACEMENT("cold_stack", MEM_PSRAM, MEM_INTERNAL),
+};
+
+typedef struct {
+  std::atomic<uint32_t> in_use;
+  std::atomic<uint32_t> high_water;
+  std::atomic<uint32_t> fallbacks;  // placed in the other memory
+  std::atomic<uint32_t> failures;
+} lk_mem_usage;
+
+static lk_mem_usage usage[LK_MEM_TAG_COUNT];
+
+// What the heap actually reserved, the same figure is subtracted on free
+static size_t lk_mem_size(void *pointer) {
+#ifdef LINUX_BUILD
+  return malloc_usable_size(pointer);
+#else
+  return heap_caps_get_allocated_size(pointer);
+#endif
+}
+
+static void *lk_mem_account(lk_mem_tag tag, void *pointer, bool fallback) {
+  auto &u = usage[tag];
+  if (pointer == NULL) {
+    u.failures.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+  if (fallback) {
+    u.fallbacks.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  auto size = lk_mem_size(pointer);
+  auto in_use = u.in_use.fetch_add(size, std::memory_order_relaxed) + size;
+  auto high_water = u.high_water.load(std::memory_order_relaxed);
+  while (in_use > high_water &&
+         !u.high_water.compare_exchange_weak(high_water, in_use,
+                                             std::memory_order_relaxed)) {
+  }
+  return pointer;
+}
+
+void *lk_mem_alloc(lk_mem_tag tag, size_t size) {
+#ifdef LINUX_BUILD
+  return lk_mem_account(tag, malloc(size), false);
+#else
+  auto pointer = heap_caps_malloc(size, placements[tag].caps);
+  if (pointer != NULL || size == 0) {
+    return lk_mem_account(tag, pointer, false);
+  }
+  return lk_mem_account(
+      tag, heap_caps_malloc(size, placements[tag].fallback_caps), true);
+#endif
+}
+
+void *lk_mem_calloc(lk_mem_tag tag, size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    return lk_mem_account(tag, NULL, false);
+  }
+
+  auto pointer = lk_mem_alloc(tag, count * size);
+  if (pointer != NULL) {
+    memset(pointer, 0, count * size);
+  }
+  return pointer;
+}
+
+void *lk_mem_aligned_alloc(lk_mem_tag tag, size_t alignment, size_t size) {
+#ifdef LINUX_BUILD
+  auto rounded = (size + alignment - 1) & ~(alignment - 1);
+  return lk_mem_account(tag, aligned_alloc(alignment, rounded), false);
+#else
+  auto pointer = heap_caps_aligned_alloc(alignment, size, placements[tag].caps);
+  if (pointer != NULL) {
+    return lk_mem_account(tag, pointer, false);
+  }
+  return lk_mem_account(
+      tag,
+      heap_caps_aligned_alloc(alignment, size, placements[tag].fallback_caps),
+      true);
+#endif
+}
+
+void *lk_mem_realloc(lk_mem_tag tag, void *pointer, size_t size) {
+  if (pointer == NULL) {
+    return lk_mem_alloc(tag, size);
+  }
+
+  auto old_size = lk_mem_size(pointer);
+#ifdef LINUX_BUILD
+  auto resized = realloc(pointer, size);
+  auto fallback = false;
+#else
+  auto resized = heap_caps_realloc(pointer, size, placements[tag].caps);
+  auto fallback = false;
+  if (resized == NULL) {
+    resized = heap_caps_realloc(pointer, size, placements[tag].fallback_caps);
+    fallback = true;
+  }
+#endif
+  if (resized == NULL) {
+    return lk_mem_account(tag, NULL, false);
+  }
+
+  usage[tag].in_use.fetch_sub(old_size, std::memory_order_relaxed);
+  return lk_mem_account(tag, resized, fallback);
+}
+
+char *lk_mem_strdup(lk_mem_tag tag, const char *string) {
+  auto size = strlen(string) + 1;
+  auto copy = (char *)lk_mem_alloc(tag, size);
+  if (copy != NULL) {
+    memcpy(copy, string, size);
+  }
+  return copy;
+}
+
+void lk_mem_free(lk_mem_tag tag, void *pointer) {
+  if (pointer == NULL) {
+    return;
+  }
+
+  usage[tag].in_use.fetch_sub(lk_mem_size(pointer),
+                              std::memory_order_relaxed);
+#ifdef LINUX_BUILD
+  free(pointer);
+#else
+  heap_caps_free(pointer);
+#endif
+}
+
+#ifdef CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+// mbedTLS calls these for every allocation instead of its built-in internal
+// RAM only allocator, which fails once internal RAM is fragmented
+extern "C" void *esp_mbedtls_mem_calloc(size_t count, size_t size) {
+  return lk_mem_calloc(LK_MEM_TLS, count, size);
+}
+
+extern "C" void esp_mbedtls_mem_free(void *pointer) {
+  lk_mem_free(LK_MEM_TLS, pointer);
+}
+#endif
+
+int lk_mem_create_task(lk_mem_tag stack_tag, TaskFunction_t task,
+                       const char *name, uint32_t stack_size, void *arg,
+                       UBaseType_t priority, BaseType_t core) {
+#ifdef LINUX_BUILD
+  // The thread function has no room for both, they are passed together
+  struct lk_mem_thread {
+    TaskFunction_t task;
+    void *arg;
+    char name[16];  // the most pthread_setname_np takes
+  };
+
+  auto thread = (lk_mem_thread *)malloc(sizeof(lk_mem_thread));
+  if (thread == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate %s task", name);
+    return -1;
+  }
+  thread->task = task;
+  thread->arg = arg;
+  snprintf(thread->name, sizeof(thread->name), "%s", name);
+
+  pthread_t thread_handle;
+  if (pthread_create(
+          &thread_handle, NULL,
+          [](void *thread) -> void * {
+            auto task = ((lk_mem_thread *)thread)->task;
+            auto arg = ((lk_mem_thread *)thread)->arg;
+            // Named like the task, for debuggers and trace.json
+            pthread_setname_np(pthread_self(), ((lk_mem_thread *)thread)->name);
+            free(thread);
+            task(arg);
+            return NULL;
+          },
+          thread) != 0) {
+    free(thread);
+    return -1;
+  }
+  pthread_detach(thread_handle);
+  return 0;
+#else
+  // The TCB is accessed on every context switch, it stays internal
+  auto task_buffer = (StaticTask_t *)heap_caps_malloc(sizeof(StaticTask_t),
+                                                      MEM_INTERNAL);
+  auto stack_memory = (StackType_t *)lk_mem_alloc(
+      stack_tag, stack_size * sizeof(StackType_t));
+  if (task_buffer == NULL || stack_memory == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate %s task", name);
+    heap_caps_free(task_buffer);
+    lk_mem_free(stack_tag, stack_memory);
+    return -1;
+  }
+
+  // Still runs, but every stack access can miss the PSRAM cache and the task
+  // stalls while flash is written
+  if (stack_tag == LK_MEM_STACK && !esp_ptr_internal(stack_memory)) {
+    ESP_LOGE(LOG_TAG,
+             "%s stack is in PSRAM, internal RAM is exhausted. Audio will "
+             "glitch",
+             name);
+  }
+
+  xTaskCreateStaticPinnedToCore(task, name, stack_size, arg, priority,
+                                stack_memory, task_buffer, core);
+  return 0;
+#endif
+}
+
+size_t lk_mem_report(char *out, size_t out_size) {
+  lk_text_buffer text;
+  lk_text_buffer_init(&text, out, out_size);
+
+  lk_text_append(&text, "\nmemory_kb:");
+  for (int i = 0; i < LK_MEM_TAG_COUNT; i++) {
+    auto &u = usage[i];
+    lk_text_append(
+        &text, " %s=%lu/%lu", placements[i].name,
+        (unsigned long)u.in_use.load(std::memory_order_relaxed) / 1024,
+        (unsigned long)u.high_water.load(std::memory_order_relaxed) / 1024);
+  }
+
+  lk_text_append(&text, "\nmemory_misplaced:");
+  for (int i = 0; i < LK_MEM_TAG_COUNT; i++) {
+    auto &u = usage[i];
+    lk_text_append(&text, " %s=%lu/%lu", placements[i].name,
+                   (unsigned long)u.fallbacks.load(std::memory_order_relaxed),
+                   (unsigned long)u.failures.load(std::memory_order_relaxed));
+  }
+
+#ifndef LINUX_BUILD
+  lk_text_append(
+      &text, "\nheap_kb: internal=%lu min=%lu largest=%lu psram=%lu min=%lu",
+      (unsigned long)heap_caps_get_free_size(MEM_INTERNAL) / 1024,
+      (unsigned long)heap_caps_get_minimum_free_size(MEM_INTERNAL) / 1024,
+      (unsigned long)heap_caps_get_largest_free_block(MEM_INTERNAL) / 1024,
+      (unsigned long)heap_caps_get_free_size(MEM_PSRAM) / 1024,
+      (unsigned long)heap_caps_get_minimum_free_size(MEM_PSRAM) / 1024);
+#endif
+
+  return lk_text_buffer_length(&text);
+}
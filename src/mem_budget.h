@@ -0,0 +1,47 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every allocation the SDK makes goes through here with the tag of the
+// subsystem it belongs to. The tag decides where it is placed on target
+// (internal RAM for what is touched every frame, PSRAM for bulk data), and
+// in-use and high-water bytes are kept per tag so internal RAM that lwIP and
+// mbedTLS need can be budgeted. An allocation that doesn't fit where its tag
+// wants it goes to the other memory instead of failing, and is counted.
+//
+// On linux there is one heap, only the accounting applies.
+
+typedef enum {
+  LK_MEM_SIGNALING,   // SDP and protobuf buffers, sessions. PSRAM
+  LK_MEM_CODEC,       // Opus state and the stream pool. Internal
+  LK_MEM_TLS,         // mbedTLS: DTLS-SRTP and the websocket. Internal
+  LK_MEM_AUDIO,       // PCM touched every frame, resamplers, queues. Internal
+  LK_MEM_STACK,       // media and PeerConnection task stacks. Internal
+  LK_MEM_COLD_STACK,  // stacks of tasks that rarely wake up. PSRAM
+  LK_MEM_TAG_COUNT,
+} lk_mem_tag;
+
+// Memory from these must be released with lk_mem_free and the same tag
+void *lk_mem_alloc(lk_mem_tag tag, size_t size);
+void *lk_mem_calloc(lk_mem_tag tag, size_t count, size_t size);
+void *lk_mem_aligned_alloc(lk_mem_tag tag, size_t alignment, size_t size);
+void *lk_mem_realloc(lk_mem_tag tag, void *pointer, size_t size);
+char *lk_mem_strdup(lk_mem_tag tag, const char *string);
+void lk_mem_free(lk_mem_tag tag, void *pointer);
+
+// Starts a task with its stack allocated as stack_tag, LK_MEM_STACK or
+// LK_MEM_COLD_STACK. A task in PSRAM stalls on cache misses and can't run
+// while flash is written, so only tasks off the audio path go there. An
+// LK_MEM_STACK stack that had to fall back to PSRAM is logged as an error. On
+// linux it is a thread and stack_size, priority and core are ignored. Returns
+// 0 on success
+int lk_mem_create_task(lk_mem_tag stack_tag, TaskFunction_t task,
+                       const char *name, uint32_t stack_size, void *arg,
+                       UBaseType_t priority, BaseType_t core);
+
+// Appends per tag in-use/high-water KB, fallbacks and failures, and on target
+// the free internal RAM and PSRAM. Returns the length written
+size_t lk_mem_report(char *out, size_t out_size);
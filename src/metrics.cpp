@@ -0,0 +1,179 @@
+#include "metrics.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "mem_budget.h"
+#include "power.h"
+#include "text_buffer.h"
+#include "trace.h"
+
+#define LOG_TAG "metrics"
+
+#define METRICS_REPORT_SIZE 2048
+#define METRICS_TASK_STACK_SIZE 4096
+
+typedef struct {
+  std::atomic<uint32_t> buckets[LK_METRICS_HISTOGRAM_BUCKETS];
+  std::atomic<uint32_t> sum_us;  // wraps after ~71 minutes within a report
+  std::atomic<uint32_t> max_us;
+} lk_metrics_histogram_data;
+
+typedef struct {
+  std::atomic<uint32_t> value;
+  std::atomic<uint32_t> max;
+} lk_metrics_gauge_data;
+
+static std::atomic<uint32_t> counters[LK_COUNTER_COUNT];
+static lk_metrics_gauge_data gauges[LK_GAUGE_COUNT];
+static lk_metrics_histogram_data histograms[LK_HISTOGRAM_COUNT];
+
+static const char *counter_names[LK_COUNTER_COUNT] = {
+    "captured",   "capture_dropped", "encoded",   "encode_dropped",
+    "dtx",        "vad_skipped",     "sent",      "received",
+    "no_stream",  "decoded",         "recovered", "concealed",
+    "silence",    "silent_out",      "signal_tx", "signal_rx",
+    "reconnects",
+};
+
+static const char *gauge_names[LK_GAUGE_COUNT] = {
+    "capture_backlog",
+    "opus_queue",
+    "jitter_depth",
+    "jitter_target",
+    "streams",
+    "subscribed",
+};
+
+static const char *histogram_names[LK_HISTOGRAM_COUNT] = {
+    "encode",         "decode",          "audio_read",   "audio_write",
+    "publisher_loop", "subscriber_loop", "offer_answer", "answer_local",
+    "reconnect",
+};
+
+static void lk_metrics_atomic_max(std::atomic<uint32_t> *max, uint32_t value) {
+  auto current = max->load(std::memory_order_relaxed);
+  while (value > current &&
+         !max->compare_exchange_weak(current, value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+void lk_metrics_count(lk_metrics_counter counter, uint32_t n) {
+  counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void lk_metrics_gauge_set(lk_metrics_gauge gauge, uint32_t value) {
+  gauges[gauge].value.store(value, std::memory_order_relaxed);
+  lk_metrics_atomic_max(&gauges[gauge].max, value);
+}
+
+void lk_metrics_record_value(lk_metrics_histogram histogram,
+                             uint32_t value_us) {
+  auto h = &histograms[histogram];
+  int bucket = value_us == 0 ? 0 : 32 - __builtin_clz(value_us);
+  if (bucket >= LK_METRICS_HISTOGRAM_BUCKETS) {
+    bucket = LK_METRICS_HISTOGRAM_BUCKETS - 1;
+  }
+
+  h->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  h->sum_us.fetch_add(value_us, std::memory_order_relaxed);
+  lk_metrics_atomic_max(&h->max_us, value_us);
+}
+
+void lk_metrics_record(lk_metrics_histogram histogram, int64_t start_us) {
+  auto elapsed_us = esp_timer_get_time() - start_us;
+  if (elapsed_us < 0) {
+    elapsed_us = 0;
+  } else if (elapsed_us > UINT32_MAX) {
+    elapsed_us = UINT32_MAX;
+  }
+  lk_metrics_record_value(histogram, (uint32_t)elapsed_us);
+}
+
+// Upper bound of the bucket that holds the given percentile
+static uint32_t lk_metrics_percentile(const uint32_t *buckets, uint32_t count,
+                                      uint32_t percent) {
+  uint32_t rank = (count * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < LK_METRICS_HISTOGRAM_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return i == 0 ? 1 : 1u << i;
+    }
+  }
+  return 1u << (LK_METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+// Counts recorded while the snapshot runs land in the next report, none are
+// lost. A report can be slightly inconsistent across metrics.
+size_t lk_metrics_snapshot(char *out, size_t out_size) {
+  lk_text_buffer text;
+  lk_text_buffer_init(&text, out, out_size);
+
+  lk_text_append(&text, "counters:");
+  for (int i = 0; i < LK_COUNTER_COUNT; i++) {
+    lk_text_append(
+        &text, " %s=%lu", counter_names[i],
+        (unsigned long)counters[i].exchange(0, std::memory_order_relaxed));
+  }
+
+  lk_text_append(&text, "\ngauges:");
+  for (int i = 0; i < LK_GAUGE_COUNT; i++) {
+    auto value = gauges[i].value.load(std::memory_order_relaxed);
+    auto max = gauges[i].max.exchange(value, std::memory_order_relaxed);
+    lk_text_append(&text, " %s=%lu/%lu", gauge_names[i], (unsigned long)value,
+                   (unsigned long)max);
+  }
+
+  for (int i = 0; i < LK_HISTOGRAM_COUNT; i++) {
+    auto h = &histograms[i];
+    uint32_t buckets[LK_METRICS_HISTOGRAM_BUCKETS];
+    uint32_t count = 0;
+    for (int b = 0; b < LK_METRICS_HISTOGRAM_BUCKETS; b++) {
+      buckets[b] = h->buckets[b].exchange(0, std::memory_order_relaxed);
+      count += buckets[b];
+    }
+    auto sum_us = h->sum_us.exchange(0, std::memory_order_relaxed);
+    auto max_us = h->max_us.exchange(0, std::memory_order_relaxed);
+    if (count == 0) {
+      continue;
+    }
+
+    lk_text_append(&text, "\n%s_us: n=%lu avg=%lu p50<%lu p99<%lu max=%lu",
+                   histogram_names[i], (unsigned long)count,
+                   (unsigned long)(sum_us / count),
+                   (unsigned long)lk_metrics_percentile(buckets, count, 50),
+                   (unsigned long)lk_metrics_percentile(buckets, count, 99),
+                   (unsigned long)max_us);
+  }
+
+  return lk_text_buffer_length(&text);
+}
+
+static void lk_metrics_report_task(void *arg) {
+  static char report[METRICS_REPORT_SIZE];
+
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(LK_METRICS_INTERVAL_MS));
+
+    auto len = lk_metrics_snapshot(report, sizeof(report));
+    len += lk_mem_report(report + len, sizeof(report) - len);
+    lk_power_report(report + len, sizeof(report) - len);
+    ESP_LOGI(LOG_TAG, "\n%s", report);
+#if defined(LK_TRACE) && defined(LINUX_BUILD)
+    lk_trace_dump();
+#endif
+  }
+}
+
+// Wakes up once a report, its stack can live in PSRAM
+void lk_metrics_init(void) {
+  lk_mem_create_task(LK_MEM_COLD_STACK, lk_metrics_report_task, "lk_metrics",
+                     METRICS_TASK_STACK_SIZE, NULL, 1, 0);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Runtime counters, gauges and latency histograms for the media and
+// signaling paths. Recording is lock-free and safe from any task, a report
+// task snapshots and resets everything once per LK_METRICS_INTERVAL_MS.
+#ifndef LK_METRICS_INTERVAL_MS
+#define LK_METRICS_INTERVAL_MS 10000
+#endif
+
+// Bucket i counts values in [2^(i-1), 2^i) microseconds, the last bucket also
+// holds everything larger (~8.4s)
+#define LK_METRICS_HISTOGRAM_BUCKETS 24
+
+typedef enum {
+  LK_COUNTER_FRAMES_CAPTURED = 0,
+  LK_COUNTER_FRAMES_CAPTURE_DROPPED,  // encoder fell behind the microphone
+  LK_COUNTER_FRAMES_ENCODED,
+  LK_COUNTER_FRAMES_ENCODE_DROPPED,  // sender fell behind the encoder
+  LK_COUNTER_FRAMES_DTX,             // silence, sent as a 1-2 byte frame
+  LK_COUNTER_FRAMES_VAD_SKIPPED,     // no voice, sent as an empty frame
+  LK_COUNTER_FRAMES_SENT,
+  LK_COUNTER_PACKETS_RECEIVED,
+  LK_COUNTER_PACKETS_NO_STREAM,  // more remote tracks than streams
+  LK_COUNTER_FRAMES_DECODED,
+  LK_COUNTER_FRAMES_RECOVERED,  // rebuilt from inband FEC
+  LK_COUNTER_FRAMES_CONCEALED,
+  LK_COUNTER_FRAMES_SILENCE,  // jitter buffer empty
+  LK_COUNTER_FRAMES_PLAYOUT_SILENT,  // played without conversion
+  LK_COUNTER_SIGNAL_SENT,
+  LK_COUNTER_SIGNAL_RECEIVED,
+  LK_COUNTER_RECONNECTS,
+  LK_COUNTER_COUNT,
+} lk_metrics_counter;
+
+// Current value and the largest value since the last report
+typedef enum {
+  LK_GAUGE_CAPTURE_BACKLOG = 0,  // frames waiting in the DMA ring
+  LK_GAUGE_OPUS_QUEUE_DEPTH,
+  LK_GAUGE_JITTER_BUFFER_DEPTH,
+  LK_GAUGE_JITTER_BUFFER_TARGET,
+  LK_GAUGE_PLAYING_STREAMS,
+  LK_GAUGE_SUBSCRIBED_TRACKS,  // remote audio tracks subscribed
+  LK_GAUGE_COUNT,
+} lk_metrics_gauge;
+
+typedef enum {
+  LK_HISTOGRAM_ENCODE_US = 0,
+  LK_HISTOGRAM_DECODE_US,
+  LK_HISTOGRAM_AUDIO_READ_US,   // lk_audio_hal_acquire_input blocked
+  LK_HISTOGRAM_AUDIO_WRITE_US,  // lk_audio_hal_acquire_output blocked
+  LK_HISTOGRAM_PUBLISHER_LOOP_US,
+  LK_HISTOGRAM_SUBSCRIBER_LOOP_US,  // includes waiting for packets
+  LK_HISTOGRAM_OFFER_ANSWER_US,   // publisher offer sent -> answer received
+  LK_HISTOGRAM_ANSWER_LOCAL_US,   // subscriber offer received -> answer sent
+  LK_HISTOGRAM_RECONNECT_US,      // connection lost -> both reconnected
+  LK_HISTOGRAM_COUNT,
+} lk_metrics_histogram;
+
+// Starts the report task, reports cover every session in the process
+void lk_metrics_init(void);
+
+void lk_metrics_count(lk_metrics_counter counter, uint32_t n = 1);
+void lk_metrics_gauge_set(lk_metrics_gauge gauge, uint32_t value);
+
+// Records esp_timer_get_time() - start_us
+void lk_metrics_record(lk_metrics_histogram histogram, int64_t start_us);
+void lk_metrics_record_value(lk_metrics_histogram histogram, uint32_t value_us);
+
+// Writes a text report of everything recorded since the last snapshot and
+// resets it. Returns the length written
+size_t lk_metrics_snapshot(char *out, size_t out_size);
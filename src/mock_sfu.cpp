@@ -0,0 +1,795 @@
+#include "mock_sfu.h"
+
+#include <arpa/inet.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <livekit_rtc.pb-c.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/sha1.h>
+#include <netinet/in.h>
+#include <peer.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "sdp.h"
+#include "signal_record.h"
+
+#define LOG_TAG "mock_sfu"
+
+#define MOCK_SFU_POLL_INTERVAL_MS 5
+#define MOCK_SFU_RECEIVE_SIZE 4096
+#define MOCK_SFU_HANDSHAKE_MAX 8192
+#define MOCK_SFU_MESSAGE_MAX (256 * 1024)
+#define MOCK_SFU_SDP_SIZE 8192
+#define MOCK_SFU_CANDIDATE_SIZE 512
+
+#define MOCK_SFU_PARTICIPANT_SID "PA_mock"
+#define MOCK_SFU_TRACK_SID "TR_mock_microphone"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_OPCODE_CONTINUATION 0x0
+#define WEBSOCKET_OPCODE_BINARY 0x2
+#define WEBSOCKET_OPCODE_CLOSE 0x8
+#define WEBSOCKET_OPCODE_PING 0x9
+#define WEBSOCKET_OPCODE_PONG 0xA
+
+struct lk_mock_sfu {
+  lk_mock_sfu_config config;
+  int listen_fd;
+  int port;
+
+  // The connected client, -1 if none. Everything below is per connection
+  // and only touched by the mock's thread unless noted
+  int client_fd;
+  bool upgraded;
+  uint8_t *received;
+  size_t received_size;
+  uint8_t *message;  // binary message assembled from its fragments
+  size_t message_size;
+
+  FILE *replay;
+  int64_t replay_start_time;
+  int64_t replay_first_time_us;  // of the first recorded response
+  lk_signal_record_header replay_header;
+  uint8_t *replay_frame;
+  bool replay_pending;
+
+  PeerConnection *subscriber;
+  PeerConnection *publisher;
+  char *subscriber_offer;  // local description of subscriber, to send
+  char *publisher_offer;   // from the client, answered once publisher has
+  char *publisher_local;   // a local description
+  char *subscriber_answer;  // from the client, waiting for candidates
+
+  // Set by the client's tasks
+  pthread_mutex_t mutex;
+  char *subscriber_candidates;
+};
+
+static int64_t lk_mock_sfu_now_us() {
+  return esp_timer_get_time();
+}
+
+static void lk_mock_sfu_send_all(lk_mock_sfu *mock, const uint8_t *data,
+                                 size_t size) {
+  while (size > 0 && mock->client_fd >= 0) {
+    auto sent = send(mock->client_fd, data, size, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      ESP_LOGW(LOG_TAG, "Failed to send to client");
+      return;
+    }
+    data += sent;
+    size -= sent;
+  }
+}
+
+static void lk_mock_sfu_send_frame(lk_mock_sfu *mock, int opcode,
+                                   const uint8_t *data, size_t size) {
+  // Server frames are never masked
+  uint8_t header[10];
+  size_t header_size = 2;
+  header[0] = 0x80 | opcode;
+  if (size < 126) {
+    header[1] = size;
+  } else if (size <= 0xffff) {
+    header[1] = 126;
+    header[2] = size >> 8;
+    header[3] = size & 0xff;
+    header_size = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      header[2 + i] = (uint64_t)size >> (56 - 8 * i);
+    }
+    header_size = 10;
+  }
+
+  lk_mock_sfu_send_all(mock, header, header_size);
+  lk_mock_sfu_send_all(mock, data, size);
+}
+
+static void lk_mock_sfu_send(lk_mock_sfu *mock,
+                             const Livekit__SignalResponse *response) {
+  auto size = livekit__signal_response__get_packed_size(response);
+  auto buffer = (uint8_t *)malloc(size > 0 ? size : 1);
+  if (buffer == NULL) {
+    return;
+  }
+  livekit__signal_response__pack(response, buffer);
+  lk_mock_sfu_send_frame(mock, WEBSOCKET_OPCODE_BINARY, buffer, size);
+  free(buffer);
+}
+
+static void lk_mock_sfu_send_trickle(lk_mock_sfu *mock,
+                                     Livekit__SignalTarget target,
+                                     std::string_view candidate) {
+  char candidate_init[MOCK_SFU_CANDIDATE_SIZE];
+  snprintf(candidate_init, sizeof(candidate_init),
+           "{\"candidate\":\"%.*s\",\"sdpMid\":\"0\",\"sdpMLineIndex\":0}",
+           (int)candidate.size(), candidate.data());
+
+  Livekit__TrickleRequest trickle = LIVEKIT__TRICKLE_REQUEST__INIT;
+  trickle.candidateinit = candidate_init;
+  trickle.target = target;
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRICKLE;
+  response.trickle = &trickle;
+  lk_mock_sfu_send(mock, &response);
+}
+
+static bool lk_mock_sfu_is_candidate(const lk_sdp_line *line) {
+  return line->type == 'a' && line->value.substr(0, 10) == "candidate:";
+}
+
+// Like LiveKit, candidates are left out of the description and trickled
+// after it with lk_mock_sfu_send_candidates
+
+static void lk_mock_sfu_send_description(lk_mock_sfu *mock, const char *type,
+                                         const char *description) {
+  static char sdp[MOCK_SFU_SDP_SIZE];
+  size_t len = 0;
+  std::string_view remaining = description;
+  lk_sdp_line line;
+  while (lk_sdp_next_line(&remaining, &line) && len < sizeof(sdp)) {
+    if (lk_mock_sfu_is_candidate(&line) ||
+        (line.type == 'a' && line.value == "end-of-candidates")) {
+      continue;
+    }
+    auto ret = snprintf(sdp + len, sizeof(sdp) - len, "%c=%.*s\r\n",
+                        line.type, (int)line.value.size(), line.value.data());
+    len += ret > 0 ? ret : 0;
+  }
+
+  Livekit__SessionDescription session_description =
+      LIVEKIT__SESSION_DESCRIPTION__INIT;
+  session_description.type = (char *)type;
+  session_description.sdp = sdp;
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  if (strcmp(type, "offer") == 0) {
+    response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_OFFER;
+    response.offer = &session_description;
+  } else {
+    response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ANSWER;
+    response.answer = &session_description;
+  }
+  lk_mock_sfu_send(mock, &response);
+}
+
+static void lk_mock_sfu_send_candidates(lk_mock_sfu *mock,
+                                        Livekit__SignalTarget target,
+                                        const char *description) {
+  std::string_view remaining = description;
+  lk_sdp_line line;
+  while (lk_sdp_next_line(&remaining, &line)) {
+    if (lk_mock_sfu_is_candidate(&line)) {
+      lk_mock_sfu_send_trickle(mock, target, line.value);
+    }
+  }
+}
+
+static void lk_mock_sfu_send_join(lk_mock_sfu *mock) {
+  Livekit__Room room = LIVEKIT__ROOM__INIT;
+  room.sid = (char *)"RM_mock";
+  room.name = (char *)"mock";
+  Livekit__ParticipantInfo participant = LIVEKIT__PARTICIPANT_INFO__INIT;
+  participant.sid = (char *)MOCK_SFU_PARTICIPANT_SID;
+  participant.identity = (char *)"device";
+  Livekit__JoinResponse join = LIVEKIT__JOIN_RESPONSE__INIT;
+  join.room = &room;
+  join.participant = &participant;
+
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN;
+  response.join = &join;
+  lk_mock_sfu_send(mock, &response);
+}
+
+static void lk_mock_sfu_send_track_published(
+    lk_mock_sfu *mock, const Livekit__AddTrackRequest *a) {
+  Livekit__TrackInfo track = LIVEKIT__TRACK_INFO__INIT;
+  track.sid = (char *)MOCK_SFU_TRACK_SID;
+  track.name = a->name;
+  track.type = LIVEKIT__TRACK_TYPE__AUDIO;
+  track.source = a->source;
+  Livekit__TrackPublishedResponse published =
+      LIVEKIT__TRACK_PUBLISHED_RESPONSE__INIT;
+  published.cid = a->cid;
+  published.track = &track;
+
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRACK_PUBLISHED;
+  response.track_published = &published;
+  lk_mock_sfu_send(mock, &response);
+}
+
+// Adds every candidate of an SDP to peer_connection
+static void lk_mock_sfu_add_candidates(PeerConnection *peer_connection,
+                                       const char *description) {
+  std::string_view remaining = description;
+  lk_sdp_line line;
+  while (lk_sdp_next_line(&remaining, &line)) {
+    if (!lk_mock_sfu_is_candidate(&line)) {
+      continue;
+    }
+    char candidate[MOCK_SFU_CANDIDATE_SIZE];
+    snprintf(candidate, sizeof(candidate), "%.*s", (int)line.value.size(),
+             line.value.data());
+    peer_connection_add_ice_candidate(peer_connection, candidate);
+  }
+}
+
+static PeerConnection *lk_mock_sfu_create_peer_connection(
+    lk_mock_sfu *mock, bool subscriber) {
+  PeerConfiguration peer_connection_config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_OPUS,
+      .video_codec = CODEC_NONE,
+      .datachannel = subscriber ? DATA_CHANNEL_STRING : DATA_CHANNEL_NONE,
+      .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) {},
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = mock,
+  };
+
+  auto peer_connection = peer_connection_create(&peer_connection_config);
+  if (peer_connection == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to create peer connection");
+    return NULL;
+  }
+
+  // Called from peer_connection_loop on the mock's thread
+  if (subscriber) {
+    peer_connection_onicecandidate(
+        peer_connection, [](char *description, void *user_data) {
+          auto mock = (lk_mock_sfu *)user_data;
+          free(mock->subscriber_offer);
+          mock->subscriber_offer = strdup(description);
+        });
+  } else {
+    peer_connection_onicecandidate(
+        peer_connection, [](char *description, void *user_data) {
+          auto mock = (lk_mock_sfu *)user_data;
+          free(mock->publisher_local);
+          mock->publisher_local = strdup(description);
+        });
+  }
+  return peer_connection;
+}
+
+static void lk_mock_sfu_close_client(lk_mock_sfu *mock) {
+  if (mock->client_fd >= 0) {
+    close(mock->client_fd);
+    mock->client_fd = -1;
+  }
+  mock->upgraded = false;
+  mock->received_size = 0;
+  mock->message_size = 0;
+
+  if (mock->replay != NULL) {
+    fclose(mock->replay);
+    mock->replay = NULL;
+  }
+  mock->replay_pending = false;
+
+  if (mock->subscriber != NULL) {
+    peer_connection_destroy(mock->subscriber);
+    mock->subscriber = NULL;
+  }
+  if (mock->publisher != NULL) {
+    peer_connection_destroy(mock->publisher);
+    mock->publisher = NULL;
+  }
+  free(mock->subscriber_offer);
+  mock->subscriber_offer = NULL;
+  free(mock->publisher_offer);
+  mock->publisher_offer = NULL;
+  free(mock->publisher_local);
+  mock->publisher_local = NULL;
+  free(mock->subscriber_answer);
+  mock->subscriber_answer = NULL;
+
+  pthread_mutex_lock(&mock->mutex);
+  free(mock->subscriber_candidates);
+  mock->subscriber_candidates = NULL;
+  pthread_mutex_unlock(&mock->mutex);
+}
+
+// The client is joined as soon as the upgrade is accepted
+static void lk_mock_sfu_on_join(lk_mock_sfu *mock) {
+  if (mock->config.replay_path != NULL) {
+    mock->replay = lk_signal_record_open(mock->config.replay_path);
+    if (mock->replay == NULL) {
+      ESP_LOGE(LOG_TAG, "%s is not a signaling recording",
+               mock->config.replay_path);
+    }
+    mock->replay_start_time = lk_mock_sfu_now_us();
+    mock->replay_first_time_us = -1;
+    return;
+  }
+
+  lk_mock_sfu_send_join(mock);
+  mock->subscriber = lk_mock_sfu_create_peer_connection(mock, true);
+  mock->publisher = lk_mock_sfu_create_peer_connection(mock, false);
+  if (mock->subscriber != NULL) {
+    peer_connection_create_offer(mock->subscriber);
+  }
+}
+
+static int lk_mock_sfu_handshake(lk_mock_sfu *mock) {
+  mock->received[mock->received_size] = '\0';
+  auto end = strstr((char *)mock->received, "\r\n\r\n");
+  if (end == NULL) {
+    return mock->received_size < MOCK_SFU_HANDSHAKE_MAX ? 0 : -1;
+  }
+
+  auto key = strcasestr((char *)mock->received, "Sec-WebSocket-Key:");
+  if (key == NULL || key > end) {
+    ESP_LOGE(LOG_TAG, "Not a websocket upgrade");
+    return -1;
+  }
+  key += strlen("Sec-WebSocket-Key:");
+  key += strspn(key, " ");
+  auto key_size = strcspn(key, "\r\n ");
+
+  char accept_input[128];
+  unsigned char digest[20];
+  unsigned char accept[32];
+  size_t accept_size = 0;
+  snprintf(accept_input, sizeof(accept_input), "%.*s" WEBSOCKET_GUID,
+           (int)key_size, key);
+  if (mbedtls_sha1((const unsigned char *)accept_input, strlen(accept_input),
+                   digest) != 0 ||
+      mbedtls_base64_encode(accept, sizeof(accept), &accept_size, digest,
+                            sizeof(digest)) != 0) {
+    return -1;
+  }
+
+  char response[256];
+  auto response_size =
+      snprintf(response, sizeof(response),
+               "HTTP/1.1 101 Switching Protocols\r\n"
+               "Upgrade: websocket\r\n"
+               "Connection: Upgrade\r\n"
+               "Sec-WebSocket-Accept: %.*s\r\n\r\n",
+               (int)accept_size, accept);
+  lk_mock_sfu_send_all(mock, (const uint8_t *)response, response_size);
+
+  auto consumed = (size_t)(end + 4 - (char *)mock->received);
+  memmove(mock->received, mock->received + consumed,
+          mock->received_size - consumed);
+  mock->received_size -= consumed;
+  mock->upgraded = true;
+
+  ESP_LOGI(LOG_TAG, "Client joined");
+  lk_mock_sfu_on_join(mock);
+  return 0;
+}
+
+static void lk_mock_sfu_apply_subscriber_answer(lk_mock_sfu *mock) {
+  if (mock->subscriber_answer == NULL || mock->subscriber == NULL) {
+    return;
+  }
+
+  if (mock->config.subscriber_candidates) {
+    pthread_mutex_lock(&mock->mutex);
+    auto candidates = mock->subscriber_candidates;
+    mock->subscriber_candidates = NULL;
+    pthread_mutex_unlock(&mock->mutex);
+    if (candidates == NULL) {
+      return;
+    }
+    lk_mock_sfu_add_candidates(mock->subscriber, candidates);
+    free(candidates);
+  }
+
+  peer_connection_set_remote_description(mock->subscriber,
+                                         mock->subscriber_answer);
+  free(mock->subscriber_answer);
+  mock->subscriber_answer = NULL;
+}
+
+static void lk_mock_sfu_handle_request(lk_mock_sfu *mock,
+                                       const Livekit__SignalRequest *r) {
+  switch (r->message_case) {
+    case LIVEKIT__SIGNAL_REQUEST__MESSAGE_ANSWER:
+      free(mock->subscriber_answer);
+      mock->subscriber_answer = strdup(r->answer->sdp);
+      break;
+    case LIVEKIT__SIGNAL_REQUEST__MESSAGE_OFFER:
+      // Answered once the publisher has a local description for it
+      free(mock->publisher_offer);
+      mock->publisher_offer = strdup(r->offer->sdp);
+      free(mock->publisher_local);
+      mock->publisher_local = NULL;
+      if (mock->publisher != NULL) {
+        peer_connection_set_remote_description(mock->publisher,
+                                               mock->publisher_offer);
+      }
+      break;
+    case LIVEKIT__SIGNAL_REQUEST__MESSAGE_TRICKLE: {
+      auto peer_connection =
+          r->trickle->target == LIVEKIT__SIGNAL_TARGET__PUBLISHER
+              ? mock->publisher
+              : mock->subscriber;
+      auto candidate = strstr(r->trickle->candidateinit, "candidate:");
+      if (peer_connection != NULL && candidate != NULL) {
+        char line[MOCK_SFU_CANDIDATE_SIZE];
+        snprintf(line, sizeof(line), "%.*s", (int)strcspn(candidate, "\""),
+                 candidate);
+        peer_connection_add_ice_candidate(peer_connection, line);
+      }
+      break;
+    }
+    case LIVEKIT__SIGNAL_REQUEST__MESSAGE_ADD_TRACK:
+      lk_mock_sfu_send_track_published(mock, r->add_track);
+      break;
+    case LIVEKIT__SIGNAL_REQUEST__MESSAGE_LEAVE:
+      ESP_LOGI(LOG_TAG, "Client left");
+      lk_mock_sfu_close_client(mock);
+      break;
+    default:
+      break;
+  }
+}
+
+static void lk_mock_sfu_handle_message(lk_mock_sfu *mock) {
+  if (mock->config.replay_path != NULL) {
+    return;
+  }
+
+  auto r = livekit__signal_request__unpack(NULL, mock->message_size,
+                                           mock->message);
+  if (r == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to decode SignalRequest");
+    return;
+  }
+  lk_mock_sfu_handle_request(mock, r);
+  livekit__signal_request__free_unpacked(r, NULL);
+}
+
+// Returns the size of the frame at the start of data, 0 if it hasn't been
+// received completely, -1 if it is malformed. The payload is unmasked in
+// place
+static long lk_mock_sfu_parse_frame(uint8_t *data, size_t size, int *opcode,
+                                    bool *fin, uint8_t **payload,
+                                    size_t *payload_size) {
+  if (size < 2) {
+    return 0;
+  }
+  *fin = (data[0] & 0x80) != 0;
+  *opcode = data[0] & 0x0f;
+
+  size_t header_size = 2;
+  uint64_t length = data[1] & 0x7f;
+  if (length == 126) {
+    if (size < 4) {
+      return 0;
+    }
+    length = (data[2] << 8) | data[3];
+    header_size = 4;
+  } else if (length == 127) {
+    if (size < 10) {
+      return 0;
+    }
+    length = 0;
+    for (int i = 0; i < 8; i++) {
+      length = (length << 8) | data[2 + i];
+    }
+    header_size = 10;
+  }
+  if (length > MOCK_SFU_MESSAGE_MAX) {
+    return -1;
+  }
+
+  // Client frames are always masked
+  bool masked = (data[1] & 0x80) != 0;
+  auto mask = data + header_size;
+  header_size += masked ? 4 : 0;
+  if (size < header_size + length) {
+    return 0;
+  }
+
+  *payload = data + header_size;
+  *payload_size = length;
+  if (masked) {
+    for (size_t i = 0; i < length; i++) {
+      (*payload)[i] ^= mask[i % 4];
+    }
+  }
+  return header_size + length;
+}
+
+static int lk_mock_sfu_handle_frames(lk_mock_sfu *mock) {
+  size_t offset = 0;
+  while (mock->client_fd >= 0 && offset < mock->received_size) {
+    int opcode;
+    bool fin;
+    uint8_t *payload;
+    size_t payload_size;
+    auto frame_size = lk_mock_sfu_parse_frame(
+        mock->received + offset, mock->received_size - offset, &opcode, &fin,
+        &payload, &payload_size);
+    if (frame_size < 0) {
+      return -1;
+    } else if (frame_size == 0) {
+      break;
+    }
+    offset += frame_size;
+
+    switch (opcode) {
+      case WEBSOCKET_OPCODE_BINARY:
+      case WEBSOCKET_OPCODE_CONTINUATION: {
+        if (opcode == WEBSOCKET_OPCODE_BINARY) {
+          mock->message_size = 0;
+        }
+        if (mock->message_size + payload_size > MOCK_SFU_MESSAGE_MAX) {
+          return -1;
+        }
+        memcpy(mock->message + mock->message_size, payload, payload_size);
+        mock->message_size += payload_size;
+        if (fin) {
+          lk_mock_sfu_handle_message(mock);
+          mock->message_size = 0;
+        }
+        break;
+      }
+      case WEBSOCKET_OPCODE_PING:
+        lk_mock_sfu_send_frame(mock, WEBSOCKET_OPCODE_PONG, payload,
+                               payload_size);
+        break;
+      case WEBSOCKET_OPCODE_CLOSE:
+        return -1;
+      default:
+        break;
+    }
+  }
+
+  if (mock->client_fd >= 0) {
+    memmove(mock->received, mock->received + offset,
+            mock->received_size - offset);
+    mock->received_size -= offset;
+  }
+  return 0;
+}
+
+static void lk_mock_sfu_receive(lk_mock_sfu *mock) {
+  auto space = MOCK_SFU_MESSAGE_MAX + MOCK_SFU_RECEIVE_SIZE -
+               mock->received_size;
+  auto received =
+      recv(mock->client_fd, mock->received + mock->received_size,
+           space < MOCK_SFU_RECEIVE_SIZE ? space : MOCK_SFU_RECEIVE_SIZE, 0);
+  if (received <= 0) {
+    ESP_LOGI(LOG_TAG, "Client disconnected");
+    lk_mock_sfu_close_client(mock);
+    return;
+  }
+  mock->received_size += received;
+
+  if (!mock->upgraded && lk_mock_sfu_handshake(mock) != 0) {
+    lk_mock_sfu_close_client(mock);
+    return;
+  }
+  if (mock->upgraded && lk_mock_sfu_handle_frames(mock) != 0) {
+    ESP_LOGI(LOG_TAG, "Client closed the websocket");
+    lk_mock_sfu_close_client(mock);
+  }
+}
+
+// Sends every recorded response that is due
+static void lk_mock_sfu_replay(lk_mock_sfu *mock) {
+  while (mock->replay != NULL) {
+    if (!mock->replay_pending) {
+      if (lk_signal_record_read(mock->replay, &mock->replay_header,
+                                &mock->replay_frame) != 0) {
+        ESP_LOGI(LOG_TAG, "Replay finished");
+        fclose(mock->replay);
+        mock->replay = NULL;
+        return;
+      }
+      if (mock->replay_header.direction != LK_SIGNAL_RECEIVED) {
+        continue;
+      }
+      mock->replay_pending = true;
+      if (mock->replay_first_time_us < 0) {
+        mock->replay_first_time_us = mock->replay_header.time_us;
+      }
+    }
+
+    auto due = mock->replay_start_time + mock->replay_header.time_us -
+               mock->replay_first_time_us;
+    if (mock->config.replay_realtime && lk_mock_sfu_now_us() < due) {
+      return;
+    }
+    lk_mock_sfu_send_frame(mock, WEBSOCKET_OPCODE_BINARY, mock->replay_frame,
+                           mock->replay_header.size);
+    mock->replay_pending = false;
+  }
+}
+
+// Drives both PeerConnections and sends whatever they produced
+static void lk_mock_sfu_script(lk_mock_sfu *mock) {
+  if (mock->subscriber != NULL) {
+    peer_connection_loop(mock->subscriber);
+    if (mock->subscriber_offer != NULL) {
+      lk_mock_sfu_send_description(mock, "offer", mock->subscriber_offer);
+      lk_mock_sfu_send_candidates(mock, LIVEKIT__SIGNAL_TARGET__SUBSCRIBER,
+                                  mock->subscriber_offer);
+      free(mock->subscriber_offer);
+      mock->subscriber_offer = NULL;
+    }
+    lk_mock_sfu_apply_subscriber_answer(mock);
+  }
+
+  if (mock->publisher != NULL) {
+    peer_connection_loop(mock->publisher);
+    if (mock->publisher_offer != NULL && mock->publisher_local != NULL) {
+      static char answer[MOCK_SFU_SDP_SIZE];
+      static lk_sdp offer;
+      static lk_sdp local;
+      if (lk_sdp_parse(mock->publisher_offer, &offer) == 0 &&
+          lk_sdp_parse(mock->publisher_local, &local) == 0 &&
+          lk_sdp_build_answer(&offer, &local, answer, sizeof(answer)) > 0) {
+        // The answer carries no candidates, they are in the local description
+        lk_mock_sfu_send_description(mock, "answer", answer);
+        lk_mock_sfu_send_candidates(mock, LIVEKIT__SIGNAL_TARGET__PUBLISHER,
+                                    mock->publisher_local);
+      } else {
+        ESP_LOGE(LOG_TAG, "Failed to answer the publisher offer");
+      }
+      free(mock->publisher_offer);
+      mock->publisher_offer = NULL;
+    }
+  }
+}
+
+static void *lk_mock_sfu_task(void *arg) {
+  auto mock = (lk_mock_sfu *)arg;
+  while (true) {
+    struct pollfd fds[2] = {
+        {.fd = mock->listen_fd, .events = POLLIN},
+        {.fd = mock->client_fd, .events = POLLIN},
+    };
+    poll(fds, mock->client_fd >= 0 ? 2 : 1, MOCK_SFU_POLL_INTERVAL_MS);
+
+    if (fds[0].revents & POLLIN) {
+      auto client_fd = accept(mock->listen_fd, NULL, NULL);
+      if (client_fd >= 0) {
+        lk_mock_sfu_close_client(mock);
+        mock->client_fd = client_fd;
+        ESP_LOGI(LOG_TAG, "Client connected");
+      }
+    } else if (mock->client_fd >= 0 &&
+               (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+      lk_mock_sfu_receive(mock);
+    }
+
+    if (mock->client_fd >= 0 && mock->upgraded) {
+      lk_mock_sfu_replay(mock);
+      lk_mock_sfu_script(mock);
+    }
+  }
+  return NULL;
+}
+
+lk_mock_sfu *lk_mock_sfu_start(const lk_mock_sfu_config *config) {
+  auto mock = (lk_mock_sfu *)calloc(1, sizeof(lk_mock_sfu));
+  if (mock == NULL) {
+    return NULL;
+  }
+  mock->config = *config;
+  mock->client_fd = -1;
+  pthread_mutex_init(&mock->mutex, NULL);
+  mock->received =
+      (uint8_t *)malloc(MOCK_SFU_MESSAGE_MAX + MOCK_SFU_RECEIVE_SIZE + 1);
+  mock->message = (uint8_t *)malloc(MOCK_SFU_MESSAGE_MAX);
+
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(config->port);
+  inet_pton(AF_INET,
+            config->address != NULL ? config->address : "127.0.0.1",
+            &address.sin_addr);
+  socklen_t address_size = sizeof(address);
+  int reuse = 1;
+
+  mock->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (mock->received == NULL || mock->message == NULL ||
+      mock->listen_fd < 0 ||
+      setsockopt(mock->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) != 0 ||
+      bind(mock->listen_fd, (struct sockaddr *)&address, address_size) != 0 ||
+      listen(mock->listen_fd, 1) != 0 ||
+      getsockname(mock->listen_fd, (struct sockaddr *)&address,
+                  &address_size) != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to listen on port %d", config->port);
+    if (mock->listen_fd >= 0) {
+      close(mock->listen_fd);
+    }
+    free(mock->received);
+    free(mock->message);
+    free(mock);
+    return NULL;
+  }
+  mock->port = ntohs(address.sin_port);
+
+  pthread_t thread_handle;
+  if (pthread_create(&thread_handle, NULL, lk_mock_sfu_task, mock) != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to start");
+    close(mock->listen_fd);
+    free(mock->received);
+    free(mock->message);
+    free(mock);
+    return NULL;
+  }
+  pthread_detach(thread_handle);
+  return mock;
+}
+
+int lk_mock_sfu_port(lk_mock_sfu *mock) {
+  return mock->port;
+}
+
+void lk_mock_sfu_set_subscriber_candidates(lk_mock_sfu *mock,
+                                           const char *description) {
+  pthread_mutex_lock(&mock->mutex);
+  free(mock->subscriber_candidates);
+  mock->subscriber_candidates = strdup(description);
+  pthread_mutex_unlock(&mock->mutex);
+}
+
+int lk_mock_sfu_main(int argc, char **argv) {
+  lk_mock_sfu_config config = {};
+  config.address = "0.0.0.0";
+  config.port = 7880;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--realtime") == 0) {
+      config.replay_realtime = true;
+    } else if (i + 1 < argc && strcmp(argv[i], "--port") == 0) {
+      config.port = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "--replay") == 0) {
+      config.replay_path = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: src.elf mock-sfu [--port PORT] [--replay FILE] "
+              "[--realtime]\n");
+      return 2;
+    }
+  }
+
+  peer_init();
+  auto mock = lk_mock_sfu_start(&config);
+  if (mock == NULL) {
+    return 1;
+  }
+  ESP_LOGI(LOG_TAG, "Listening on ws://%s:%d", config.address,
+           lk_mock_sfu_port(mock));
+  while (true) {
+    sleep(60);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+
+// A stand-in for a LiveKit server on linux. It speaks the livekit_rtc
+// SignalRequest/SignalResponse framing over a plain websocket, so
+// lk_websocket can join it with a ws:// URL and any token.
+//
+// Scripted, it plays the SFU side of a join with two libpeer PeerConnections
+// of its own: JOIN, the subscriber OFFER and its TRICKLEs, TRACK_PUBLISHED
+// for ADD_TRACK, and an ANSWER and TRICKLEs for the publisher OFFER.
+// Replaying, it sends the SignalResponses of an LK_SIGNAL_RECORD recording
+// and ignores every request.
+//
+// One client at a time, a new connection replaces the previous one.
+
+typedef struct lk_mock_sfu lk_mock_sfu;
+
+typedef struct {
+  const char *address;  // to listen on, 127.0.0.1 if NULL
+  int port;             // 0 picks a free one
+  const char *replay_path;  // NULL scripts the join
+  bool replay_realtime;     // keep the recorded gaps, otherwise back to back
+  // Hold the subscriber answer until lk_mock_sfu_set_subscriber_candidates
+  bool subscriber_candidates;
+} lk_mock_sfu_config;
+
+// Starts serving on a thread of its own. NULL if it could not listen
+lk_mock_sfu *lk_mock_sfu_start(const lk_mock_sfu_config *config);
+int lk_mock_sfu_port(lk_mock_sfu *mock);
+
+// LiveKit is ICE lite and learns the subscriber's address from its
+// connectivity checks, libpeer can't. A client in the same process hands over
+// the local description it answered with, its candidates are added before
+// the answer is applied
+void lk_mock_sfu_set_subscriber_candidates(lk_mock_sfu *mock,
+                                           const char *description);
@@ -0,0 +1,99 @@
+#include "opus_profile.h"
+
+#include <esp_log.h>
+
+#include <atomic>
+
+#include "main.h"
+
+#define LOG_TAG "opus_profile"
+
+// Consecutive good quality reports before leaving a degraded profile. The
+// SFU sends one every few seconds
+#define OPUS_PROFILE_RECOVER_REPORTS 3
+
+static const lk_opus_profile opus_profiles[LK_OPUS_PROFILE_COUNT] = {
+    {
+        .name = "low_power",
+        .bitrate = 12000,
+        .complexity = 0,
+        .inband_fec = false,
+        .dtx = true,
+        .packet_loss_percent = 0,
+    },
+    {
+        .name = "voice",
+        .bitrate = 30000,
+        .complexity = 0,
+        .inband_fec = false,
+        .dtx = true,
+        .packet_loss_percent = 0,
+    },
+    {
+        .name = "resilient",
+        .bitrate = 32000,
+        .complexity = 3,
+        .inband_fec = true,
+        .dtx = true,
+        .packet_loss_percent = 20,
+    },
+};
+
+static std::atomic<int> requested_profile{LK_OPUS_PROFILE};
+
+// Only touched by the websocket task
+static int good_reports = 0;
+
+const lk_opus_profile *lk_opus_profile_get(lk_opus_profile_id id) {
+  return &opus_profiles[id];
+}
+
+lk_opus_profile_id lk_opus_profile_requested() {
+  return (lk_opus_profile_id)requested_profile.load(std::memory_order_relaxed);
+}
+
+void lk_opus_profile_request(lk_opus_profile_id id) {
+  if (requested_profile.exchange(id, std::memory_order_relaxed) != id) {
+    ESP_LOGI(LOG_TAG, "Switching to %s", opus_profiles[id].name);
+  }
+}
+
+int lk_opus_profile_apply(OpusEncoder *encoder,
+                          const lk_opus_profile *profile) {
+  if (opus_encoder_ctl(encoder, OPUS_SET_BITRATE(profile->bitrate)) !=
+          OPUS_OK ||
+      opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(profile->complexity)) !=
+          OPUS_OK ||
+      opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(profile->inband_fec)) !=
+          OPUS_OK ||
+      opus_encoder_ctl(encoder, OPUS_SET_DTX(profile->dtx)) != OPUS_OK ||
+      opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(
+                                    profile->packet_loss_percent)) != OPUS_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to apply %s", profile->name);
+    return -1;
+  }
+
+  ESP_LOGI(LOG_TAG, "Encoder using %s: %ld bps, complexity %d%s%s",
+           profile->name, (long)profile->bitrate, profile->complexity,
+           profile->inband_fec ? ", fec" : "", profile->dtx ? ", dtx" : "");
+  return 0;
+}
+
+void lk_opus_profile_on_link_quality(lk_link_quality quality) {
+  switch (quality) {
+    case LK_LINK_QUALITY_LOST:
+      // Nothing gets through, send as little as possible until it recovers
+      good_reports = 0;
+      lk_opus_profile_request(LK_OPUS_PROFILE_LOW_POWER);
+      break;
+    case LK_LINK_QUALITY_POOR:
+      good_reports = 0;
+      lk_opus_profile_request(LK_OPUS_PROFILE_RESILIENT);
+      break;
+    case LK_LINK_QUALITY_GOOD:
+      if (++good_reports >= OPUS_PROFILE_RECOVER_REPORTS) {
+        lk_opus_profile_request(LK_OPUS_PROFILE);
+      }
+      break;
+  }
+}
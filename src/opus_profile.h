@@ -0,0 +1,53 @@
+#pragma once
+
+#include <opus.h>
+#include <stdint.h>
+
+// Named Opus encoder configurations. One is selected at build time with
+// LK_OPUS_PROFILE, and can be switched at runtime by lk_opus_profile_request
+// or by link quality adaptation. The encoder task applies a switch before the
+// next packet it encodes.
+typedef enum {
+  // Low bitrate and complexity, for a constrained device on a good network
+  LK_OPUS_PROFILE_LOW_POWER = 0,
+  LK_OPUS_PROFILE_VOICE,
+  // Inband FEC and a higher loss estimate, spends CPU and bits on recovery
+  LK_OPUS_PROFILE_RESILIENT,
+  LK_OPUS_PROFILE_COUNT,
+} lk_opus_profile_id;
+
+#ifndef LK_OPUS_PROFILE
+#define LK_OPUS_PROFILE LK_OPUS_PROFILE_VOICE
+#endif
+
+// Every profile encodes one AUDIO_FRAME_DURATION_MS frame per packet. libpeer
+// advances the RTP timestamp by a fixed frame for every packet sent, so longer
+// packets would compress the receiver's timeline
+typedef struct {
+  const char *name;
+  opus_int32 bitrate;
+  int complexity;
+  bool inband_fec;
+  // Silence is encoded as 1-2 byte frames and an occasional comfort noise
+  // update
+  bool dtx;
+  int packet_loss_percent;
+} lk_opus_profile;
+
+// Link quality as reported by the SFU for the local participant
+typedef enum {
+  LK_LINK_QUALITY_LOST = 0,
+  LK_LINK_QUALITY_POOR,
+  LK_LINK_QUALITY_GOOD,
+} lk_link_quality;
+
+const lk_opus_profile *lk_opus_profile_get(lk_opus_profile_id id);
+lk_opus_profile_id lk_opus_profile_requested(void);
+void lk_opus_profile_request(lk_opus_profile_id id);
+
+// Only called by the task that owns the encoder
+int lk_opus_profile_apply(OpusEncoder *encoder, const lk_opus_profile *profile);
+
+// Steps to a profile for the reported quality. Degrading is immediate,
+// recovering back to LK_OPUS_PROFILE takes several good reports in a row
+void lk_opus_profile_on_link_quality(lk_link_quality quality);
@@ -0,0 +1,213 @@
+#include "power.h"
+
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "text_buffer.h"
+
+#define LOG_TAG "power"
+
+// Rough ESP32-S3 supply current with the radio in modem sleep, only good for
+// comparing modes. Measure the board for real figures
+#define POWER_ACTIVE_MA 48.0f      // working at the maximum frequency
+#define POWER_IDLE_MAX_MA 30.0f    // waiting at the maximum frequency
+#define POWER_IDLE_MIN_MA 14.0f    // waiting at LK_POWER_MIN_FREQ_MHZ
+#define POWER_LIGHT_SLEEP_MA 0.3f  // light sleep
+
+static const char *mode_names[LK_POWER_MODE_COUNT] = {
+    "performance",
+    "dfs",
+    "light_sleep",
+};
+
+static const char *lock_names[LK_POWER_LOCK_COUNT] = {
+    "lk_encode",
+    "lk_decode",
+    "lk_peer_connection",
+};
+
+typedef struct {
+  int64_t elapsed_us;  // time spent in the mode, until it was last left
+  int64_t active_us;   // of which a lock was held
+  std::atomic<uint32_t> deadline_misses;
+} lk_power_usage;
+
+static esp_pm_lock_handle_t locks[LK_POWER_LOCK_COUNT];
+static lk_power_usage usage[LK_POWER_MODE_COUNT];
+
+// Guards everything below, held for a few instructions
+static portMUX_TYPE power_mux = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<lk_power_mode> current_mode{LK_POWER_PERFORMANCE};
+static int64_t mode_start_us;
+static int held;  // locks currently held, across tasks
+static int64_t held_start_us;
+
+static std::atomic<bool> receiving_audio{false};
+static int64_t last_received_us;
+
+static void lk_power_apply_modem_sleep(lk_power_mode mode, bool receiving) {
+  auto ps = mode != LK_POWER_PERFORMANCE && !receiving ? WIFI_PS_MIN_MODEM
+                                                        : WIFI_PS_NONE;
+  if (esp_wifi_set_ps(ps) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to set Wi-Fi power save %d", ps);
+  }
+}
+
+// Adds the time since the last call to the current mode
+static void lk_power_account(int64_t now_us) {
+  auto &u = usage[current_mode.load(std::memory_order_relaxed)];
+  u.elapsed_us += now_us - mode_start_us;
+  mode_start_us = now_us;
+  if (held > 0) {
+    u.active_us += now_us - held_start_us;
+    held_start_us = now_us;
+  }
+}
+
+int lk_power_set_mode(lk_power_mode new_mode) {
+  auto max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+  esp_pm_config_t config = {
+      .max_freq_mhz = max_freq_mhz,
+      .min_freq_mhz = new_mode == LK_POWER_PERFORMANCE ? max_freq_mhz
+                                                       : LK_POWER_MIN_FREQ_MHZ,
+      .light_sleep_enable = new_mode == LK_POWER_LIGHT_SLEEP,
+  };
+  auto err = esp_pm_configure(&config);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to configure %s: %s", mode_names[new_mode],
+             esp_err_to_name(err));
+    return -1;
+  }
+
+  portENTER_CRITICAL(&power_mux);
+  lk_power_account(esp_timer_get_time());
+  current_mode.store(new_mode, std::memory_order_relaxed);
+  portEXIT_CRITICAL(&power_mux);
+
+  lk_power_apply_modem_sleep(new_mode,
+                             receiving_audio.load(std::memory_order_relaxed));
+  ESP_LOGI(LOG_TAG, "Power mode %s", mode_names[new_mode]);
+  return 0;
+}
+
+void lk_power_init(void) {
+  for (int i = 0; i < LK_POWER_LOCK_COUNT; i++) {
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, lock_names[i], &locks[i]) !=
+        ESP_OK) {
+      ESP_LOGW(LOG_TAG, "No PM lock %s, is CONFIG_PM_ENABLE set?",
+               lock_names[i]);
+    }
+  }
+
+  mode_start_us = esp_timer_get_time();
+  lk_power_set_mode(LK_POWER_MODE);
+}
+
+void lk_power_acquire(lk_power_lock lock) {
+  if (locks[lock] != NULL) {
+    esp_pm_lock_acquire(locks[lock]);
+  }
+
+  portENTER_CRITICAL(&power_mux);
+  if (held++ == 0) {
+    held_start_us = esp_timer_get_time();
+  }
+  portEXIT_CRITICAL(&power_mux);
+}
+
+void lk_power_release(lk_power_lock lock) {
+  portENTER_CRITICAL(&power_mux);
+  if (--held == 0) {
+    usage[current_mode.load(std::memory_order_relaxed)].active_us +=
+        esp_timer_get_time() - held_start_us;
+  }
+  portEXIT_CRITICAL(&power_mux);
+
+  if (locks[lock] != NULL) {
+    esp_pm_lock_release(locks[lock]);
+  }
+}
+
+// Gaps in the remote audio shorter than LK_POWER_RECEIVE_IDLE_MS keep the
+// modem awake, switching costs more than it saves
+void lk_power_set_receiving(bool now_receiving) {
+  auto now_us = esp_timer_get_time();
+  if (now_receiving) {
+    last_received_us = now_us;
+  } else if (now_us - last_received_us < LK_POWER_RECEIVE_IDLE_MS * 1000LL) {
+    return;
+  }
+
+  if (receiving_audio.exchange(now_receiving, std::memory_order_relaxed) !=
+      now_receiving) {
+    lk_power_apply_modem_sleep(current_mode.load(std::memory_order_relaxed),
+                               now_receiving);
+  }
+}
+
+void lk_power_frame_done(int64_t start_us, uint32_t budget_us) {
+  if (esp_timer_get_time() - start_us > budget_us) {
+    auto &u = usage[current_mode.load(std::memory_order_relaxed)];
+    u.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// Time without a lock is spent waiting, at the minimum frequency or, in light
+// sleep mode, assumed asleep. That makes light sleep a best case, the Wi-Fi
+// and I2S drivers hold locks of their own that keep the chip awake
+static float lk_power_current_ma(lk_power_mode mode, float active) {
+  float idle_ma = POWER_IDLE_MAX_MA;
+  if (mode == LK_POWER_DFS) {
+    idle_ma = POWER_IDLE_MIN_MA;
+  } else if (mode == LK_POWER_LIGHT_SLEEP) {
+    idle_ma = POWER_LIGHT_SLEEP_MA;
+  }
+  return active * POWER_ACTIVE_MA + (1 - active) * idle_ma;
+}
+
+size_t lk_power_report(char *out, size_t out_size) {
+  int64_t elapsed_us[LK_POWER_MODE_COUNT];
+  int64_t active_us[LK_POWER_MODE_COUNT];
+  portENTER_CRITICAL(&power_mux);
+  lk_power_account(esp_timer_get_time());
+  for (int i = 0; i < LK_POWER_MODE_COUNT; i++) {
+    elapsed_us[i] = usage[i].elapsed_us;
+    active_us[i] = usage[i].active_us;
+  }
+  portEXIT_CRITICAL(&power_mux);
+
+  lk_text_buffer text;
+  lk_text_buffer_init(&text, out, out_size);
+
+  auto current = current_mode.load(std::memory_order_relaxed);
+  lk_text_append(&text, "\npower: mode=%s modem_sleep=%d", mode_names[current],
+                 current != LK_POWER_PERFORMANCE &&
+                     !receiving_audio.load(std::memory_order_relaxed));
+
+  // active percent / average mA / deadline misses, since boot
+  lk_text_append(&text, "\npower_modes:");
+  for (int i = 0; i < LK_POWER_MODE_COUNT; i++) {
+    if (elapsed_us[i] == 0) {
+      continue;
+    }
+    auto active = (float)active_us[i] / elapsed_us[i];
+    lk_text_append(
+        &text, " %s=%d%%/%.1fmA/%lu", mode_names[i], (int)(active * 100),
+        lk_power_current_ma((lk_power_mode)i, active),
+        (unsigned long)usage[i].deadline_misses.load(
+            std::memory_order_relaxed));
+  }
+
+#ifdef LK_POWER_CYCLE
+  lk_power_set_mode((lk_power_mode)((current + 1) % LK_POWER_MODE_COUNT));
+#endif
+
+  return lk_text_buffer_length(&text);
+}
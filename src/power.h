@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Power management on target. Between 20ms frames there is little to do, so
+// the CPU only runs at full speed while a PM lock is held around encoding,
+// decoding and PeerConnection work (DTLS, SRTP). Outside of them the chip
+// drops to LK_POWER_MIN_FREQ_MHZ or light sleeps, depending on the mode.
+//
+// Wi-Fi modem sleep delays received packets to the next DTIM beacon. While
+// remote audio plays the modem stays awake, it sleeps once nothing has played
+// for LK_POWER_RECEIVE_IDLE_MS. Sent packets wake it anyway.
+//
+// Each metrics report has, per mode, the share of time a lock was held, an
+// estimated average current and the frames that missed their deadline, ie.
+// took more than a frame period to process. Define LK_POWER_CYCLE to switch to
+// the next mode after every report and compare them in one session.
+
+typedef enum {
+  LK_POWER_PERFORMANCE = 0,  // fixed at the maximum frequency, no PM
+  LK_POWER_DFS,              // frequency scaling
+  LK_POWER_LIGHT_SLEEP,      // frequency scaling and automatic light sleep
+  LK_POWER_MODE_COUNT,
+} lk_power_mode;
+
+typedef enum {
+  LK_POWER_LOCK_ENCODE = 0,
+  LK_POWER_LOCK_DECODE,
+  LK_POWER_LOCK_PEER_CONNECTION,
+  LK_POWER_LOCK_COUNT,
+} lk_power_lock;
+
+#ifndef LK_POWER_MODE
+#define LK_POWER_MODE LK_POWER_DFS
+#endif
+
+#ifndef LK_POWER_MIN_FREQ_MHZ
+#define LK_POWER_MIN_FREQ_MHZ 40
+#endif
+
+#ifndef LK_POWER_RECEIVE_IDLE_MS
+#define LK_POWER_RECEIVE_IDLE_MS 1000
+#endif
+
+#ifndef LINUX_BUILD
+// After lk_wifi, applies LK_POWER_MODE
+void lk_power_init(void);
+int lk_power_set_mode(lk_power_mode mode);
+
+// Nest, and may be taken by any task
+void lk_power_acquire(lk_power_lock lock);
+void lk_power_release(lk_power_lock lock);
+
+// Called every frame by the playout task, whether remote audio is playing
+void lk_power_set_receiving(bool receiving);
+
+// Counts a deadline miss if more than budget_us passed since start_us
+void lk_power_frame_done(int64_t start_us, uint32_t budget_us);
+
+// Appends the power report, returns the length written
+size_t lk_power_report(char *out, size_t out_size);
+#else
+// Linux has no power management
+static inline void lk_power_init(void) {}
+static inline void lk_power_acquire(lk_power_lock lock) {}
+static inline void lk_power_release(lk_power_lock lock) {}
+static inline void lk_power_set_receiving(bool receiving) {}
+static inline void lk_power_frame_done(int64_t start_us, uint32_t budget_us) {}
+static inline size_t lk_power_report(char *out, size_t out_size) {
+  return 0;
+}
+#endif
@@ -0,0 +1,246 @@
+#include "sdp.h"
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "main.h"
+#include "text_buffer.h"
+
+#define LOG_TAG "sdp"
+
+// What we ask the sender for. Inband FEC feeds the jitter buffer's recovery,
+// mono and the playback rate match the decoder so no bandwidth is spent on
+// audio that is thrown away
+#define SDP_OPUS_FMTP "minptime=10;useinbandfec=1;stereo=0;maxplaybackrate=%d"
+
+#define SDP_SESSION_HEADER                          \
+  "v=0\r\n"                                         \
+  "o=- 8611954123959290783 2 IN IP4 127.0.0.1\r\n" \
+  "s=-\r\n"                                         \
+  "t=0 0\r\n"                                       \
+  "a=msid-semantic:  iot\r\n"
+
+bool lk_sdp_next_line(std::string_view *sdp, lk_sdp_line *line) {
+  while (!sdp->empty()) {
+    auto end = sdp->find('\n');
+    auto current = sdp->substr(0, end);
+    sdp->remove_prefix(end == std::string_view::npos ? sdp->size() : end + 1);
+
+    if (!current.empty() && current.back() == '\r') {
+      current.remove_suffix(1);
+    }
+    if (current.size() < 2 || current[1] != '=') {
+      continue;
+    }
+
+    line->type = current[0];
+    line->value = current.substr(2);
+    return true;
+  }
+
+  return false;
+}
+
+bool lk_sdp_attribute(std::string_view attribute, std::string_view name,
+                      std::string_view *value) {
+  if (attribute.substr(0, name.size()) != name) {
+    return false;
+  }
+
+  attribute.remove_prefix(name.size());
+  if (!attribute.empty() && attribute[0] != ':') {
+    return false;
+  }
+
+  *value = attribute.empty() ? attribute : attribute.substr(1);
+  return true;
+}
+
+// Splits off the next space separated token of *value
+static std::string_view lk_sdp_token(std::string_view *value) {
+  auto end = value->find(' ');
+  auto token = value->substr(0, end);
+  value->remove_prefix(end == std::string_view::npos ? value->size()
+                                                     : end + 1);
+  return token;
+}
+
+static int lk_sdp_payload_type(std::string_view value) {
+  int payload_type = 0;
+  auto token = lk_sdp_token(&value);
+  if (token.empty()) {
+    return -1;
+  }
+
+  for (auto c : token) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    payload_type = payload_type * 10 + (c - '0');
+  }
+  return payload_type;
+}
+
+static void lk_sdp_parse_media_attribute(lk_sdp_media *media,
+                                         std::string_view attribute) {
+  std::string_view value;
+  if (lk_sdp_attribute(attribute, "mid", &value)) {
+    media->mid = value;
+  } else if (lk_sdp_attribute(attribute, "rtcp-mux", &value)) {
+    media->rtcp_mux = true;
+  } else if (attribute == "sendrecv" || attribute == "sendonly" ||
+             attribute == "recvonly" || attribute == "inactive") {
+    media->direction = attribute;
+  } else if (lk_sdp_attribute(attribute, "rtpmap", &value)) {
+    auto payload_type = lk_sdp_payload_type(value);
+    lk_sdp_token(&value);
+    if (media->opus_payload_type == -1 && value.size() >= 5 &&
+        strncasecmp(value.data(), "opus/", 5) == 0) {
+      media->opus_payload_type = payload_type;
+    }
+  } else if (lk_sdp_attribute(attribute, "fmtp", &value)) {
+    if (media->opus_payload_type != -1 &&
+        lk_sdp_payload_type(value) == media->opus_payload_type) {
+      lk_sdp_token(&value);
+      media->opus_fmtp = value;
+    }
+  }
+}
+
+int lk_sdp_parse(std::string_view sdp, lk_sdp *out) {
+  *out = {};
+  lk_sdp_media *media = NULL;
+  lk_sdp_line line;
+
+  while (lk_sdp_next_line(&sdp, &line)) {
+    if (line.type == 'm') {
+      if (out->media_count == SDP_MAX_MEDIA) {
+        ESP_LOGE(LOG_TAG, "More than %d media sections", SDP_MAX_MEDIA);
+        return -1;
+      }
+
+      media = &out->media[out->media_count++];
+      media->opus_payload_type = -1;
+
+      auto value = line.value;
+      media->kind = lk_sdp_token(&value);
+      lk_sdp_token(&value);  // port
+      media->protocol = lk_sdp_token(&value);
+      media->formats = value;
+      continue;
+    }
+
+    if (line.type != 'a') {
+      continue;
+    }
+
+    std::string_view value;
+    if (lk_sdp_attribute(line.value, "ice-ufrag", &value)) {
+      out->ice_ufrag = out->ice_ufrag.empty() ? value : out->ice_ufrag;
+    } else if (lk_sdp_attribute(line.value, "ice-pwd", &value)) {
+      out->ice_pwd = out->ice_pwd.empty() ? value : out->ice_pwd;
+    } else if (lk_sdp_attribute(line.value, "fingerprint", &value)) {
+      out->fingerprint = out->fingerprint.empty() ? value : out->fingerprint;
+    } else if (media != NULL) {
+      lk_sdp_parse_media_attribute(media, line.value);
+    }
+  }
+
+  return 0;
+}
+
+static bool lk_sdp_media_accepted(const lk_sdp_media *media) {
+  if (media->kind == "audio") {
+    return media->opus_payload_type != -1;
+  }
+  return media->kind == "application" &&
+         media->formats.find("webrtc-datachannel") != std::string_view::npos;
+}
+
+// We never send on the subscriber, only receive what is offered
+static const char *lk_sdp_answer_direction(const lk_sdp_media *media) {
+  if (media->direction == "recvonly" || media->direction == "inactive") {
+    return "inactive";
+  }
+  return "recvonly";
+}
+
+int lk_sdp_build_answer(const lk_sdp *offer, const lk_sdp *local, char *out,
+                        size_t out_size) {
+  lk_text_buffer text;
+  lk_text_buffer_init(&text, out, out_size);
+  auto append_view = [&](const char *prefix, std::string_view value) {
+    lk_text_append(&text, "%s%.*s\r\n", prefix, (int)value.size(),
+                   value.data());
+  };
+  auto append_transport = [&]() {
+    lk_text_append(&text, "c=IN IP4 0.0.0.0\r\n");
+    lk_text_append(&text, "a=setup:passive\r\n");
+    append_view("a=ice-ufrag:", local->ice_ufrag);
+    append_view("a=ice-pwd:", local->ice_pwd);
+    append_view("a=fingerprint:", local->fingerprint);
+  };
+
+  lk_text_append(&text, SDP_SESSION_HEADER);
+  lk_text_append(&text, "a=group:BUNDLE");
+  for (int i = 0; i < offer->media_count; i++) {
+    auto media = &offer->media[i];
+    if (lk_sdp_media_accepted(media)) {
+      lk_text_append(&text, " %.*s", (int)media->mid.size(), media->mid.data());
+    }
+  }
+  lk_text_append(&text, "\r\n");
+
+  for (int i = 0; i < offer->media_count; i++) {
+    auto media = &offer->media[i];
+    auto kind = (int)media->kind.size();
+    auto protocol = (int)media->protocol.size();
+
+    if (!lk_sdp_media_accepted(media)) {
+      ESP_LOGI(LOG_TAG, "Rejecting %.*s section %.*s", kind,
+               media->kind.data(), (int)media->mid.size(), media->mid.data());
+      lk_text_append(&text, "m=%.*s 0 %.*s %.*s\r\n", kind, media->kind.data(),
+                     protocol, media->protocol.data(),
+                     (int)media->formats.size(), media->formats.data());
+      lk_text_append(&text, "c=IN IP4 0.0.0.0\r\n");
+      append_view("a=mid:", media->mid);
+      lk_text_append(&text, "a=inactive\r\n");
+      continue;
+    }
+
+    if (media->kind == "application") {
+      lk_text_append(&text, "m=application 9 %.*s webrtc-datachannel\r\n",
+                     protocol, media->protocol.data());
+      append_transport();
+      append_view("a=mid:", media->mid);
+      lk_text_append(&text, "a=sctp-port:5000\r\n");
+      continue;
+    }
+
+    auto payload_type = media->opus_payload_type;
+    ESP_LOGI(LOG_TAG, "Accepting Opus %d on %.*s, offered fmtp: %.*s",
+             payload_type, (int)media->mid.size(), media->mid.data(),
+             (int)media->opus_fmtp.size(), media->opus_fmtp.data());
+    lk_text_append(&text, "m=audio 9 %.*s %d\r\n", protocol,
+                   media->protocol.data(), payload_type);
+    append_transport();
+    append_view("a=mid:", media->mid);
+    lk_text_append(&text, "a=rtcp:9 IN IP4 0.0.0.0\r\n");
+    if (media->rtcp_mux) {
+      lk_text_append(&text, "a=rtcp-mux\r\n");
+    }
+    lk_text_append(&text, "a=rtpmap:%d opus/48000/2\r\n", payload_type);
+    lk_text_append(&text, "a=fmtp:%d " SDP_OPUS_FMTP "\r\n", payload_type,
+                   SAMPLE_RATE);
+    lk_text_append(&text, "a=ptime:%d\r\n", AUDIO_FRAME_DURATION_MS);
+    lk_text_append(&text, "a=%s\r\n", lk_sdp_answer_direction(media));
+  }
+
+  if (lk_text_buffer_truncated(&text)) {
+    ESP_LOGE(LOG_TAG, "Answer does not fit in %d bytes", (int)out_size);
+    return -1;
+  }
+  return (int)text.len;
+}
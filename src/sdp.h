@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <string_view>
+
+// Minimal SDP tokenizer and answer builder. Parsing never copies, every field
+// is a span into the parsed SDP so it must outlive the lk_sdp.
+
+// Media sections past this are rejected by the parser
+#define SDP_MAX_MEDIA 8
+
+// One "<type>=<value>" line, without the line ending
+typedef struct {
+  char type;
+  std::string_view value;
+} lk_sdp_line;
+
+typedef struct {
+  std::string_view kind;  // audio, video, application
+  std::string_view protocol;
+  std::string_view formats;  // everything after the protocol on the m= line
+  std::string_view mid;
+  std::string_view direction;  // empty if not given, which means sendrecv
+  bool rtcp_mux;
+  int opus_payload_type;  // -1 if Opus was not offered
+  std::string_view opus_fmtp;
+} lk_sdp_media;
+
+typedef struct {
+  // Taken from the first session or media level occurrence, BUNDLE shares
+  // them across every media section
+  std::string_view ice_ufrag;
+  std::string_view ice_pwd;
+  std::string_view fingerprint;
+
+  lk_sdp_media media[SDP_MAX_MEDIA];
+  int media_count;
+} lk_sdp;
+
+// Reads the next line of *sdp and advances it. Returns false at the end
+bool lk_sdp_next_line(std::string_view *sdp, lk_sdp_line *line);
+
+// Matches "name" and "name:value" attributes, value is set to what follows
+// the colon
+bool lk_sdp_attribute(std::string_view attribute, std::string_view name,
+                      std::string_view *value);
+
+int lk_sdp_parse(std::string_view sdp, lk_sdp *out);
+
+// Builds an answer that mirrors the offered media sections in order. Opus
+// audio is accepted receive only, data channels are accepted, everything
+// else is rejected with port 0. ICE and DTLS parameters come from local.
+// Returns the length, or -1 if out is too small
+int lk_sdp_build_answer(const lk_sdp *offer, const lk_sdp *local, char *out,
+                        size_t out_size);
@@ -0,0 +1,65 @@
+#include "session.h"
+
+#include <esp_log.h>
+
+#include <new>
+
+#define LOG_TAG "session"
+
+// Only for a session that failed to initialize, nothing else refers to it yet
+static void lk_session_free(lk_session *session) {
+  if (session->mutex != NULL) {
+    vSemaphoreDelete(session->mutex);
+  }
+  if (session->signaling_events != NULL) {
+    vEventGroupDelete(session->signaling_events);
+  }
+  lk_mem_free(LK_MEM_SIGNALING, session->answer_buffer);
+  session->~lk_session();
+  lk_mem_free(LK_MEM_SIGNALING, session);
+}
+
+lk_session *lk_session_create(const char *url, const char *token, bool media) {
+  auto memory = lk_mem_alloc(LK_MEM_SIGNALING, sizeof(lk_session));
+  if (memory == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate session");
+    return NULL;
+  }
+  // Value initialized, everything starts zeroed and the atomics are
+  // constructed
+  auto session = new (memory) lk_session();
+
+  session->url = url;
+  session->token = token;
+  session->media = media;
+
+  session->mutex = xSemaphoreCreateMutex();
+  session->signaling_events = xEventGroupCreate();
+  session->answer_buffer =
+      (char *)lk_mem_calloc(LK_MEM_SIGNALING, 1, ANSWER_BUFFER_SIZE);
+  if (session->mutex == NULL || session->signaling_events == NULL ||
+      session->answer_buffer == NULL ||
+      lk_arena_init(&session->signal_response_arena,
+                    SIGNAL_RESPONSE_ARENA_SIZE, LK_MEM_SIGNALING) != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate session");
+    lk_session_free(session);
+    return NULL;
+  }
+
+  session->signal_response_allocator = {
+      .alloc = [](void *arena, size_t size) -> void * {
+        return lk_arena_alloc((lk_arena *)arena, size);
+      },
+      .free = [](void *arena, void *pointer) -> void {
+        lk_arena_free((lk_arena *)arena, pointer);
+      },
+      .allocator_data = &session->signal_response_arena,
+  };
+
+  session->signal_request_buffer = (uint8_t *)lk_mem_alloc(
+      LK_MEM_SIGNALING, SIGNAL_REQUEST_BUFFER_SIZE);
+  session->signal_request_buffer_size =
+      session->signal_request_buffer != NULL ? SIGNAL_REQUEST_BUFFER_SIZE : 0;
+
+  return session;
+}
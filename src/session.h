@@ -0,0 +1,158 @@
+#pragma once
+
+#include <esp_websocket_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <livekit_rtc.pb-c.h>
+#include <peer.h>
+#include <protobuf-c/protobuf-c.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "arena.h"
+#include "sdp.h"
+#include "subscriptions.h"
+
+// One connection to a room: the signaling websocket, both PeerConnections and
+// every buffer and FSM between them. A process can run any number of them,
+// only the session created with media is attached to the microphone and
+// speaker.
+
+#define ICE_CANDIDATE_QUEUE_SIZE 16
+#define ANSWER_BUFFER_SIZE 4096
+#define SIGNAL_RESPONSE_ARENA_SIZE (32 * 1024)
+
+// Initial size, enough for every request but an unusually large offer
+#define SIGNAL_REQUEST_BUFFER_SIZE 2048
+
+// Trickled remote ICE candidates, one ring per PeerConnection. Filled by the
+// signaling thread and drained in arrival order by the PeerConnection thread,
+// both under the session mutex. Candidates stay queued until the remote
+// description they belong to has been applied
+typedef struct {
+  char *candidates[ICE_CANDIDATE_QUEUE_SIZE];
+  int head;
+  int count;
+  bool remote_description_set;
+} lk_ice_candidate_queue;
+
+struct lk_session {
+  // Guards everything shared between the signaling loop and the
+  // PeerConnection tasks
+  SemaphoreHandle_t mutex;
+
+  // Set whenever the publisher or subscriber FSM has a SignalRequest to send,
+  // or a reconnect is requested. The signaling loop sleeps on it instead of
+  // polling
+  EventGroupHandle_t signaling_events;
+
+  const char *url;
+  const char *token;
+  bool media;
+  esp_websocket_client_handle_t client;
+
+  PeerConnection *subscriber_peer_connection;
+  PeerConnection *publisher_peer_connection;
+  bool publisher_started;
+
+  // publisher_status is a FSM of the following states
+  // * 0 - NoOp
+  // * 1 - Send AddTrackRequest
+  // * 2 - Create Local Offer
+  // * 3 - Send Local Offer
+  // * 4 - Handle remote Answer
+  int publisher_status;
+  char *publisher_signaling_buffer;
+
+  // subscriber_status is a FSM of the following states
+  // * 0 - NoOp, don't send an answer
+  // * 1 - Send an answer to subscriber_remote_offer
+  int subscriber_status;
+
+  // Offer + ICE Candidates. Captured in signaling thread and set
+  // PeerConnection thread
+  char *subscriber_offer_buffer;
+  lk_ice_candidate_queue subscriber_ice_candidates;
+  lk_ice_candidate_queue publisher_ice_candidates;
+
+  // Subscriber answer is generated manually from the remote offer and the
+  // ICE/DTLS parameters of libpeer's local description. Both are kept until
+  // the answer to the offer is sent
+  char *subscriber_remote_offer;
+  char *subscriber_local_description;
+  lk_sdp answer_offer;
+  lk_sdp answer_local;
+  char *answer_buffer;
+
+  // reconnect_status is a FSM of the following states, only touched by the
+  // signaling loop
+  // * 0 - Connected, nothing to do
+  // * 1 - Resume. Reconnect signaling with reconnect=1 and the same
+  //       participant sid, then ICE restart whichever PeerConnection dropped
+  // * 2 - Rejoin. Join again as a new participant, retried with exponential
+  //       backoff
+  int reconnect_status;
+  int reconnect_attempts;
+  int64_t reconnect_start_time;
+  int64_t reconnect_deadline;
+
+  // Set by the websocket task once the server accepted the current connection
+  volatile bool signaling_ready;
+
+  // Whether each PeerConnection completed, set by its state callback. A rejoin
+  // clears both, the old connections stay completed until the new participant
+  // negotiates again
+  volatile bool subscriber_connected;
+  volatile bool publisher_connected;
+
+  // Assigned by the JOIN response, needed to resume the session
+  char *participant_sid;
+  bool track_published;
+
+  // Assigned by TRACK_PUBLISHED, MuteTrackRequests refer to it
+  char *track_sid;
+
+  // Remote audio tracks and which of them are subscribed. Updated by the
+  // websocket task, the signaling loop sends the resulting requests
+  lk_subscriptions subscriptions;
+
+  // Mute state the media pipeline asked for and the last one sent for
+  // track_sid. A new track starts unmuted
+  volatile bool microphone_muted;
+  bool microphone_muted_sent;
+
+  // Time lk_websocket was called, join milestones are logged relative to it
+  int64_t join_start_time;
+
+  // Also told about every join milestone when set, the join benchmark times
+  // joins with it. Called from whichever task reached the milestone
+  void (*join_milestone_observer)(lk_session *session, const char *milestone,
+                                  int64_t elapsed_us);
+
+  // Start of the signaling round trips recorded in metrics, 0 when none is
+  // outstanding. Set by the signaling loop or the websocket task and taken by
+  // the other
+  std::atomic<int64_t> publisher_offer_sent_time;
+  std::atomic<int64_t> subscriber_offer_received_time;
+
+  // Every SignalResponse is unpacked into this arena and it is reset once the
+  // response has been handled, so decoding never touches the heap
+  lk_arena signal_response_arena;
+  ProtobufCAllocator signal_response_allocator;
+
+  // SignalRequests are packed into this buffer. Only grows if a request is
+  // larger than anything sent before
+  uint8_t *signal_request_buffer;
+  size_t signal_request_buffer_size;
+};
+
+// Returns NULL if the session could not be allocated. The url and token must
+// outlive it
+lk_session *lk_session_create(const char *url, const char *token, bool media);
+
+// Packs r into session->signal_request_buffer, growing it if needed. Returns
+// the packed length, 0 if the buffer could not grow
+size_t lk_pack_signal_request(lk_session *session,
+                              const Livekit__SignalRequest *r);
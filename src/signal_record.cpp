@@ -0,0 +1,98 @@
+#include "signal_record.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+
+#define LOG_TAG "signal_record"
+
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *record_file = NULL;
+static bool record_opened = false;
+
+// Opened on the first frame, NULL when recording is off. Called with
+// record_mutex held
+static FILE *lk_signal_record_file() {
+  if (record_opened) {
+    return record_file;
+  }
+  record_opened = true;
+
+  auto path = getenv("LK_SIGNAL_RECORD");
+  if (path == NULL) {
+    return NULL;
+  }
+
+  record_file = fopen(path, "wb");
+  if (record_file == NULL ||
+      fwrite(LK_SIGNAL_RECORD_MAGIC, 1, strlen(LK_SIGNAL_RECORD_MAGIC),
+             record_file) != strlen(LK_SIGNAL_RECORD_MAGIC)) {
+    ESP_LOGE(LOG_TAG, "Failed to open %s, not recording", path);
+    if (record_file != NULL) {
+      fclose(record_file);
+      record_file = NULL;
+    }
+    return NULL;
+  }
+
+  ESP_LOGI(LOG_TAG, "Recording signaling to %s", path);
+  return record_file;
+}
+
+void lk_signal_record(lk_session *session, lk_signal_direction direction,
+                      const uint8_t *data, size_t size) {
+  pthread_mutex_lock(&record_mutex);
+  auto file = lk_signal_record_file();
+  if (file != NULL) {
+    lk_signal_record_header header = {};
+    header.time_us = esp_timer_get_time() - session->join_start_time;
+    header.size = size;
+    header.direction = direction;
+
+    // Flushed per frame, a recording is usually stopped by killing the
+    // process
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(data, 1, size, file) != size || fflush(file) != 0) {
+      ESP_LOGE(LOG_TAG, "Failed to record frame, recording stopped");
+      fclose(record_file);
+      record_file = NULL;
+    }
+  }
+  pthread_mutex_unlock(&record_mutex);
+}
+
+FILE *lk_signal_record_open(const char *path) {
+  auto file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  char magic[sizeof(LK_SIGNAL_RECORD_MAGIC)] = {};
+  if (fread(magic, 1, strlen(LK_SIGNAL_RECORD_MAGIC), file) !=
+          strlen(LK_SIGNAL_RECORD_MAGIC) ||
+      strcmp(magic, LK_SIGNAL_RECORD_MAGIC) != 0) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+int lk_signal_record_read(FILE *file, lk_signal_record_header *header,
+                          uint8_t **data) {
+  if (fread(header, sizeof(*header), 1, file) != 1 ||
+      header->size > LK_SIGNAL_RECORD_MAX_FRAME) {
+    return -1;
+  }
+
+  auto resized =
+      (uint8_t *)realloc(*data, header->size > 0 ? header->size : 1);
+  if (resized == NULL) {
+    return -1;
+  }
+  *data = resized;
+  return fread(*data, 1, header->size, file) == header->size ? 0 : -1;
+}
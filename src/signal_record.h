@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct lk_session lk_session;
+
+// Every SignalResponse received and SignalRequest sent is appended to the
+// file named by LK_SIGNAL_RECORD (linux only), so a join can be replayed
+// against the mock SFU. Frames of every session in the process go to the
+// same file.
+//
+// The file is LK_SIGNAL_RECORD_MAGIC followed by frames, each a header and
+// the packed message.
+
+#define LK_SIGNAL_RECORD_MAGIC "LKSIG001"
+#define LK_SIGNAL_RECORD_MAX_FRAME (256 * 1024)
+
+typedef enum {
+  LK_SIGNAL_RECEIVED = 0,  // SignalResponse
+  LK_SIGNAL_SENT = 1,      // SignalRequest
+} lk_signal_direction;
+
+typedef struct {
+  int64_t time_us;  // since the session called lk_websocket
+  uint32_t size;
+  uint8_t direction;
+  uint8_t reserved[3];
+} lk_signal_record_header;
+
+#ifdef LINUX_BUILD
+void lk_signal_record(lk_session *session, lk_signal_direction direction,
+                      const uint8_t *data, size_t size);
+
+// Opens a recording for reading, past the magic. NULL if it isn't one
+FILE *lk_signal_record_open(const char *path);
+
+// Reads the next frame into *data, which is grown as needed and freed by the
+// caller. Returns 0 on success, -1 at the end of the file or if it is
+// malformed
+int lk_signal_record_read(FILE *file, lk_signal_record_header *header,
+                          uint8_t **data);
+#else
+static inline void lk_signal_record(lk_session *session,
+                                    lk_signal_direction direction,
+                                    const uint8_t *data, size_t size) {}
+#endif
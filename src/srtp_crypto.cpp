@@ -0,0 +1,275 @@
+#include "srtp_crypto.h"
+
+#include <crypto_kernel.h>
+#include <esp_log.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+#include <srtp2/srtp.h>
+#include <string.h>
+
+#include "mem_budget.h"
+
+#define LOG_TAG "srtp_crypto"
+
+// AES_CM_128 keys are followed by the 112 bit salt
+#define AES_ICM_KEY_SIZE 16
+#define AES_ICM_SALT_SIZE 14
+#define AES_BLOCK_SIZE 16
+#define HMAC_SHA1_SIZE 20
+
+typedef struct {
+  mbedtls_aes_context aes;
+  uint8_t salt[AES_BLOCK_SIZE];  // zero padded, XORed into every IV
+  uint8_t counter[AES_BLOCK_SIZE];
+  uint8_t stream_block[AES_BLOCK_SIZE];
+  size_t stream_offset;
+} lk_srtp_aes_icm;
+
+typedef struct {
+  mbedtls_md_context_t md;
+} lk_srtp_hmac;
+
+// The self tests libsrtp runs on a replacement are the built-in's, they are
+// filled in before the first replacement
+static srtp_cipher_type_t aes_icm_type;
+static srtp_auth_type_t hmac_type;
+
+static const srtp_cipher_type_t *software_cipher_type;
+static const srtp_auth_type_t *software_auth_type;
+static lk_srtp_crypto selected = LK_SRTP_CRYPTO_SOFTWARE;
+
+static srtp_err_status_t lk_srtp_aes_icm_alloc(srtp_cipher_pointer_t *cipher,
+                                               int key_len, int tag_len) {
+  if (key_len != AES_ICM_KEY_SIZE + AES_ICM_SALT_SIZE) {
+    return srtp_err_status_bad_param;
+  }
+
+  // One allocation for both, like libsrtp's own ciphers
+  auto c = (srtp_cipher_t *)lk_mem_calloc(
+      LK_MEM_TLS, 1, sizeof(srtp_cipher_t) + sizeof(lk_srtp_aes_icm));
+  if (c == NULL) {
+    return srtp_err_status_alloc_fail;
+  }
+  auto state = (lk_srtp_aes_icm *)(c + 1);
+  mbedtls_aes_init(&state->aes);
+
+  c->type = &aes_icm_type;
+  c->state = state;
+  c->key_len = key_len;
+  c->algorithm = SRTP_AES_ICM_128;
+  *cipher = c;
+  return srtp_err_status_ok;
+}
+
+static srtp_err_status_t lk_srtp_aes_icm_dealloc(srtp_cipher_pointer_t c) {
+  auto state = (lk_srtp_aes_icm *)c->state;
+  mbedtls_aes_free(&state->aes);
+  mbedtls_platform_zeroize(c, sizeof(srtp_cipher_t) + sizeof(*state));
+  lk_mem_free(LK_MEM_TLS, c);
+  return srtp_err_status_ok;
+}
+
+static srtp_err_status_t lk_srtp_aes_icm_init(void *cipher_state,
+                                              const uint8_t *key) {
+  auto state = (lk_srtp_aes_icm *)cipher_state;
+  memset(state->salt, 0, sizeof(state->salt));
+  memcpy(state->salt, key + AES_ICM_KEY_SIZE, AES_ICM_SALT_SIZE);
+  return mbedtls_aes_setkey_enc(&state->aes, key, AES_ICM_KEY_SIZE * 8) == 0
+             ? srtp_err_status_ok
+             : srtp_err_status_init_fail;
+}
+
+static srtp_err_status_t lk_srtp_aes_icm_set_iv(
+    void *cipher_state, uint8_t *iv, srtp_cipher_direction_t direction) {
+  auto state = (lk_srtp_aes_icm *)cipher_state;
+  for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+    state->counter[i] = state->salt[i] ^ iv[i];
+  }
+  state->stream_offset = 0;
+  return srtp_err_status_ok;
+}
+
+// The whole packet in one call, which the accelerator and AES-NI process
+// without going back to libsrtp for every block. Decrypting is the same
+static srtp_err_status_t lk_srtp_aes_icm_encrypt(void *cipher_state,
+                                                 uint8_t *buffer,
+                                                 unsigned int *size) {
+  auto state = (lk_srtp_aes_icm *)cipher_state;
+  return mbedtls_aes_crypt_ctr(&state->aes, *size, &state->stream_offset,
+                               state->counter, state->stream_block, buffer,
+                               buffer) == 0
+             ? srtp_err_status_ok
+             : srtp_err_status_cipher_fail;
+}
+
+static srtp_err_status_t lk_srtp_hmac_alloc(srtp_auth_pointer_t *auth,
+                                            int key_len, int out_len) {
+  if (key_len > HMAC_SHA1_SIZE || out_len > HMAC_SHA1_SIZE) {
+    return srtp_err_status_bad_param;
+  }
+
+  auto a = (srtp_auth_t *)lk_mem_calloc(
+      LK_MEM_TLS, 1, sizeof(srtp_auth_t) + sizeof(lk_srtp_hmac));
+  if (a == NULL) {
+    return srtp_err_status_alloc_fail;
+  }
+  auto state = (lk_srtp_hmac *)(a + 1);
+  mbedtls_md_init(&state->md);
+  if (mbedtls_md_setup(&state->md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1),
+                       /* hmac */ 1) != 0) {
+    mbedtls_md_free(&state->md);
+    lk_mem_free(LK_MEM_TLS, a);
+    return srtp_err_status_alloc_fail;
+  }
+
+  a->type = &hmac_type;
+  a->state = state;
+  a->out_len = out_len;
+  a->key_len = key_len;
+  a->prefix_len = 0;
+  *auth = a;
+  return srtp_err_status_ok;
+}
+
+static srtp_err_status_t lk_srtp_hmac_dealloc(srtp_auth_pointer_t a) {
+  auto state = (lk_srtp_hmac *)a->state;
+  mbedtls_md_free(&state->md);
+  mbedtls_platform_zeroize(a, sizeof(srtp_auth_t) + sizeof(*state));
+  lk_mem_free(LK_MEM_TLS, a);
+  return srtp_err_status_ok;
+}
+
+// Keeps the padded key, every start only restores it
+static srtp_err_status_t lk_srtp_hmac_init(void *auth_state, const uint8_t *key,
+                                           int key_len) {
+  auto state = (lk_srtp_hmac *)auth_state;
+  return mbedtls_md_hmac_starts(&state->md, key, key_len) == 0
+             ? srtp_err_status_ok
+             : srtp_err_status_auth_fail;
+}
+
+static srtp_err_status_t lk_srtp_hmac_start(void *auth_state) {
+  auto state = (lk_srtp_hmac *)auth_state;
+  return mbedtls_md_hmac_reset(&state->md) == 0 ? srtp_err_status_ok
+                                                : srtp_err_status_auth_fail;
+}
+
+static srtp_err_status_t lk_srtp_hmac_update(void *auth_state,
+                                             const uint8_t *message,
+                                             int size) {
+  auto state = (lk_srtp_hmac *)auth_state;
+  return mbedtls_md_hmac_update(&state->md, message, size) == 0
+             ? srtp_err_status_ok
+             : srtp_err_status_auth_fail;
+}
+
+static srtp_err_status_t lk_srtp_hmac_compute(void *auth_state,
+                                              const uint8_t *message,
+                                              int size, int tag_len,
+                                              uint8_t *tag) {
+  if (tag_len > HMAC_SHA1_SIZE) {
+    return srtp_err_status_bad_param;
+  }
+
+  auto state = (lk_srtp_hmac *)auth_state;
+  uint8_t digest[HMAC_SHA1_SIZE];
+  if (mbedtls_md_hmac_update(&state->md, message, size) != 0 ||
+      mbedtls_md_hmac_finish(&state->md, digest) != 0) {
+    return srtp_err_status_auth_fail;
+  }
+  memcpy(tag, digest, tag_len);
+  return srtp_err_status_ok;
+}
+
+// libsrtp has no getter for what is registered, an instance knows its type
+static int lk_srtp_crypto_find_software() {
+  if (software_cipher_type != NULL) {
+    return 0;
+  }
+
+  srtp_cipher_pointer_t cipher;
+  if (srtp_crypto_kernel_alloc_cipher(
+          SRTP_AES_ICM_128, &cipher, AES_ICM_KEY_SIZE + AES_ICM_SALT_SIZE,
+          0) != srtp_err_status_ok) {
+    return -1;
+  }
+  auto cipher_type = cipher->type;
+  cipher_type->dealloc(cipher);
+
+  srtp_auth_pointer_t auth;
+  if (srtp_crypto_kernel_alloc_auth(SRTP_HMAC_SHA1, &auth, HMAC_SHA1_SIZE,
+                                    HMAC_SHA1_SIZE) != srtp_err_status_ok) {
+    return -1;
+  }
+  auto auth_type = auth->type;
+  auth_type->dealloc(auth);
+
+  aes_icm_type = {
+      .alloc = lk_srtp_aes_icm_alloc,
+      .dealloc = lk_srtp_aes_icm_dealloc,
+      .init = lk_srtp_aes_icm_init,
+      .set_aad = NULL,
+      .encrypt = lk_srtp_aes_icm_encrypt,
+      .decrypt = lk_srtp_aes_icm_encrypt,
+      .set_iv = lk_srtp_aes_icm_set_iv,
+      .get_tag = NULL,
+      .description = "AES-128 counter mode using mbedTLS",
+      .test_data = cipher_type->test_data,
+      .id = SRTP_AES_ICM_128,
+  };
+  hmac_type = {
+      .alloc = lk_srtp_hmac_alloc,
+      .dealloc = lk_srtp_hmac_dealloc,
+      .init = lk_srtp_hmac_init,
+      .compute = lk_srtp_hmac_compute,
+      .update = lk_srtp_hmac_update,
+      .start = lk_srtp_hmac_start,
+      .description = "HMAC-SHA1 using mbedTLS",
+      .test_data = auth_type->test_data,
+      .id = SRTP_HMAC_SHA1,
+  };
+  software_cipher_type = cipher_type;
+  software_auth_type = auth_type;
+  return 0;
+}
+
+int lk_srtp_crypto_use(lk_srtp_crypto crypto) {
+  if (crypto == selected) {
+    return 0;
+  }
+  if (lk_srtp_crypto_find_software() != 0) {
+    ESP_LOGE(LOG_TAG, "libsrtp is not initialized");
+    return -1;
+  }
+
+  auto mbedtls = crypto == LK_SRTP_CRYPTO_MBEDTLS;
+  // Replacing runs libsrtp's self tests against the new implementation
+  if (srtp_crypto_kernel_replace_cipher_type(
+          mbedtls ? &aes_icm_type : software_cipher_type, SRTP_AES_ICM_128) !=
+      srtp_err_status_ok) {
+    ESP_LOGE(LOG_TAG, "Failed to replace AES-CM");
+    return -1;
+  }
+  if (srtp_crypto_kernel_replace_auth_type(
+          mbedtls ? &hmac_type : software_auth_type, SRTP_HMAC_SHA1) !=
+      srtp_err_status_ok) {
+    ESP_LOGE(LOG_TAG, "Failed to replace HMAC-SHA1");
+    srtp_crypto_kernel_replace_cipher_type(
+        mbedtls ? software_cipher_type : &aes_icm_type, SRTP_AES_ICM_128);
+    return -1;
+  }
+
+  selected = crypto;
+  return 0;
+}
+
+void lk_srtp_crypto_init(void) {
+#ifndef LK_SRTP_SOFTWARE_CRYPTO
+  if (lk_srtp_crypto_use(LK_SRTP_CRYPTO_MBEDTLS) == 0) {
+    ESP_LOGI(LOG_TAG, "SRTP uses mbedTLS AES-CM and HMAC-SHA1");
+  } else {
+    ESP_LOGW(LOG_TAG, "SRTP falls back to libsrtp's built-in crypto");
+  }
+#endif
+}
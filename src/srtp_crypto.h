@@ -0,0 +1,24 @@
+#pragma once
+
+// AES-CM and HMAC-SHA1 for libsrtp through mbedTLS, which uses the AES and
+// SHA accelerators on target and AES-NI on linux. libsrtp's built-in
+// implementations are generic C, one AES block at a time.
+//
+// Every sent and received audio packet is protected with the default SRTP
+// profile (AES_CM_128_HMAC_SHA1_80), the only AES profile mbedTLS negotiates
+// for DTLS-SRTP, so these two are the ones replaced. Sessions keep the
+// implementation they were created with. Build with LK_SRTP_SOFTWARE_CRYPTO
+// defined to keep libsrtp's.
+
+typedef enum {
+  LK_SRTP_CRYPTO_SOFTWARE = 0,  // libsrtp's built-in
+  LK_SRTP_CRYPTO_MBEDTLS,
+} lk_srtp_crypto;
+
+// Selects what SRTP sessions created from now on use. libsrtp must be
+// initialized, peer_init does it. Returns 0 on success, on failure nothing
+// changed.
+int lk_srtp_crypto_use(lk_srtp_crypto crypto);
+
+// After peer_init, mbedTLS unless LK_SRTP_SOFTWARE_CRYPTO is defined
+void lk_srtp_crypto_init(void);
@@ -0,0 +1,249 @@
+#include "subscriptions.h"
+
+#include <esp_log.h>
+#include <string.h>
+
+#include "main.h"
+#include "mem_budget.h"
+
+#define LOG_TAG "subscriptions"
+
+// A subscribed track beyond the stream pool would only be dropped by media
+static_assert(LK_SUBSCRIPTION_MAX_SPEAKERS <= LK_AUDIO_MAX_STREAMS,
+              "LK_SUBSCRIPTION_MAX_SPEAKERS exceeds LK_AUDIO_MAX_STREAMS");
+
+#define HOLD_US (LK_SUBSCRIPTION_HOLD_MS * 1000LL)
+#define RELEASE_US (LK_SUBSCRIPTION_RELEASE_MS * 1000LL)
+
+static lk_subscription_track *lk_subscriptions_find(
+    lk_subscriptions *subscriptions, const char *track_sid) {
+  for (int i = 0; i < subscriptions->count; i++) {
+    if (strcmp(subscriptions->tracks[i].track_sid, track_sid) == 0) {
+      return &subscriptions->tracks[i];
+    }
+  }
+  return NULL;
+}
+
+static lk_subscription_track *lk_subscriptions_add(
+    lk_subscriptions *subscriptions, const char *participant_sid,
+    const char *track_sid) {
+  if (subscriptions->count == LK_SUBSCRIPTION_MAX_TRACKS) {
+    ESP_LOGW(LOG_TAG, "Ignoring track %s, tracking %d already", track_sid,
+             LK_SUBSCRIPTION_MAX_TRACKS);
+    return NULL;
+  }
+
+  auto t = &subscriptions->tracks[subscriptions->count];
+  memset(t, 0, sizeof(*t));
+  t->participant_sid = lk_mem_strdup(LK_MEM_SIGNALING, participant_sid);
+  t->track_sid = lk_mem_strdup(LK_MEM_SIGNALING, track_sid);
+  if (t->participant_sid == NULL || t->track_sid == NULL) {
+    lk_mem_free(LK_MEM_SIGNALING, t->participant_sid);
+    lk_mem_free(LK_MEM_SIGNALING, t->track_sid);
+    return NULL;
+  }
+  subscriptions->count++;
+  return t;
+}
+
+// The SFU drops the subscription of an unpublished track itself
+static void lk_subscriptions_remove(lk_subscriptions *subscriptions, int i) {
+  auto t = &subscriptions->tracks[i];
+  ESP_LOGI(LOG_TAG, "Track %s of %s gone", t->track_sid, t->participant_sid);
+  if (t->state != LK_SUBSCRIPTION_UNSUBSCRIBED) {
+    subscriptions->subscribed--;
+  }
+  lk_mem_free(LK_MEM_SIGNALING, t->participant_sid);
+  lk_mem_free(LK_MEM_SIGNALING, t->track_sid);
+  *t = subscriptions->tracks[--subscriptions->count];
+}
+
+void lk_subscriptions_reset(lk_subscriptions *subscriptions) {
+  while (subscriptions->count > 0) {
+    lk_subscriptions_remove(subscriptions, subscriptions->count - 1);
+  }
+  subscriptions->subscribed = 0;
+}
+
+void lk_subscriptions_update_participant(lk_subscriptions *subscriptions,
+                                         const Livekit__ParticipantInfo *info) {
+  for (int i = 0; i < subscriptions->count; i++) {
+    if (strcmp(subscriptions->tracks[i].participant_sid, info->sid) == 0) {
+      subscriptions->tracks[i].seen = false;
+    }
+  }
+
+  if (info->state != LIVEKIT__PARTICIPANT_INFO__STATE__DISCONNECTED) {
+    for (size_t i = 0; i < info->n_tracks; i++) {
+      auto track = info->tracks[i];
+      if (track->type != LIVEKIT__TRACK_TYPE__AUDIO) {
+        continue;
+      }
+
+      auto t = lk_subscriptions_find(subscriptions, track->sid);
+      if (t == NULL) {
+        t = lk_subscriptions_add(subscriptions, info->sid, track->sid);
+        if (t == NULL) {
+          continue;
+        }
+        ESP_LOGI(LOG_TAG, "Track %s of %s published", track->sid,
+                 info->identity);
+      }
+      t->muted = track->muted;
+      t->seen = true;
+    }
+  }
+
+  // Unpublished, or the participant left
+  for (int i = subscriptions->count - 1; i >= 0; i--) {
+    auto t = &subscriptions->tracks[i];
+    if (!t->seen && strcmp(t->participant_sid, info->sid) == 0) {
+      lk_subscriptions_remove(subscriptions, i);
+    }
+  }
+}
+
+void lk_subscriptions_update_speakers(lk_subscriptions *subscriptions,
+                                      const Livekit__SpeakersChanged *changed,
+                                      int64_t now_us) {
+  for (size_t i = 0; i < changed->n_speakers; i++) {
+    auto speaker = changed->speakers[i];
+    for (int j = 0; j < subscriptions->count; j++) {
+      auto t = &subscriptions->tracks[j];
+      if (strcmp(t->participant_sid, speaker->sid) != 0) {
+        continue;
+      }
+
+      // The hold runs from when they stopped
+      if (speaker->active || t->speaking) {
+        t->last_spoke_us = now_us;
+      }
+      t->speaking = speaker->active;
+      t->level = speaker->active ? speaker->level : 0;
+    }
+  }
+}
+
+static bool lk_subscriptions_held(const lk_subscription_track *t,
+                                  int64_t now_us) {
+  return t->speaking ||
+         (t->last_spoke_us != 0 && now_us - t->last_spoke_us < HOLD_US);
+}
+
+// Speaking first, loudest first, then whoever has the slot, then whoever
+// spoke last
+static bool lk_subscriptions_better(const lk_subscription_track *a,
+                                    const lk_subscription_track *b) {
+  if (a->speaking != b->speaking) {
+    return a->speaking;
+  }
+  if (a->level != b->level) {
+    return a->level > b->level;
+  }
+  if (a->selected != b->selected) {
+    return a->selected;
+  }
+  return a->last_spoke_us > b->last_spoke_us;
+}
+
+// Selected speakers keep their slot while held, the rest go to the best
+// ranked. With no more tracks than slots every unmuted track is selected
+static void lk_subscriptions_rank(lk_subscriptions *subscriptions,
+                                  int64_t now_us) {
+  bool keep[LK_SUBSCRIPTION_MAX_TRACKS];
+  int slots = LK_SUBSCRIPTION_MAX_SPEAKERS;
+  for (int i = 0; i < subscriptions->count; i++) {
+    auto t = &subscriptions->tracks[i];
+    keep[i] = t->selected && !t->muted && lk_subscriptions_held(t, now_us);
+    if (keep[i]) {
+      slots--;
+    }
+  }
+
+  bool taken[LK_SUBSCRIPTION_MAX_TRACKS];
+  memcpy(taken, keep, sizeof(taken));
+  for (; slots > 0; slots--) {
+    lk_subscription_track *best = NULL;
+    int best_index = -1;
+    for (int i = 0; i < subscriptions->count; i++) {
+      auto t = &subscriptions->tracks[i];
+      if (taken[i] || t->muted) {
+        continue;
+      }
+      if (best == NULL || lk_subscriptions_better(t, best)) {
+        best = t;
+        best_index = i;
+      }
+    }
+    if (best == NULL) {
+      break;
+    }
+    taken[best_index] = true;
+  }
+
+  for (int i = 0; i < subscriptions->count; i++) {
+    subscriptions->tracks[i].selected = taken[i];
+  }
+}
+
+bool lk_subscriptions_select(lk_subscriptions *subscriptions, int64_t now_us,
+                             lk_subscription_changes *changes) {
+  memset(changes, 0, sizeof(*changes));
+  lk_subscriptions_rank(subscriptions, now_us);
+
+  for (int i = 0; i < subscriptions->count; i++) {
+    auto t = &subscriptions->tracks[i];
+    if (t->selected) {
+      if (t->state == LK_SUBSCRIPTION_UNSUBSCRIBED) {
+        changes->subscribe[changes->n_subscribe++] = t->track_sid;
+        subscriptions->subscribed++;
+      } else if (t->state == LK_SUBSCRIPTION_DISABLED) {
+        changes->enable[changes->n_enable++] = t->track_sid;
+      } else {
+        continue;
+      }
+      ESP_LOGI(LOG_TAG, "Receiving %s of %s", t->track_sid,
+               t->participant_sid);
+      t->state = LK_SUBSCRIPTION_ENABLED;
+    } else if (t->state == LK_SUBSCRIPTION_ENABLED) {
+      ESP_LOGI(LOG_TAG, "Pausing %s of %s", t->track_sid, t->participant_sid);
+      changes->disable[changes->n_disable++] = t->track_sid;
+      t->state = LK_SUBSCRIPTION_DISABLED;
+      t->deselected_us = now_us;
+    } else if (t->state == LK_SUBSCRIPTION_DISABLED &&
+               now_us - t->deselected_us >= RELEASE_US) {
+      ESP_LOGI(LOG_TAG, "Unsubscribing %s of %s", t->track_sid,
+               t->participant_sid);
+      changes->unsubscribe[changes->n_unsubscribe++] = t->track_sid;
+      t->state = LK_SUBSCRIPTION_UNSUBSCRIBED;
+      subscriptions->subscribed--;
+    }
+  }
+
+  return changes->n_subscribe > 0 || changes->n_unsubscribe > 0 ||
+         changes->n_enable > 0 || changes->n_disable > 0;
+}
+
+// A hold running out only matters if someone waits for the slot, running
+// lk_subscriptions_select for nothing is cheap though
+int64_t lk_subscriptions_deadline(const lk_subscriptions *subscriptions,
+                                  int64_t now_us) {
+  int64_t deadline = 0;
+  auto consider = [&](int64_t at) {
+    if (at > now_us && (deadline == 0 || at < deadline)) {
+      deadline = at;
+    }
+  };
+
+  for (int i = 0; i < subscriptions->count; i++) {
+    auto t = &subscriptions->tracks[i];
+    if (t->selected && !t->speaking && t->last_spoke_us != 0) {
+      consider(t->last_spoke_us + HOLD_US);
+    }
+    if (t->state == LK_SUBSCRIPTION_DISABLED) {
+      consider(t->deselected_us + RELEASE_US);
+    }
+  }
+  return deadline;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <livekit_rtc.pb-c.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Selective subscription to remote audio. The session joins with
+// auto_subscribe=false and only the LK_SUBSCRIPTION_MAX_SPEAKERS most active
+// speakers are subscribed, so downlink bitrate and decode load stay bounded
+// however many participants publish. Participants and their audio tracks are
+// tracked from JOIN and UPDATE, speaking from SPEAKERS_CHANGED.
+//
+// Hysteresis keeps a speaker selected for LK_SUBSCRIPTION_HOLD_MS after they
+// stop, and a track that loses its slot is first only disabled
+// (UpdateTrackSettings), which the SFU resumes at once. It is unsubscribed
+// (UpdateSubscription) after LK_SUBSCRIPTION_RELEASE_MS without a slot.
+//
+// Not thread safe, the session mutex guards it. Define LK_AUTO_SUBSCRIBE to
+// subscribe to everything instead.
+
+// At most as many as media mixes, LK_AUDIO_MAX_STREAMS in main.h
+#ifndef LK_SUBSCRIPTION_MAX_SPEAKERS
+#define LK_SUBSCRIPTION_MAX_SPEAKERS 3
+#endif
+
+#ifndef LK_SUBSCRIPTION_HOLD_MS
+#define LK_SUBSCRIPTION_HOLD_MS 2000
+#endif
+
+#ifndef LK_SUBSCRIPTION_RELEASE_MS
+#define LK_SUBSCRIPTION_RELEASE_MS 10000
+#endif
+
+// Remote audio tracks tracked, later ones are ignored
+#define LK_SUBSCRIPTION_MAX_TRACKS 32
+
+typedef enum {
+  LK_SUBSCRIPTION_UNSUBSCRIBED = 0,
+  LK_SUBSCRIPTION_ENABLED,
+  LK_SUBSCRIPTION_DISABLED,  // subscribed, the SFU doesn't forward it
+} lk_subscription_state;
+
+typedef struct {
+  char *participant_sid;
+  char *track_sid;
+  bool muted;
+  bool seen;  // in the participant's latest update
+
+  bool speaking;
+  float level;
+  int64_t last_spoke_us;  // when last reported speaking, or stopping
+
+  bool selected;
+  lk_subscription_state state;  // as last requested from the SFU
+  int64_t deselected_us;
+} lk_subscription_track;
+
+typedef struct {
+  lk_subscription_track tracks[LK_SUBSCRIPTION_MAX_TRACKS];
+  int count;
+  int subscribed;  // tracks not UNSUBSCRIBED
+} lk_subscriptions;
+
+// Track sids to send in each request, valid until the subscriptions change
+typedef struct {
+  char *subscribe[LK_SUBSCRIPTION_MAX_TRACKS];
+  size_t n_subscribe;
+  char *unsubscribe[LK_SUBSCRIPTION_MAX_TRACKS];
+  size_t n_unsubscribe;
+  char *enable[LK_SUBSCRIPTION_MAX_TRACKS];
+  size_t n_enable;
+  char *disable[LK_SUBSCRIPTION_MAX_TRACKS];
+  size_t n_disable;
+} lk_subscription_changes;
+
+// Forgets every track, the SFU dropped the subscriptions with the participant
+void lk_subscriptions_reset(lk_subscriptions *subscriptions);
+
+// A participant's current state, from JOIN or UPDATE. The local participant
+// must be left out
+void lk_subscriptions_update_participant(lk_subscriptions *subscriptions,
+                                         const Livekit__ParticipantInfo *info);
+
+// SPEAKERS_CHANGED only lists the participants whose state changed
+void lk_subscriptions_update_speakers(lk_subscriptions *subscriptions,
+                                      const Livekit__SpeakersChanged *changed,
+                                      int64_t now_us);
+
+// Selects the speakers and fills changes with the requests that get the SFU
+// there. Returns whether any is needed
+bool lk_subscriptions_select(lk_subscriptions *subscriptions, int64_t now_us,
+                             lk_subscription_changes *changes);
+
+// After now_us, when lk_subscriptions_select has to run again even if nothing
+// is received, 0 if never
+int64_t lk_subscriptions_deadline(const lk_subscriptions *subscriptions,
+                                  int64_t now_us);
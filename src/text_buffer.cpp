@@ -0,0 +1,37 @@
+#include "text_buffer.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+void lk_text_buffer_init(lk_text_buffer *text, char *out, size_t size) {
+  text->out = out;
+  text->size = size;
+  text->len = 0;
+  if (size > 0) {
+    out[0] = '\0';
+  }
+}
+
+void lk_text_append(lk_text_buffer *text, const char *format, ...) {
+  if (text->len >= text->size) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  auto ret = vsnprintf(text->out + text->len, text->size - text->len, format,
+                       args);
+  va_end(args);
+  text->len += ret > 0 ? ret : 0;
+}
+
+bool lk_text_buffer_truncated(const lk_text_buffer *text) {
+  return text->len >= text->size;
+}
+
+size_t lk_text_buffer_length(const lk_text_buffer *text) {
+  if (text->size == 0) {
+    return 0;
+  }
+  return text->len < text->size ? text->len : text->size - 1;
+}
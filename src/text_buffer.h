@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+// Formatted text appended to a fixed buffer, for reports and the SDP answer.
+// Whatever doesn't fit is dropped, len keeps counting so the caller can tell.
+typedef struct {
+  char *out;
+  size_t size;
+  size_t len;
+} lk_text_buffer;
+
+void lk_text_buffer_init(lk_text_buffer *text, char *out, size_t size);
+
+void lk_text_append(lk_text_buffer *text, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+bool lk_text_buffer_truncated(const lk_text_buffer *text);
+
+// Length of the text in out, without what was dropped
+size_t lk_text_buffer_length(const lk_text_buffer *text);
@@ -0,0 +1,162 @@
+#include "trace.h"
+
+#if defined(LK_TRACE) && defined(LINUX_BUILD)
+
+#include <esp_log.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#define LOG_TAG "trace"
+
+// Per thread, about 5 seconds of every span at 50 frames a second
+#define LK_TRACE_RING_EVENTS 16384
+#define LK_TRACE_DEFAULT_FILE "trace.json"
+
+static const char *span_names[LK_TRACE_SPAN_COUNT] = {
+    "send_audio",       "audio_encode",      "audio_decode",
+    "publisher_loop",   "subscriber_loop",   "signaling_values",
+    "signal_request",
+};
+
+typedef struct {
+  int64_t time_ns;
+  uint16_t span;
+  char phase;  // 'B' or 'E'
+} lk_trace_event;
+
+// Only the owning thread writes events, it publishes them by storing head
+// after the slot. The dump copies and then checks nothing it copied was
+// overwritten in the meantime, so recording never waits
+typedef struct lk_trace_ring {
+  lk_trace_event events[LK_TRACE_RING_EVENTS];
+  std::atomic<uint64_t> head;  // events ever recorded
+  int tid;
+  char name[16];
+  lk_trace_ring *next;
+} lk_trace_ring;
+
+// Rings are never freed, threads that exited keep their last events
+static std::atomic<lk_trace_ring *> rings;
+static thread_local lk_trace_ring *thread_ring;
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static lk_trace_ring *lk_trace_thread_ring() {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  auto ring = (lk_trace_ring *)calloc(1, sizeof(lk_trace_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->tid = gettid();
+  pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+  auto next = rings.load(std::memory_order_relaxed);
+  do {
+    ring->next = next;
+  } while (!rings.compare_exchange_weak(next, ring, std::memory_order_release,
+                                        std::memory_order_relaxed));
+  thread_ring = ring;
+  return ring;
+}
+
+static void lk_trace_record(lk_trace_span span, char phase) {
+  auto ring = lk_trace_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  auto head = ring->head.load(std::memory_order_relaxed);
+  auto &event = ring->events[head % LK_TRACE_RING_EVENTS];
+  event.time_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+  event.span = span;
+  event.phase = phase;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void lk_trace_begin(lk_trace_span span) {
+  lk_trace_record(span, 'B');
+}
+
+void lk_trace_end(lk_trace_span span) {
+  lk_trace_record(span, 'E');
+}
+
+static void lk_trace_dump_ring(FILE *file, lk_trace_ring *ring, bool *first) {
+  static lk_trace_event events[LK_TRACE_RING_EVENTS];
+
+  auto head = ring->head.load(std::memory_order_acquire);
+  auto start = head > LK_TRACE_RING_EVENTS ? head - LK_TRACE_RING_EVENTS : 0;
+  for (auto i = start; i < head; i++) {
+    events[i - start] = ring->events[i % LK_TRACE_RING_EVENTS];
+  }
+
+  // Whatever the thread recorded while copying may have replaced the oldest
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto after = ring->head.load(std::memory_order_relaxed);
+  auto skip = after - start > LK_TRACE_RING_EVENTS
+                  ? after - start - LK_TRACE_RING_EVENTS
+                  : 0;
+
+  fprintf(file,
+          "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}",
+          *first ? "" : ",", getpid(), ring->tid, ring->name);
+  *first = false;
+
+  // Spans that began before the oldest event left would end unmatched
+  int depth = 0;
+  for (auto i = skip; i < head - start; i++) {
+    auto &event = events[i];
+    if (event.phase == 'E' && depth == 0) {
+      continue;
+    }
+    depth += event.phase == 'B' ? 1 : -1;
+
+    fprintf(file,
+            ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%lld.%03d}",
+            event.phase, span_names[event.span], getpid(), ring->tid,
+            (long long)(event.time_ns / 1000), (int)(event.time_ns % 1000));
+  }
+}
+
+void lk_trace_dump(void) {
+  const char *path = getenv("LK_TRACE_FILE");
+  if (path == NULL) {
+    path = LK_TRACE_DEFAULT_FILE;
+  }
+
+  pthread_mutex_lock(&dump_mutex);
+  auto file = fopen(path, "w");
+  if (file == NULL) {
+    pthread_mutex_unlock(&dump_mutex);
+    ESP_LOGE(LOG_TAG, "Failed to open %s", path);
+    return;
+  }
+
+  fputs("{\"traceEvents\":[", file);
+  bool first = true;
+  for (auto ring = rings.load(std::memory_order_acquire); ring != NULL;
+       ring = ring->next) {
+    lk_trace_dump_ring(file, ring, &first);
+  }
+  fputs("\n]}\n", file);
+
+  if (fclose(file) != 0) {
+    ESP_LOGE(LOG_TAG, "Failed to write %s", path);
+  }
+  pthread_mutex_unlock(&dump_mutex);
+}
+
+#endif
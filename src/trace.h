@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+// Named spans around the stages of the media and signaling pipeline, to see
+// where each 20ms frame goes. Build with LK_TRACE defined to record them,
+// otherwise every macro compiles to nothing.
+//
+// On target spans are SystemView user events (CONFIG_APPTRACE_SV_ENABLE), the
+// span id is the lk_trace_span value. On linux each thread records into a
+// ring of its own, and the last LK_TRACE_RING_EVENTS events of every thread
+// are written as Chrome trace_event JSON to LK_TRACE_FILE (trace.json) with
+// every metrics report. Open it in chrome://tracing or Perfetto.
+
+typedef enum {
+  LK_TRACE_SEND_AUDIO = 0,
+  LK_TRACE_AUDIO_ENCODE,
+  LK_TRACE_AUDIO_DECODE,
+  LK_TRACE_PUBLISHER_LOOP,   // one peer_connection_loop
+  LK_TRACE_SUBSCRIBER_LOOP,  // one peer_connection_loop
+  LK_TRACE_SIGNALING_VALUES,
+  LK_TRACE_SIGNAL_REQUEST,
+  LK_TRACE_SPAN_COUNT,
+} lk_trace_span;
+
+#ifdef LK_TRACE
+#ifdef LINUX_BUILD
+void lk_trace_begin(lk_trace_span span);
+void lk_trace_end(lk_trace_span span);
+
+// Writes every thread's ring to LK_TRACE_FILE. Safe while spans are recorded
+void lk_trace_dump(void);
+#else
+#include <sdkconfig.h>
+#if CONFIG_APPTRACE_SV_ENABLE
+#include <SEGGER_SYSVIEW.h>
+
+static inline void lk_trace_begin(lk_trace_span span) {
+  SEGGER_SYSVIEW_OnUserStart(span);
+}
+
+static inline void lk_trace_end(lk_trace_span span) {
+  SEGGER_SYSVIEW_OnUserStop(span);
+}
+#else
+static inline void lk_trace_begin(lk_trace_span span) {}
+static inline void lk_trace_end(lk_trace_span span) {}
+#endif
+#endif
+
+// Ends the span when the enclosing scope is left
+struct lk_trace_scope {
+  lk_trace_span span;
+  explicit lk_trace_scope(lk_trace_span span) : span(span) {
+    lk_trace_begin(span);
+  }
+  ~lk_trace_scope() {
+    lk_trace_end(span);
+  }
+};
+
+#define LK_TRACE_BEGIN(span) lk_trace_begin(span)
+#define LK_TRACE_END(span) lk_trace_end(span)
+#define LK_TRACE_CONCAT_(a, b) a##b
+#define LK_TRACE_CONCAT(a, b) LK_TRACE_CONCAT_(a, b)
+#define LK_TRACE_SCOPE(span) \
+  lk_trace_scope LK_TRACE_CONCAT(lk_trace_scope_, __LINE__)(span)
+#else
+#define LK_TRACE_BEGIN(span) \
+  do {                       \
+  } while (0)
+#define LK_TRACE_END(span) \
+  do {                     \
+  } while (0)
+#define LK_TRACE_SCOPE(span) \
+  do {                       \
+  } while (0)
+#endif
@@ -0,0 +1,66 @@
+#include "vad.h"
+
+// Voiced frames are this much louder than the noise floor, ~9 dB
+#define VAD_SPEECH_RATIO 8
+
+// Unvoiced consonants (s, f, sh) are quiet but cross zero far more often than
+// background noise with the same energy. Crossings per sample, as a shift
+#define VAD_FRICATIVE_RATIO 2
+#define VAD_FRICATIVE_ZCR_SHIFT 2
+
+// Below this mean square energy (~-54 dBFS) a frame is never voiced, an idle
+// microphone is not speech however quiet the room is
+#define VAD_MIN_ENERGY 4096
+
+// The floor drops to quieter frames quickly and creeps up by 1/128 (~0.03
+// dB) per frame, ~6 seconds to follow a 10 dB louder background
+#define VAD_FLOOR_DECAY_SHIFT 2
+#define VAD_FLOOR_RISE_SHIFT 7
+
+void lk_vad_init(lk_vad *vad, uint32_t frame_duration_ms) {
+  vad->noise_floor = VAD_MIN_ENERGY;
+  vad->hangover_frames = LK_VAD_HANGOVER_MS / frame_duration_ms;
+  vad->silent_frames = vad->hangover_frames;
+  vad->active = false;
+}
+
+bool lk_vad_process(lk_vad *vad, const int16_t *samples, size_t count) {
+  if (count == 0) {
+    return vad->active;
+  }
+
+  uint64_t sum = 0;
+  size_t crossings = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += (int32_t)samples[i] * samples[i];
+    if (i > 0 && (samples[i] ^ samples[i - 1]) < 0) {
+      crossings++;
+    }
+  }
+  auto energy = (uint32_t)(sum / count);
+  uint64_t floor = vad->noise_floor;
+
+  auto voiced =
+      energy > VAD_MIN_ENERGY &&
+      ((uint64_t)energy > floor * VAD_SPEECH_RATIO ||
+       ((uint64_t)energy > floor * VAD_FRICATIVE_RATIO &&
+        crossings > count >> VAD_FRICATIVE_ZCR_SHIFT));
+
+  if (energy < vad->noise_floor) {
+    vad->noise_floor -= (vad->noise_floor - energy) >> VAD_FLOOR_DECAY_SHIFT;
+  } else {
+    vad->noise_floor += (vad->noise_floor >> VAD_FLOOR_RISE_SHIFT) + 1;
+  }
+  if (vad->noise_floor < VAD_MIN_ENERGY) {
+    vad->noise_floor = VAD_MIN_ENERGY;
+  }
+
+  if (voiced) {
+    vad->silent_frames = 0;
+  } else if (vad->silent_frames <= vad->hangover_frames) {
+    vad->silent_frames++;
+  }
+
+  vad->active = vad->silent_frames <= vad->hangover_frames;
+  return vad->active;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Energy and zero crossing voice activity detector for the capture path.
+// Costs one pass over the frame, integer only. The noise floor follows the
+// quietest frames, so a constant background (fan, hiss) reads as silence.
+
+// Silence after the last voiced frame that still counts as activity, covers
+// word gaps and trailing consonants
+#ifndef LK_VAD_HANGOVER_MS
+#define LK_VAD_HANGOVER_MS 400
+#endif
+
+typedef struct {
+  uint32_t noise_floor;  // mean square energy of background noise
+  uint32_t hangover_frames;
+  uint32_t silent_frames;  // since the last voiced frame
+  bool active;
+} lk_vad;
+
+void lk_vad_init(lk_vad *vad, uint32_t frame_duration_ms);
+
+// Classifies one frame and updates the noise floor. Returns whether the
+// stream is active: voiced now or within the hangover.
+bool lk_vad_process(lk_vad *vad, const int16_t *samples, size_t count);
@@ -3,72 +3,87 @@
 
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <string.h>
 
+#include "dtls_identity.h"
 #include "main.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "power.h"
+#include "sdp.h"
+#include "session.h"
+#include "trace.h"
 
 #define LOG_TAG "webrtc"
 
 #define SUBSCRIBER_TICK_INTERVAL 15
 #define PUBLISHER_TICK_INTERVAL 15
 
+// Once connected the subscriber sleeps in select on its sockets, a packet
+// wakes it immediately. The timeout only drives keepalives and DTLS timers.
+// During ICE checks and the DTLS handshake libpeer receives several times per
+// loop, there it stays at the default so connecting isn't slowed down
+#define SUBSCRIBER_POLL_TIMEOUT 50
+
+// The publisher wakes for every encoded frame, this only bounds how long
+// ICE/DTLS go unattended while nothing is sent
+#define PUBLISHER_IDLE_INTERVAL 50
+
+// libpeer's AGENT_POLL_TIMEOUT, how long peer_connection_loop waits for a
+// packet. Thread local so every PeerConnection task has its own, by default it
+// only peeks at the sockets like stock libpeer
+#define PEER_POLL_TIMEOUT_DEFAULT 1
+static thread_local int peer_poll_timeout_ms = PEER_POLL_TIMEOUT_DEFAULT;
+
+extern "C" int lk_peer_poll_timeout_ms(void) {
+  return peer_poll_timeout_ms;
+}
+
 // 20ms samples
 #define OPUS_OUT_BUFFER_SIZE 3840  // 1276 bytes is recommended by opus_encode
-extern SemaphoreHandle_t g_mutex;
-
-char *subscriber_offer_buffer = NULL;
-char *ice_candidate_buffer = NULL;
-
-// Subscriber answer is generated manually. These are the extracted values
-// used to generate the synthetic answer
-char *subscriber_answer_ice_ufrag = NULL;
-char *subscriber_answer_ice_pwd = NULL;
-char *subscriber_answer_fingerprint = NULL;
-
-// publisher_status is a FSM of the following states
-// * 0 - NoOp
-// * 1 - Send AddTrackRequest
-// * 2 - Create Local Offer
-// * 3 - Send Local Offer
-// * 4 - Handle remote Answer
-int publisher_status = 0;
-char *publisher_signaling_buffer = NULL;
-
-PeerConnection *subscriber_peer_connection = NULL;
-PeerConnection *publisher_peer_connection = NULL;
-
-int get_publisher_status() {
-  return publisher_status;
+
+int get_publisher_status(lk_session *session) {
+  return session->publisher_status;
 }
 
-void set_publisher_status(int status) {
+void set_publisher_status(lk_session *session, int status) {
   ESP_LOGI(LOG_TAG, "Setting publisher status to %d", status);
-  publisher_status = status;
+  session->publisher_status = status;
+  lk_signaling_notify(session);
 }
 
+// PeerConnection callbacks get the session they were created for as
+// user_data
 static void lk_publisher_onconnectionstatechange_task(PeerConnectionState state,
                                                       void *user_data) {
+  auto session = (lk_session *)user_data;
   ESP_LOGI(LOG_TAG, "Publisher PeerConnectionState: %s",
            peer_connection_state_to_string(state));
-  if (state == PEER_CONNECTION_DISCONNECTED ||
-      state == PEER_CONNECTION_CLOSED) {
-    ESP_LOGI(LOG_TAG, "Restarting");
-    esp_restart();
+  session->publisher_connected = state == PEER_CONNECTION_COMPLETED;
+  if (state == PEER_CONNECTION_COMPLETED) {
+    lk_join_milestone(session, "publisher connected");
+    lk_signaling_notify(session);
+  } else if (state == PEER_CONNECTION_DISCONNECTED ||
+             state == PEER_CONNECTION_CLOSED) {
+    lk_request_reconnect(session, "publisher disconnected", /* rejoin */ 0);
   }
 }
 
 static void lk_subscriber_onconnectionstatechange_task(
     PeerConnectionState state, void *user_data) {
+  auto session = (lk_session *)user_data;
   ESP_LOGI(LOG_TAG, "Subscriber PeerConnectionState: %s",
            peer_connection_state_to_string(state));
+  session->subscriber_connected = state == PEER_CONNECTION_COMPLETED;
 
   // Subscriber has connected, start connecting publisher
   if (state == PEER_CONNECTION_COMPLETED) {
-    set_publisher_status(1);
+    lk_join_milestone(session, "subscriber connected");
+    set_publisher_status(session, 1);
   } else if (state == PEER_CONNECTION_DISCONNECTED ||
              state == PEER_CONNECTION_CLOSED) {
-    ESP_LOGI(LOG_TAG, "Restarting");
-    esp_restart();
+    lk_request_reconnect(session, "subscriber disconnected", /* rejoin */ 0);
   }
 }
 
@@ -76,52 +91,114 @@ static void lk_subscriber_onconnectionstatechange_task(
 // what causes it to be fired
 static void lk_subscriber_on_icecandidate_task(char *description,
                                                void *user_data) {
-  auto fingerprint = strstr(description, "a=fingerprint");
-  subscriber_answer_fingerprint =
-      strndup(fingerprint, (int)(strchr(fingerprint, '\r') - fingerprint));
-
-  auto iceUfrag = strstr(description, "a=ice-ufrag");
-  subscriber_answer_ice_ufrag =
-      strndup(iceUfrag, (int)(strchr(iceUfrag, '\r') - iceUfrag));
-
-  auto icePwd = strstr(description, "a=ice-pwd");
-  subscriber_answer_ice_pwd =
-      strndup(icePwd, (int)(strchr(icePwd, '\r') - icePwd));
+  auto session = (lk_session *)user_data;
+  lk_reset_subscriber_answer(session);
+  session->subscriber_local_description =
+      lk_mem_strdup(LK_MEM_SIGNALING, description);
+  lk_signaling_notify(session);
 }
 
 static void lk_publisher_on_icecandidate_task(char *description,
                                               void *user_data) {
-  publisher_signaling_buffer = strdup(description);
-  set_publisher_status(3);
+  auto session = (lk_session *)user_data;
+  lk_mem_free(LK_MEM_SIGNALING, session->publisher_signaling_buffer);
+  session->publisher_signaling_buffer =
+      lk_mem_strdup(LK_MEM_SIGNALING, description);
+  set_publisher_status(session, 3);
 }
 
-// Given a Remote Description + ICE Candidate do a Set+Free on a PeerConnection
-int lk_process_signaling_values(PeerConnection *peer_connection,
-                                char **ice_candidate,
-                                char **remote_description) {
-  int amount_set = 0;
+// Values are regenerated for every subscriber offer. Called with the session
+// mutex held
+void lk_reset_subscriber_answer(lk_session *session) {
+  lk_mem_free(LK_MEM_SIGNALING, session->subscriber_local_description);
+  session->subscriber_local_description = NULL;
+}
 
-  // If PeerConnection hasn't gone to completed we need a ICECandidate and
-  // RemoteDescription libpeer doesn't support Trickle ICE
-  auto state = peer_connection_get_state(peer_connection);
-  if (state != PEER_CONNECTION_COMPLETED && *ice_candidate == NULL) {
-    return amount_set;
+static void lk_clear_ice_candidates(lk_ice_candidate_queue *queue) {
+  while (queue->count > 0) {
+    lk_mem_free(LK_MEM_SIGNALING, queue->candidates[queue->head]);
+    queue->head = (queue->head + 1) % ICE_CANDIDATE_QUEUE_SIZE;
+    queue->count--;
   }
+  queue->remote_description_set = false;
+}
 
-  // Only call add_ice_candidate when not completed. Calling it on a connected
-  // PeerConnection will break it
-  if (state != PEER_CONNECTION_COMPLETED && *ice_candidate != NULL) {
-    peer_connection_add_ice_candidate(peer_connection, *ice_candidate);
-    free(*ice_candidate);
-    *ice_candidate = NULL;
-    amount_set++;
+// Drops everything buffered for a signaling session that went away. Called
+// with the session mutex held
+void lk_reset_signaling_state(lk_session *session) {
+  lk_mem_free(LK_MEM_SIGNALING, session->subscriber_offer_buffer);
+  session->subscriber_offer_buffer = NULL;
+  lk_mem_free(LK_MEM_SIGNALING, session->subscriber_remote_offer);
+  session->subscriber_remote_offer = NULL;
+  lk_mem_free(LK_MEM_SIGNALING, session->publisher_signaling_buffer);
+  session->publisher_signaling_buffer = NULL;
+  lk_reset_subscriber_answer(session);
+
+  lk_clear_ice_candidates(&session->subscriber_ice_candidates);
+  lk_clear_ice_candidates(&session->publisher_ice_candidates);
+  session->publisher_status = 0;
+}
+
+void lk_queue_ice_candidate(lk_session *session, int is_publisher,
+                            const char *candidate) {
+  auto queue = is_publisher ? &session->publisher_ice_candidates
+                            : &session->subscriber_ice_candidates;
+  if (queue->count == ICE_CANDIDATE_QUEUE_SIZE) {
+    ESP_LOGI(LOG_TAG, "ICE candidate queue full, dropping %s", candidate);
+    return;
+  }
+
+  auto tail = (queue->head + queue->count) % ICE_CANDIDATE_QUEUE_SIZE;
+  queue->candidates[tail] = lk_mem_strdup(LK_MEM_SIGNALING, candidate);
+  queue->count++;
+}
+
+// Adds every queued candidate to the PeerConnection and returns how many were
+// added. Candidates that arrive after the PeerConnection has completed are
+// discarded, calling add_ice_candidate on a connected PeerConnection will break
+// it
+static int lk_drain_ice_candidates(PeerConnection *peer_connection,
+                                   lk_ice_candidate_queue *queue) {
+  int added = 0;
+  auto completed =
+      peer_connection_get_state(peer_connection) == PEER_CONNECTION_COMPLETED;
+
+  while (queue->count > 0) {
+    auto candidate = queue->candidates[queue->head];
+    if (!completed) {
+      peer_connection_add_ice_candidate(peer_connection, candidate);
+      added++;
+    }
+
+    lk_mem_free(LK_MEM_SIGNALING, candidate);
+    queue->head = (queue->head + 1) % ICE_CANDIDATE_QUEUE_SIZE;
+    queue->count--;
   }
 
+  return added;
+}
+
+// Given a Remote Description + ICE Candidates do a Set+Free on a
+// PeerConnection. The remote description goes first, libpeer adds candidates
+// to the remote description that is set. Candidates that arrive before it stay
+// queued
+int lk_process_signaling_values(PeerConnection *peer_connection,
+                                lk_ice_candidate_queue *ice_candidates,
+                                char **remote_description) {
+  LK_TRACE_SCOPE(LK_TRACE_SIGNALING_VALUES);
+  int amount_set = 0;
+
   if (*remote_description != NULL) {
     peer_connection_set_remote_description(peer_connection,
                                            *remote_description);
-    free(*remote_description);
+    lk_mem_free(LK_MEM_SIGNALING, *remote_description);
     *remote_description = NULL;
+    ice_candidates->remote_description_set = true;
+    amount_set++;
+  }
+
+  if (ice_candidates->remote_description_set &&
+      lk_drain_ice_candidates(peer_connection, ice_candidates) > 0) {
     amount_set++;
   }
 
@@ -129,63 +206,126 @@ int lk_process_signaling_values(PeerConnection *peer_connection,
 }
 
 void lk_subscriber_peer_connection_task(void *user_data) {
+  auto session = (lk_session *)user_data;
+
   while (1) {
-    if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-      lk_process_signaling_values(subscriber_peer_connection,
-                                  &ice_candidate_buffer,
-                                  &subscriber_offer_buffer);
-      xSemaphoreGive(g_mutex);
+    if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+      lk_process_signaling_values(session->subscriber_peer_connection,
+                                  &session->subscriber_ice_candidates,
+                                  &session->subscriber_offer_buffer);
+      xSemaphoreGive(session->mutex);
     }
 
-    peer_connection_loop(subscriber_peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(SUBSCRIBER_TICK_INTERVAL));
+    // Only a connected PeerConnection reads its sockets in the loop, until
+    // then it returns immediately and the task has to pace itself
+    auto connected =
+        peer_connection_get_state(session->subscriber_peer_connection) ==
+        PEER_CONNECTION_COMPLETED;
+    peer_poll_timeout_ms =
+        connected ? SUBSCRIBER_POLL_TIMEOUT : PEER_POLL_TIMEOUT_DEFAULT;
+
+    // Connected, the loop mostly waits in select. Only the ICE and DTLS
+    // handshake runs at full speed
+    if (!connected) {
+      lk_power_acquire(LK_POWER_LOCK_PEER_CONNECTION);
+    }
+    LK_TRACE_BEGIN(LK_TRACE_SUBSCRIBER_LOOP);
+    auto start_us = esp_timer_get_time();
+    peer_connection_loop(session->subscriber_peer_connection);
+    lk_metrics_record(LK_HISTOGRAM_SUBSCRIBER_LOOP_US, start_us);
+    LK_TRACE_END(LK_TRACE_SUBSCRIBER_LOOP);
+    if (!connected) {
+      lk_power_release(LK_POWER_LOCK_PEER_CONNECTION);
+    }
+
+    if (!connected) {
+      vTaskDelay(pdMS_TO_TICKS(SUBSCRIBER_TICK_INTERVAL));
+    }
   }
 }
 
 void lk_publisher_peer_connection_task(void *user_data) {
-  lk_init_audio_encoder();
+  auto session = (lk_session *)user_data;
+#if SEND_AUDIO
+  if (session->media) {
+    lk_start_audio_pipeline(session);
+  }
+#endif
 
   while (1) {
-    auto state = peer_connection_get_state(publisher_peer_connection);
-    if (state != PEER_CONNECTION_COMPLETED &&
-        xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-      if (get_publisher_status() == 2) {
-        peer_connection_create_offer(publisher_peer_connection);
-        set_publisher_status(0);
-      } else if (get_publisher_status() == 4 &&
-                 lk_process_signaling_values(
-                     publisher_peer_connection, &ice_candidate_buffer,
-                     &publisher_signaling_buffer) == 2) {
-        set_publisher_status(0);
+    // A new offer is also how a connected publisher is ICE restarted
+    auto state = peer_connection_get_state(session->publisher_peer_connection);
+    if ((state != PEER_CONNECTION_COMPLETED ||
+         get_publisher_status(session) == 2) &&
+        xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+      auto status = get_publisher_status(session);
+      if (status == 2) {
+        // Candidates of the previous answer don't apply to the next one
+        lk_clear_ice_candidates(&session->publisher_ice_candidates);
+        peer_connection_create_offer(session->publisher_peer_connection);
+        set_publisher_status(session, 0);
+      } else if (status == 4 || status == 0) {
+        // The answer, then the candidates trickled for it. Candidates that
+        // come before the answer wait in the queue
+        lk_process_signaling_values(session->publisher_peer_connection,
+                                    &session->publisher_ice_candidates,
+                                    &session->publisher_signaling_buffer);
+        if (status == 4) {
+          set_publisher_status(session, 0);
+        }
       }
-      xSemaphoreGive(g_mutex);
+      xSemaphoreGive(session->mutex);
     }
 
-    lk_send_audio(publisher_peer_connection);
-
-    peer_connection_loop(publisher_peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(PUBLISHER_TICK_INTERVAL));
+    // The publisher only peeks at its sockets, DTLS and SRTP are all it does
+    lk_power_acquire(LK_POWER_LOCK_PEER_CONNECTION);
+    LK_TRACE_BEGIN(LK_TRACE_PUBLISHER_LOOP);
+    auto start_us = esp_timer_get_time();
+    peer_connection_loop(session->publisher_peer_connection);
+    lk_metrics_record(LK_HISTOGRAM_PUBLISHER_LOOP_US, start_us);
+    LK_TRACE_END(LK_TRACE_PUBLISHER_LOOP);
+
+    auto interval = state == PEER_CONNECTION_COMPLETED
+                        ? PUBLISHER_IDLE_INTERVAL
+                        : PUBLISHER_TICK_INTERVAL;
+#if SEND_AUDIO
+    if (session->media) {
+      lk_send_audio(session->publisher_peer_connection);
+      lk_power_release(LK_POWER_LOCK_PEER_CONNECTION);
+
+      // Wake up as soon as the encoder has a frame
+      lk_wait_for_audio_frame(interval);
+      continue;
+    }
+#endif
+    lk_power_release(LK_POWER_LOCK_PEER_CONNECTION);
+    vTaskDelay(pdMS_TO_TICKS(interval));
   }
 }
 
-PeerConnection *lk_create_peer_connection(int isPublisher) {
+PeerConnection *lk_create_peer_connection(lk_session *session,
+                                          int isPublisher) {
   PeerConfiguration peer_connection_config = {
       .ice_servers = {},
       .audio_codec = CODEC_OPUS,
       .video_codec = CODEC_NONE,
       .datachannel = isPublisher ? DATA_CHANNEL_NONE : DATA_CHANNEL_STRING,
       .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) -> void {
-#ifndef LINUX_BUILD
-        lk_audio_decode(data, size);
-#endif
+        auto session = (lk_session *)userdata;
+        if (session->media) {
+          lk_audio_receive(session, data, size);
+        }
       },
       .onvideotrack = NULL,
       .on_request_keyframe = NULL,
-      .user_data = NULL,
+      .user_data = session,
   };
 
+  // libpeer generates the DTLS key and certificate while creating it
+  lk_dtls_identity_begin();
   PeerConnection *peer_connection =
       peer_connection_create(&peer_connection_config);
+  lk_dtls_identity_end();
   if (peer_connection == NULL) {
     ESP_LOGE(LOG_TAG, "Failed to create peer connection");
     return NULL;
@@ -206,60 +346,20 @@ PeerConnection *lk_create_peer_connection(int isPublisher) {
   return peer_connection;
 }
 
-static const char sdp_no_audio[] =
-    "v=0\r\n"
-    "o=- 8611954123959290783 2 IN IP4 127.0.0.1\r\n"
-    "s=-\r\n"
-    "t=0 0\r\n"
-    "a=msid-semantic:  iot\r\n"
-    "a=group:BUNDLE datachannel\r\n"
-    "m=application 9 UDP/DTLS/SCTP webrtc-datachannel\r\n"
-    "c=IN IP4 0.0.0.0\r\n"
-    "a=setup:passive\r\n"
-    "a=mid:datachannel\r\n"
-    "%s\r\n"  // a=ice-ufrag
-    "%s\r\n"  // a=ice-pwd
-    "%s\r\n"  // a=fingeprint
-    "a=sctp-port:5000\r\n";
-
-static const char sdp_audio[] =
-    "v=0\r\n"
-    "o=- 8611954123959290783 2 IN IP4 127.0.0.1\r\n"
-    "s=-\r\n"
-    "t=0 0\r\n"
-    "a=msid-semantic:  iot\r\n"
-    "a=group:BUNDLE datachannel audio\r\n"
-    "m=application 9 UDP/DTLS/SCTP webrtc-datachannel\r\n"
-    "c=IN IP4 0.0.0.0\r\n"
-    "a=setup:passive\r\n"
-    "a=mid:datachannel\r\n"
-    "%s\r\n"  // a=ice-ufrag
-    "%s\r\n"  // a=ice-pwd
-    "%s\r\n"  // a=fingeprint
-    "a=sctp-port:5000\r\n"
-    "m=audio 9 UDP/TLS/RTP/SAVP 111\r\n"
-    "c=IN IP4 0.0.0.0\r\n"
-    "a=rtpmap:111 opus/48000/2\r\n"
-    "a=rtcp:9 IN IP4 0.0.0.0\r\n"
-    "a=setup:passive\r\n"
-    "a=mid:audio\r\n"
-    "%s\r\n"  // a=ice-ufrag
-    "%s\r\n"  // a=ice-pwd
-    "%s\r\n"  // a=fingeprint
-    "a=recvonly\r\n";
-
-void lk_populate_answer(char *answer, size_t answer_size, int include_audio) {
-  size_t ret = 0;
-  if (include_audio) {
-    ret = snprintf(answer, answer_size, sdp_audio, subscriber_answer_ice_ufrag,
-                   subscriber_answer_ice_pwd, subscriber_answer_fingerprint,
-                   subscriber_answer_ice_ufrag, subscriber_answer_ice_pwd,
-                   subscriber_answer_fingerprint);
-  } else {
-    ret =
-        snprintf(answer, answer_size, sdp_no_audio, subscriber_answer_ice_ufrag,
-                 subscriber_answer_ice_pwd, subscriber_answer_fingerprint);
+// Builds the answer into session->answer_buffer. Returns its length, or -1 if
+// it could not be built. Called with the session mutex held
+int lk_populate_answer(lk_session *session) {
+  // The parsed SDPs are kept in the session, off the signaling loop's stack
+  auto offer = &session->answer_offer;
+  auto local = &session->answer_local;
+
+  if (session->subscriber_remote_offer == NULL ||
+      session->subscriber_local_description == NULL ||
+      lk_sdp_parse(session->subscriber_remote_offer, offer) != 0 ||
+      lk_sdp_parse(session->subscriber_local_description, local) != 0) {
+    return -1;
   }
 
-  assert(ret < answer_size);
+  return lk_sdp_build_answer(offer, local, session->answer_buffer,
+                             ANSWER_BUFFER_SIZE);
 }
@@ -1,10 +1,11 @@
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_websocket_client.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include <freertos/semphr.h>
 #include <livekit_rtc.pb-c.h>
-#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,39 +15,45 @@
 
 #include <vector>
 
+#include "arena.h"
 #include "main.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "opus_profile.h"
+#include "session.h"
+#include "signal_record.h"
+#include "subscriptions.h"
+#include "trace.h"
 #define LOG_TAG "websocket"
 
 #define WEBSOCKET_URI_SIZE 1024
-#define ANSWER_BUFFER_SIZE 1024
 #define WEBSOCKET_BUFFER_SIZE 2048
 #define LIVEKIT_PROTOCOL_VERSION 3
 
+#define SUBSCRIBER_STACK_SIZE 16384
+#define PUBLISHER_STACK_SIZE 20000
+
 static const char *SDP_TYPE_ANSWER = "answer";
 static const char *SDP_TYPE_OFFER = "offer";
 
-// Mutex used for all global state
-SemaphoreHandle_t g_mutex;
-
-// subscriber_status is a FSM of the following states
-// * 0 - NoOp, don't send an answer
-// * 1 - Send an answer with audio removed
-// * 2 - Send an answer with audio enabled
-int subscriber_status = 0;
-
-extern int get_publisher_status();
-extern void set_publisher_status(int status);
-extern char *publisher_signaling_buffer;
-
-// Offer + ICE Candidates. Captured in signaling thread
-// and set PeerConnection thread
-extern char *subscriber_offer_buffer;
-extern char *ice_candidate_buffer;
-
-extern char *subscriber_answer_ice_ufrag;
-
-extern PeerConnection *subscriber_peer_connection;
-extern PeerConnection *publisher_peer_connection;
+// Bits of lk_session.signaling_events
+#define SIGNALING_EVENT_PENDING BIT0
+#define SIGNALING_EVENT_RESUME BIT1
+#define SIGNALING_EVENT_REJOIN BIT2
+#define SIGNALING_EVENT_ALL \
+  (SIGNALING_EVENT_PENDING | SIGNALING_EVENT_RESUME | SIGNALING_EVENT_REJOIN)
+
+#define RECONNECT_POLL_INTERVAL_MS 100
+#define RECONNECT_RESUME_TIMEOUT_MS 5000
+#define RECONNECT_BACKOFF_INITIAL_MS 500
+#define RECONNECT_BACKOFF_MAX_MS 30000
+
+// Without LK_AUTO_SUBSCRIBE only the active speakers are subscribed
+#ifdef LK_AUTO_SUBSCRIBE
+#define AUTO_SUBSCRIBE "true"
+#else
+#define AUTO_SUBSCRIBE "false"
+#endif
 
 static const char *request_message_to_string(
     Livekit__SignalRequest__MessageCase message_case) {
@@ -98,13 +105,81 @@ static const char *response_message_to_string(
       return "SPEAKERS_CHANGED";
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ROOM_UPDATE:
       return "ROOM_UPDATE";
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_CONNECTION_QUALITY:
+      return "CONNECTION_QUALITY";
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_RECONNECT:
+      return "RECONNECT";
     default:
       ESP_LOGI(LOG_TAG, "Unknown response message type %d", message_case);
       return "UNKNOWN";
   }
 }
 
-void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
+void lk_signaling_notify(lk_session *session) {
+  xEventGroupSetBits(session->signaling_events, SIGNALING_EVENT_PENDING);
+}
+
+// Safe to call from any task, including PeerConnection callbacks that run
+// with the session mutex held
+void lk_request_reconnect(lk_session *session, const char *reason,
+                          int rejoin) {
+  ESP_LOGI(LOG_TAG, "Reconnect requested: %s", reason);
+  xEventGroupSetBits(session->signaling_events,
+                     rejoin ? SIGNALING_EVENT_REJOIN : SIGNALING_EVENT_RESUME);
+}
+
+// Called from the encoder task, the request is sent by the signaling loop
+void lk_set_microphone_muted(lk_session *session, bool muted) {
+  if (session->microphone_muted != muted) {
+    session->microphone_muted = muted;
+    lk_signaling_notify(session);
+  }
+}
+
+void lk_join_milestone(lk_session *session, const char *milestone) {
+  auto elapsed_us = esp_timer_get_time() - session->join_start_time;
+  ESP_LOGI(LOG_TAG, "Join milestone: %s after %lld ms", milestone,
+           (long long)elapsed_us / 1000);
+  if (session->join_milestone_observer != NULL) {
+    session->join_milestone_observer(session, milestone, elapsed_us);
+  }
+}
+
+// libpeer doesn't expose RTCP receiver reports. The SFU's quality score for
+// the local participant is computed from them and drives encoder adaptation
+static void lk_websocket_handle_connection_quality(
+    lk_session *session, Livekit__ConnectionQualityUpdate *update) {
+  // The encoder belongs to the session that publishes the microphone
+  if (!session->media ||
+      xSemaphoreTake(session->mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  for (size_t i = 0; i < update->n_updates; i++) {
+    auto info = update->updates[i];
+    if (session->participant_sid == NULL ||
+        strcmp(info->participant_sid, session->participant_sid) != 0) {
+      continue;
+    }
+
+    switch (info->quality) {
+      case LIVEKIT__CONNECTION_QUALITY__LOST:
+        lk_opus_profile_on_link_quality(LK_LINK_QUALITY_LOST);
+        break;
+      case LIVEKIT__CONNECTION_QUALITY__POOR:
+        lk_opus_profile_on_link_quality(LK_LINK_QUALITY_POOR);
+        break;
+      default:
+        lk_opus_profile_on_link_quality(LK_LINK_QUALITY_GOOD);
+        break;
+    }
+  }
+
+  xSemaphoreGive(session->mutex);
+}
+
+void lk_websocket_handle_livekit_response(lk_session *session,
+                                          Livekit__SignalResponse *packet) {
   ESP_LOGI(LOG_TAG, "Recv %s",
            response_message_to_string(packet->message_case));
   switch (packet->message_case) {
@@ -125,20 +200,18 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
       if (!candidate_obj || !cJSON_IsString(candidate_obj)) {
         ESP_LOGI(LOG_TAG,
                  "failed to parse ice_candidate_init has no candidate");
+        cJSON_Delete(parsed);
         return;
       }
 
       ESP_LOGI(LOG_TAG, "Candidate: %d / %s", packet->trickle->target,
                candidate_obj->valuestring);
-      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-        if (ice_candidate_buffer != NULL) {
-          ESP_LOGI(LOG_TAG, "ice_candidate_buffer is not NULL");
-        } else {
-          ESP_LOGI(LOG_TAG, "buffering ICE candidate");
-          ice_candidate_buffer = strdup(candidate_obj->valuestring);
-        }
-
-        xSemaphoreGive(g_mutex);
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        lk_queue_ice_candidate(
+            session,
+            packet->trickle->target == LIVEKIT__SIGNAL_TARGET__PUBLISHER,
+            candidate_obj->valuestring);
+        xSemaphoreGive(session->mutex);
       }
 
       cJSON_Delete(parsed);
@@ -147,45 +220,115 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_OFFER:
       ESP_LOGI(LOG_TAG, "%s", packet->offer->sdp);
 
-      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-        if (strstr(packet->offer->sdp, "m=audio")) {
-          subscriber_status = 2;
-        } else {
-          subscriber_status = 1;
-        }
-
-        subscriber_offer_buffer = strdup(packet->offer->sdp);
-        xSemaphoreGive(g_mutex);
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        session->subscriber_status = 1;
+
+        // Answer values of a previous offer must not be sent for this one
+        lk_reset_subscriber_answer(session);
+        lk_mem_free(LK_MEM_SIGNALING, session->subscriber_offer_buffer);
+        lk_mem_free(LK_MEM_SIGNALING, session->subscriber_remote_offer);
+        session->subscriber_offer_buffer =
+            lk_mem_strdup(LK_MEM_SIGNALING, packet->offer->sdp);
+        session->subscriber_remote_offer =
+            lk_mem_strdup(LK_MEM_SIGNALING, packet->offer->sdp);
+        xSemaphoreGive(session->mutex);
       }
 
+      lk_join_milestone(session, "subscriber offer received");
+      session->subscriber_offer_received_time = esp_timer_get_time();
+      lk_signaling_notify(session);
+
       break;
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ANSWER:
-      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-        publisher_signaling_buffer = strdup(packet->answer->sdp);
-        set_publisher_status(4);
-        xSemaphoreGive(g_mutex);
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ANSWER: {
+      lk_join_milestone(session, "publisher answer received");
+      auto sent_time = session->publisher_offer_sent_time.exchange(0);
+      if (sent_time != 0) {
+        lk_metrics_record(LK_HISTOGRAM_OFFER_ANSWER_US, sent_time);
+      }
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        // An ICE restart can answer again before the last one was applied
+        lk_mem_free(LK_MEM_SIGNALING, session->publisher_signaling_buffer);
+        session->publisher_signaling_buffer =
+            lk_mem_strdup(LK_MEM_SIGNALING, packet->answer->sdp);
+        set_publisher_status(session, 4);
+        xSemaphoreGive(session->mutex);
       }
 
       break;
+    }
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRACK_PUBLISHED:
-      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-        set_publisher_status(2);
-        xSemaphoreGive(g_mutex);
+      if (packet->track_published == NULL ||
+          packet->track_published->track == NULL) {
+        ESP_LOGE(LOG_TAG, "TRACK_PUBLISHED without a track");
+        break;
+      }
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        session->track_published = true;
+        lk_mem_free(LK_MEM_SIGNALING, session->track_sid);
+        session->track_sid = lk_mem_strdup(
+            LK_MEM_SIGNALING, packet->track_published->track->sid);
+        session->microphone_muted_sent = false;
+        set_publisher_status(session, 2);
+        xSemaphoreGive(session->mutex);
       }
 
+      break;
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN:
+      if (packet->join->participant == NULL) {
+        ESP_LOGE(LOG_TAG, "JOIN without a participant");
+        break;
+      }
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        lk_mem_free(LK_MEM_SIGNALING, session->participant_sid);
+        session->participant_sid = lk_mem_strdup(
+            LK_MEM_SIGNALING, packet->join->participant->sid);
+
+        lk_subscriptions_reset(&session->subscriptions);
+        for (size_t i = 0; i < packet->join->n_other_participants; i++) {
+          lk_subscriptions_update_participant(
+              &session->subscriptions, packet->join->other_participants[i]);
+        }
+        xSemaphoreGive(session->mutex);
+      }
+
+      session->signaling_ready = true;
+      lk_signaling_notify(session);
       break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_LEAVE:
-#ifndef LINUX_BUILD
-      ESP_LOGI(LOG_TAG, "Restarting");
-      esp_restart();
-#endif
+      lk_request_reconnect(session, "server sent LEAVE", /* rejoin */ 1);
+      break;
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_CONNECTION_QUALITY:
+      lk_websocket_handle_connection_quality(session,
+                                             packet->connection_quality);
+      break;
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE:
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        for (size_t i = 0; i < packet->update->n_participants; i++) {
+          auto info = packet->update->participants[i];
+          // Our own track is in there too
+          if (session->participant_sid == NULL ||
+              strcmp(info->sid, session->participant_sid) != 0) {
+            lk_subscriptions_update_participant(&session->subscriptions,
+                                                info);
+          }
+        }
+        xSemaphoreGive(session->mutex);
+      }
+      lk_signaling_notify(session);
       break;
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_MUTE:
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_SPEAKERS_CHANGED:
+      if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+        lk_subscriptions_update_speakers(&session->subscriptions,
+                                         packet->speakers_changed,
+                                         esp_timer_get_time());
+        xSemaphoreGive(session->mutex);
+      }
+      lk_signaling_notify(session);
+      break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ROOM_UPDATE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_MUTE:
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE__NOT_SET:
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN:
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_RECONNECT:
       break;
     default:
       ESP_LOGI(LOG_TAG, "Unknown message type received.");
@@ -195,17 +338,24 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
 static void lk_websocket_event_handler(void *handler_args,
                                        esp_event_base_t base, int32_t event_id,
                                        void *event_data) {
+  auto session = (lk_session *)handler_args;
   esp_websocket_event_data_t *data = (esp_websocket_event_data_t *)event_data;
   switch (event_id) {
     case WEBSOCKET_EVENT_CONNECTED:
       ESP_LOGI(LOG_TAG, "WEBSOCKET_EVENT_CONNECTED");
+      lk_join_milestone(session, "websocket connected");
+
+      // A resumed session gets no JOIN, the server accepting the upgrade is
+      // the signal that it still exists
+      if (session->reconnect_status == 1) {
+        session->signaling_ready = true;
+        lk_signaling_notify(session);
+      }
       break;
     case WEBSOCKET_EVENT_DISCONNECTED:
       ESP_LOGI(LOG_TAG, "WEBSOCKET_EVENT_DISCONNECTED");
-#ifndef LINUX_BUILD
-      ESP_LOGI(LOG_TAG, "Restarting");
-      esp_restart();
-#endif
+      session->signaling_ready = false;
+      lk_request_reconnect(session, "websocket disconnected", /* rejoin */ 0);
       break;
     case WEBSOCKET_EVENT_DATA: {
       if (data->op_code != 0x2) {
@@ -214,59 +364,273 @@ static void lk_websocket_event_handler(void *handler_args,
         return;
       }
 
+      lk_signal_record(session, LK_SIGNAL_RECEIVED,
+                       (const uint8_t *)data->data_ptr, data->data_len);
       auto new_response = livekit__signal_response__unpack(
-          NULL, data->data_len, (uint8_t *)data->data_ptr);
+          &session->signal_response_allocator, data->data_len,
+          (uint8_t *)data->data_ptr);
 
       if (new_response == NULL) {
         ESP_LOGE(LOG_TAG, "Failed to decode SignalResponse message.");
-        ESP_LOGI(LOG_TAG, "Restarting");
-        esp_restart();
+        lk_request_reconnect(session, "undecodable SignalResponse",
+                             /* rejoin */ 1);
       } else {
-        lk_websocket_handle_livekit_response(new_response);
+        lk_metrics_count(LK_COUNTER_SIGNAL_RECEIVED);
+        lk_websocket_handle_livekit_response(session, new_response);
       }
 
-      livekit__signal_response__free_unpacked(new_response, NULL);
+      livekit__signal_response__free_unpacked(
+          new_response, &session->signal_response_allocator);
+      lk_arena_reset(&session->signal_response_arena);
 
       break;
     }
     case WEBSOCKET_EVENT_ERROR:
       ESP_LOGI(LOG_TAG, "WEBSOCKET_EVENT_ERROR");
-      ESP_LOGI(LOG_TAG, "Restarting");
-      esp_restart();
+      session->signaling_ready = false;
+      lk_request_reconnect(session, "websocket error", /* rejoin */ 0);
       break;
   }
 }
 
-void lk_pack_and_send_signal_request(const Livekit__SignalRequest *r,
-                                     esp_websocket_client *client) {
-  ESP_LOGI(LOG_TAG, "Send %s", request_message_to_string(r->message_case));
+size_t lk_pack_signal_request(lk_session *session,
+                              const Livekit__SignalRequest *r) {
   auto size = livekit__signal_request__get_packed_size(r);
-  auto *buffer = (uint8_t *)malloc(size);
-  livekit__signal_request__pack(r, buffer);
-  auto len = esp_websocket_client_send_bin(client, (char *)buffer, size,
-                                           portMAX_DELAY);
-  free(buffer);
+  if (size > session->signal_request_buffer_size) {
+    auto buffer = (uint8_t *)lk_mem_realloc(
+        LK_MEM_SIGNALING, session->signal_request_buffer, size);
+    if (buffer == NULL) {
+      ESP_LOGE(LOG_TAG, "Failed to grow request buffer to %d", (int)size);
+      return 0;
+    }
+    session->signal_request_buffer = buffer;
+    session->signal_request_buffer_size = size;
+  }
+
+  return livekit__signal_request__pack(r, session->signal_request_buffer);
+}
+
+void lk_pack_and_send_signal_request(lk_session *session,
+                                     const Livekit__SignalRequest *r) {
+  LK_TRACE_SCOPE(LK_TRACE_SIGNAL_REQUEST);
+  ESP_LOGI(LOG_TAG, "Send %s", request_message_to_string(r->message_case));
+  auto size = lk_pack_signal_request(session, r);
+  if (size == 0) {
+    return;
+  }
+  lk_signal_record(session, LK_SIGNAL_SENT, session->signal_request_buffer,
+                   size);
+
+  auto len = esp_websocket_client_send_bin(
+      session->client, (char *)session->signal_request_buffer, size,
+      portMAX_DELAY);
   if (len == -1) {
     ESP_LOGI(LOG_TAG, "Failed to send message.");
+  } else {
+    lk_metrics_count(LK_COUNTER_SIGNAL_SENT);
+  }
+}
+
+// Caller frees. Resuming appends the reconnect parameters of the current
+// session
+static char *lk_websocket_uri(lk_session *session, int resume) {
+  char *ws_uri = (char *)lk_mem_alloc(LK_MEM_SIGNALING, WEBSOCKET_URI_SIZE);
+  auto len = snprintf(ws_uri, WEBSOCKET_URI_SIZE,
+                      "%s/rtc?protocol=%d&access_token=%s&auto_subscribe=%s",
+                      session->url, LIVEKIT_PROTOCOL_VERSION, session->token,
+                      AUTO_SUBSCRIBE);
+  if (resume && session->participant_sid != NULL) {
+    snprintf(ws_uri + len, WEBSOCKET_URI_SIZE - len, "&reconnect=1&sid=%s",
+             session->participant_sid);
   }
+
+  ESP_LOGI(LOG_TAG, "WebSocket URI: %s", ws_uri);
+  return ws_uri;
 }
 
-void lk_websocket(const char *room_url, const char *token) {
-  g_mutex = xSemaphoreCreateMutex();
-  if (g_mutex == NULL) {
-    ESP_LOGE(LOG_TAG, "Failed to create mutex.");
+static bool lk_peer_connections_connected(lk_session *session) {
+  return session->subscriber_connected &&
+         (!session->publisher_started || session->publisher_connected);
+}
+
+static void lk_reconnect_start(lk_session *session, int status) {
+  if (status == 1 && session->participant_sid == NULL) {
+    status = 2;  // Never joined, nothing to resume
+  }
+
+  // Already resuming/rejoining, the running attempt handles it
+  if (status <= session->reconnect_status) {
     return;
   }
 
-  subscriber_peer_connection = lk_create_peer_connection(/* isPublisher */ 0);
-  publisher_peer_connection = lk_create_peer_connection(/* isPublisher */ 1);
-  char *answer_buffer = (char *)calloc(1, ANSWER_BUFFER_SIZE);
+  if (session->reconnect_status == 0) {
+    session->reconnect_start_time = esp_timer_get_time();
+  }
 
-  char *ws_uri = (char *)malloc(WEBSOCKET_URI_SIZE);
-  snprintf(ws_uri, WEBSOCKET_URI_SIZE,
-           "%s/rtc?protocol=%d&access_token=%s&auto_subscribe=true", room_url,
-           LIVEKIT_PROTOCOL_VERSION, token);
-  ESP_LOGI(LOG_TAG, "WebSocket URI: %s", ws_uri);
+  ESP_LOGI(LOG_TAG, "Reconnect: %s", status == 1 ? "resuming" : "rejoining");
+  lk_metrics_count(LK_COUNTER_RECONNECTS);
+  session->reconnect_status = status;
+  session->reconnect_attempts = 0;
+  session->reconnect_deadline = 0;
+}
+
+static void lk_reconnect_attempt(lk_session *session) {
+  auto client = session->client;
+  esp_websocket_client_stop(client);
+  session->signaling_ready = false;
+
+  if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+    session->subscriber_status = 0;
+    lk_reset_signaling_state(session);
+
+    if (session->reconnect_status == 2) {
+      // The server forgets the old participant and its track
+      session->subscriber_connected = false;
+      session->publisher_connected = false;
+      lk_mem_free(LK_MEM_SIGNALING, session->participant_sid);
+      session->participant_sid = NULL;
+      session->track_published = false;
+      lk_mem_free(LK_MEM_SIGNALING, session->track_sid);
+      session->track_sid = NULL;
+    } else if (session->track_published &&
+               peer_connection_get_state(session->publisher_peer_connection) !=
+                   PEER_CONNECTION_COMPLETED) {
+      set_publisher_status(session, 2);
+    }
+    xSemaphoreGive(session->mutex);
+  }
+
+  auto ws_uri = lk_websocket_uri(session, session->reconnect_status == 1);
+  esp_websocket_client_set_uri(client, ws_uri);
+  lk_mem_free(LK_MEM_SIGNALING, ws_uri);
+  esp_websocket_client_start(client);
+
+  int64_t timeout_ms = RECONNECT_RESUME_TIMEOUT_MS;
+  if (session->reconnect_status == 2) {
+    timeout_ms = RECONNECT_BACKOFF_INITIAL_MS;
+    for (int i = 0; i < session->reconnect_attempts &&
+                    timeout_ms < RECONNECT_BACKOFF_MAX_MS;
+         i++) {
+      timeout_ms *= 2;
+    }
+    if (timeout_ms > RECONNECT_BACKOFF_MAX_MS) {
+      timeout_ms = RECONNECT_BACKOFF_MAX_MS;
+    }
+  }
+
+  session->reconnect_attempts++;
+  session->reconnect_deadline = esp_timer_get_time() + timeout_ms * 1000;
+}
+
+// Called by the signaling loop on every wakeup
+static void lk_reconnect_poll(lk_session *session) {
+  if (session->reconnect_status == 0) {
+    return;
+  }
+
+  if (session->reconnect_attempts > 0 && session->signaling_ready &&
+      lk_peer_connections_connected(session)) {
+    lk_metrics_record(LK_HISTOGRAM_RECONNECT_US,
+                      session->reconnect_start_time);
+    ESP_LOGI(LOG_TAG, "Reconnect: recovered by %s in %lld ms, %d attempts",
+             session->reconnect_status == 1 ? "resume" : "rejoin",
+             (long long)(esp_timer_get_time() -
+                         session->reconnect_start_time) /
+                 1000,
+             session->reconnect_attempts);
+    session->reconnect_status = 0;
+    return;
+  }
+
+  if (esp_timer_get_time() < session->reconnect_deadline) {
+    return;
+  }
+
+  if (session->reconnect_status == 1 && session->reconnect_attempts > 0) {
+    ESP_LOGI(LOG_TAG, "Reconnect: resume timed out, rejoining");
+    session->reconnect_status = 2;
+    session->reconnect_attempts = 0;
+  }
+
+  lk_reconnect_attempt(session);
+}
+
+static void lk_send_update_subscription(lk_session *session, char **track_sids,
+                                        size_t n_track_sids, bool subscribe) {
+  if (n_track_sids == 0) {
+    return;
+  }
+
+  Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
+  Livekit__UpdateSubscription u = LIVEKIT__UPDATE_SUBSCRIPTION__INIT;
+
+  u.track_sids = track_sids;
+  u.n_track_sids = n_track_sids;
+  u.subscribe = subscribe;
+  r.subscription = &u;
+  r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_SUBSCRIPTION;
+
+  lk_pack_and_send_signal_request(session, &r);
+}
+
+static void lk_send_update_track_settings(lk_session *session,
+                                          char **track_sids,
+                                          size_t n_track_sids, bool disabled) {
+  if (n_track_sids == 0) {
+    return;
+  }
+
+  Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
+  Livekit__UpdateTrackSettings t = LIVEKIT__UPDATE_TRACK_SETTINGS__INIT;
+
+  t.track_sids = track_sids;
+  t.n_track_sids = n_track_sids;
+  t.disabled = disabled;
+  r.track_setting = &t;
+  r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_TRACK_SETTING;
+
+  lk_pack_and_send_signal_request(session, &r);
+}
+
+// Called with the session mutex held. Returns when it has to be called again,
+// 0 if only once something is received
+static int64_t lk_update_subscriptions(lk_session *session) {
+#ifdef LK_AUTO_SUBSCRIBE
+  return 0;
+#else
+  auto now = esp_timer_get_time();
+  lk_subscription_changes changes;
+  if (lk_subscriptions_select(&session->subscriptions, now, &changes)) {
+    // Pausing first, the downlink never carries more than the selected
+    // speakers
+    lk_send_update_track_settings(session, changes.disable, changes.n_disable,
+                                  /* disabled */ true);
+    lk_send_update_subscription(session, changes.unsubscribe,
+                                changes.n_unsubscribe, /* subscribe */ false);
+    lk_send_update_track_settings(session, changes.enable, changes.n_enable,
+                                  /* disabled */ false);
+    lk_send_update_subscription(session, changes.subscribe,
+                                changes.n_subscribe, /* subscribe */ true);
+  }
+  lk_metrics_gauge_set(LK_GAUGE_SUBSCRIBED_TRACKS,
+                       session->subscriptions.subscribed);
+  return lk_subscriptions_deadline(&session->subscriptions, now);
+#endif
+}
+
+void lk_websocket(lk_session *session) {
+  session->join_start_time = esp_timer_get_time();
+
+  session->subscriber_peer_connection =
+      lk_create_peer_connection(session, /* isPublisher */ 0);
+  session->publisher_peer_connection =
+      lk_create_peer_connection(session, /* isPublisher */ 1);
+  if (session->subscriber_peer_connection == NULL ||
+      session->publisher_peer_connection == NULL) {
+    return;
+  }
+
+  char *ws_uri = lk_websocket_uri(session, /* resume */ 0);
 
   esp_websocket_client_config_t ws_cfg;
   memset(&ws_cfg, 0, sizeof(ws_cfg));
@@ -274,39 +638,59 @@ void lk_websocket(const char *room_url, const char *token) {
   ws_cfg.uri = ws_uri;
   ws_cfg.buffer_size = WEBSOCKET_BUFFER_SIZE + 2048;
   ws_cfg.disable_pingpong_discon = true;
-  ws_cfg.reconnect_timeout_ms = 5000;
+  // Reconnecting is driven by the reconnect FSM, it needs to change the URI
+  ws_cfg.disable_auto_reconnect = true;
   ws_cfg.network_timeout_ms = 5000;
 
-  auto client = esp_websocket_client_init(&ws_cfg);
-  esp_websocket_register_events(client, WEBSOCKET_EVENT_ANY,
-                                lk_websocket_event_handler, (void *)client);
-  esp_websocket_client_start(client);
-  free(ws_uri);
-
-#ifdef LINUX_BUILD
-  pthread_t subscriber_peer_connection_thread_handle;
-  pthread_create(
-      &subscriber_peer_connection_thread_handle, NULL,
-      [](void *) -> void * {
-        lk_subscriber_peer_connection_task(NULL);
-        pthread_exit(NULL);
-        return NULL;
-      },
-      NULL);
-#else
-  TaskHandle_t peer_connection_task_handle = NULL;
-  StaticTask_t task_buffer;
-  StackType_t *stack_memory = (StackType_t *)heap_caps_malloc(
-      20000 * sizeof(StackType_t), MALLOC_CAP_SPIRAM);
+  session->client = esp_websocket_client_init(&ws_cfg);
+  esp_websocket_register_events(session->client, WEBSOCKET_EVENT_ANY,
+                                lk_websocket_event_handler, (void *)session);
+  esp_websocket_client_start(session->client);
+  lk_mem_free(LK_MEM_SIGNALING, ws_uri);
 
-  xTaskCreatePinnedToCore(lk_subscriber_peer_connection_task, "lk_subscriber",
-                          16384, NULL, 5, &peer_connection_task_handle, 1);
-#endif
+  lk_mem_create_task(LK_MEM_STACK, lk_subscriber_peer_connection_task,
+                     "lk_subscriber", SUBSCRIBER_STACK_SIZE, session, 5, 1);
 
+  int64_t subscriptions_deadline = 0;
   while (true) {
-    if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
-      if (get_publisher_status() == 1) {
-      // if (get_publisher_status() == 1 && SEND_AUDIO) {
+    // While reconnecting wake up periodically to drive timeouts and backoff,
+    // otherwise when a subscription hold or release runs out
+    TickType_t wait = portMAX_DELAY;
+    if (session->reconnect_status != 0) {
+      wait = pdMS_TO_TICKS(RECONNECT_POLL_INTERVAL_MS);
+    } else if (subscriptions_deadline != 0) {
+      auto remaining_ms =
+          (subscriptions_deadline - esp_timer_get_time()) / 1000 + 1;
+      wait = pdMS_TO_TICKS(remaining_ms > 0 ? remaining_ms : 0);
+    }
+    auto bits = xEventGroupWaitBits(
+        session->signaling_events, SIGNALING_EVENT_ALL,
+        /* xClearOnExit */ pdTRUE, /* xWaitForAllBits */ pdFALSE, wait);
+
+    if (bits & SIGNALING_EVENT_REJOIN) {
+      lk_reconnect_start(session, 2);
+    } else if (bits & SIGNALING_EVENT_RESUME) {
+      lk_reconnect_start(session, 1);
+    }
+    lk_reconnect_poll(session);
+
+    // Requests are sent once the server has accepted the new connection
+    if (session->reconnect_status != 0 && !session->signaling_ready) {
+      continue;
+    }
+
+    if (xSemaphoreTake(session->mutex, portMAX_DELAY) == pdTRUE) {
+      if (get_publisher_status(session) == 1 && session->track_published) {
+        // Subscriber reconnected within the same session. The track is still
+        // published, only ICE restart the publisher if it dropped too
+        set_publisher_status(
+            session,
+            peer_connection_get_state(session->publisher_peer_connection) ==
+                    PEER_CONNECTION_COMPLETED
+                ? 0
+                : 2);
+      } else if (get_publisher_status(session) == 1) {
+      // if (get_publisher_status(session) == 1 && SEND_AUDIO) {
         Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
         Livekit__AddTrackRequest a = LIVEKIT__ADD_TRACK_REQUEST__INIT;
 
@@ -317,59 +701,79 @@ void lk_websocket(const char *room_url, const char *token) {
         r.add_track = &a;
         r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_ADD_TRACK;
 
-        lk_pack_and_send_signal_request(&r, client);
-        set_publisher_status(0);
-
-#ifdef LINUX_BUILD
-        pthread_t publisher_peer_connection_thread_handle;
-        pthread_create(
-            &publisher_peer_connection_thread_handle, NULL,
-            [](void *) -> void * {
-              lk_publisher_peer_connection_task(NULL);
-              pthread_exit(NULL);
-              return NULL;
-            },
-            NULL);
-#else
-        if (stack_memory) {
-          xTaskCreateStaticPinnedToCore(lk_publisher_peer_connection_task,
-                                        "lk_publisher", 20000, NULL, 7,
-                                        stack_memory, &task_buffer, 0);
+        lk_pack_and_send_signal_request(session, &r);
+        set_publisher_status(session, 0);
+
+        // A rejoin publishes the track again on the existing PeerConnection
+        if (!session->publisher_started) {
+          session->publisher_started = true;
+          lk_mem_create_task(LK_MEM_STACK, lk_publisher_peer_connection_task,
+                             "lk_publisher", PUBLISHER_STACK_SIZE, session, 7,
+                             0);
         }
-#endif
 
-      } else if (get_publisher_status() == 3) {
+      } else if (get_publisher_status(session) == 3) {
         Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
         Livekit__SessionDescription s = LIVEKIT__SESSION_DESCRIPTION__INIT;
 
-        s.sdp = publisher_signaling_buffer;
+        s.sdp = session->publisher_signaling_buffer;
         s.type = (char *)SDP_TYPE_OFFER;
         r.offer = &s;
         r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_OFFER;
 
-        lk_pack_and_send_signal_request(&r, client);
-        free(publisher_signaling_buffer);
-        publisher_signaling_buffer = NULL;
-        set_publisher_status(0);
+        lk_pack_and_send_signal_request(session, &r);
+        lk_join_milestone(session, "publisher offer sent");
+        session->publisher_offer_sent_time = esp_timer_get_time();
+        lk_mem_free(LK_MEM_SIGNALING, session->publisher_signaling_buffer);
+        session->publisher_signaling_buffer = NULL;
+        set_publisher_status(session, 0);
       }
 
-      if (subscriber_status != 0 && subscriber_answer_ice_ufrag != NULL) {
+      if (session->track_sid != NULL &&
+          session->microphone_muted != session->microphone_muted_sent) {
         Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
-        Livekit__SessionDescription s = LIVEKIT__SESSION_DESCRIPTION__INIT;
+        Livekit__MuteTrackRequest m = LIVEKIT__MUTE_TRACK_REQUEST__INIT;
 
-        lk_populate_answer(answer_buffer, ANSWER_BUFFER_SIZE,
-                           subscriber_status == 2);
-        s.sdp = answer_buffer;
-        s.type = (char *)SDP_TYPE_ANSWER;
-        r.answer = &s;
-        r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_ANSWER;
+        session->microphone_muted_sent = session->microphone_muted;
+        m.sid = session->track_sid;
+        m.muted = session->microphone_muted_sent;
+        r.mute = &m;
+        r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_MUTE;
 
-        lk_pack_and_send_signal_request(&r, client);
-        subscriber_status = 0;
+        lk_pack_and_send_signal_request(session, &r);
+      }
+
+      if (session->subscriber_status != 0 &&
+          session->subscriber_local_description != NULL) {
+        if (lk_populate_answer(session) < 0) {
+          // The SFU would reject an empty or partial answer and leave the
+          // subscriber half negotiated. A new participant gets a new offer
+          ESP_LOGE(LOG_TAG, "Failed to build subscriber answer");
+          session->subscriber_offer_received_time = 0;
+          lk_request_reconnect(session, "subscriber answer failed",
+                               /* rejoin */ 1);
+        } else {
+          Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
+          Livekit__SessionDescription s = LIVEKIT__SESSION_DESCRIPTION__INIT;
+
+          s.sdp = session->answer_buffer;
+          s.type = (char *)SDP_TYPE_ANSWER;
+          r.answer = &s;
+          r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_ANSWER;
+
+          lk_pack_and_send_signal_request(session, &r);
+          lk_join_milestone(session, "subscriber answer sent");
+          auto received_time =
+              session->subscriber_offer_received_time.exchange(0);
+          if (received_time != 0) {
+            lk_metrics_record(LK_HISTOGRAM_ANSWER_LOCAL_US, received_time);
+          }
+        }
+        session->subscriber_status = 0;
       }
 
-      xSemaphoreGive(g_mutex);
+      subscriptions_deadline = lk_update_subscriptions(session);
+      xSemaphoreGive(session->mutex);
     }
-    vTaskDelay(pdMS_TO_TICKS(500));
   }
 }
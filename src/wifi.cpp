@@ -1,7 +1,12 @@
 #include <assert.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <mbedtls/pkcs5.h>
+#include <nvs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,26 +15,190 @@
 
 #define LOG_TAG "wifi"
 
-static bool g_wifi_connected = false;
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_FAIL_BIT BIT1
+
+#define WIFI_CONNECT_RETRIES 5
+#define WIFI_RETRY_DELAY_MS 200
+
+// A cached AP that doesn't answer within this falls back to a full scan
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+
+// Once lk_wifi has returned a lost AP is retried forever, the delay doubles
+// up to this
+#define WIFI_RECONNECT_MAX_DELAY_MS 30000
+
+#define WIFI_NVS_NAMESPACE "lk_wifi"
+#define WIFI_NVS_KEY "cache"
+#define WIFI_CACHE_VERSION 2
+
+// WPA2 PSK derivation, PBKDF2-HMAC-SHA1 over the SSID
+#define WIFI_PMK_SIZE 32
+#define WIFI_PMK_ITERATIONS 4096
+
+// What the last successful association used. The PMK is passed to the driver
+// as a 64 digit hex PSK, which skips the 4096 round PBKDF2 it otherwise does
+// on every boot. Only WPA2-PSK takes a PSK, so other auth modes are never
+// cached. The DHCP lease is cached by lwIP itself
+// (CONFIG_LWIP_DHCP_RESTORE_LAST_IP).
+typedef struct {
+  uint32_t version;
+  uint32_t credentials_hash;  // cache is for WIFI_SSID and WIFI_PASSWORD
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t authmode;  // wifi_auth_mode_t, always WIFI_AUTH_WPA2_PSK
+  char pmk[2 * WIFI_PMK_SIZE];  // hex, not terminated
+} lk_wifi_cache;
+
+static EventGroupHandle_t wifi_events = NULL;
+static bool fast_connect = false;
+static wifi_event_sta_connected_t connected_ap;
+
+// Set once lk_wifi has returned, nothing waits on the event bits after that
+static volatile bool keep_connected = false;
+static wifi_config_t reconnect_config;
+static esp_timer_handle_t reconnect_timer = NULL;
+static uint32_t reconnect_delay_ms = WIFI_RETRY_DELAY_MS;
+
+// Runs on the esp_timer task. A connect the driver refuses is retried, one it
+// accepts ends in either an IP or another disconnect event
+static void lk_wifi_reconnect(void *arg) {
+  if (esp_wifi_set_config(static_cast<wifi_interface_t>(ESP_IF_WIFI_STA),
+                          &reconnect_config) != ESP_OK ||
+      esp_wifi_connect() != ESP_OK) {
+    esp_timer_start_once(reconnect_timer, reconnect_delay_ms * 1000ULL);
+  }
+}
 
 static void lk_event_handler(void *arg, esp_event_base_t event_base,
                              int32_t event_id, void *event_data) {
   static int s_retry_num = 0;
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < 5) {
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    memcpy(&connected_ap, event_data, sizeof(connected_ap));
+    s_retry_num = 0;
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    if (keep_connected) {
+      ESP_LOGW(LOG_TAG, "Lost the AP, reconnecting in %lu ms",
+               (unsigned long)reconnect_delay_ms);
+      esp_timer_start_once(reconnect_timer, reconnect_delay_ms * 1000ULL);
+      reconnect_delay_ms = reconnect_delay_ms * 2 > WIFI_RECONNECT_MAX_DELAY_MS
+                               ? WIFI_RECONNECT_MAX_DELAY_MS
+                               : reconnect_delay_ms * 2;
+      return;
+    }
+    // A stale cache is given up on at once, the scan is the retry
+    if (!fast_connect && s_retry_num < WIFI_CONNECT_RETRIES) {
       esp_wifi_connect();
       s_retry_num++;
       ESP_LOGI(LOG_TAG, "retry to connect to the AP");
+      return;
     }
     ESP_LOGI(LOG_TAG, "connect to the AP fail");
+    s_retry_num = 0;
+    xEventGroupSetBits(wifi_events, WIFI_FAIL_BIT);
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(LOG_TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-    g_wifi_connected = true;
+    reconnect_delay_ms = WIFI_RETRY_DELAY_MS;
+    xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+  }
+}
+
+static uint32_t lk_fnv1a(uint32_t hash, const char *s) {
+  for (; *s != '\0'; s++) {
+    hash = (hash ^ (uint8_t)*s) * 16777619u;
+  }
+  return hash;
+}
+
+// Only tells whether the cache belongs to the built-in credentials
+static uint32_t lk_wifi_credentials_hash() {
+  auto hash = lk_fnv1a(2166136261u, WIFI_SSID);
+  hash = lk_fnv1a(hash, "\n");
+  return lk_fnv1a(hash, WIFI_PASSWORD);
+}
+
+static bool lk_wifi_cache_load(lk_wifi_cache *cache) {
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+
+  size_t size = sizeof(*cache);
+  auto err = nvs_get_blob(handle, WIFI_NVS_KEY, cache, &size);
+  nvs_close(handle);
+  return err == ESP_OK && size == sizeof(*cache) &&
+         cache->version == WIFI_CACHE_VERSION &&
+         cache->credentials_hash == lk_wifi_credentials_hash() &&
+         cache->authmode == WIFI_AUTH_WPA2_PSK;
+}
+
+static void lk_wifi_cache_store(const lk_wifi_cache *cache) {
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to open NVS, association not cached");
+    return;
+  }
+
+  if (nvs_set_blob(handle, WIFI_NVS_KEY, cache, sizeof(*cache)) != ESP_OK ||
+      nvs_commit(handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to write association cache");
   }
+  nvs_close(handle);
+}
+
+static void lk_wifi_cache_erase() {
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+    nvs_erase_key(handle, WIFI_NVS_KEY);
+    nvs_commit(handle);
+    nvs_close(handle);
+  }
+}
+
+static int lk_wifi_derive_pmk(char *hex) {
+  uint8_t pmk[WIFI_PMK_SIZE];
+  auto ssid = (const char *)WIFI_SSID;
+  auto password = (const char *)WIFI_PASSWORD;
+  if (mbedtls_pkcs5_pbkdf2_hmac_ext(
+          MBEDTLS_MD_SHA1, (const unsigned char *)password, strlen(password),
+          (const unsigned char *)ssid, strlen(ssid), WIFI_PMK_ITERATIONS,
+          sizeof(pmk), pmk) != 0) {
+    return -1;
+  }
+
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < WIFI_PMK_SIZE; i++) {
+    hex[2 * i] = digits[pmk[i] >> 4];
+    hex[2 * i + 1] = digits[pmk[i] & 0xF];
+  }
+  return 0;
+}
+
+// Returns whether an IP was acquired within timeout
+static bool lk_wifi_connect(wifi_config_t *wifi_config, TickType_t timeout) {
+  xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+
+  // Fails while a retry of the previous attempt is still connecting
+  if (esp_wifi_set_config(static_cast<wifi_interface_t>(ESP_IF_WIFI_STA),
+                          wifi_config) != ESP_OK ||
+      esp_wifi_connect() != ESP_OK) {
+    vTaskDelay(pdMS_TO_TICKS(WIFI_RETRY_DELAY_MS));
+    return false;
+  }
+
+  auto bits = xEventGroupWaitBits(wifi_events,
+                                  WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+                                  /* xClearOnExit */ pdFALSE,
+                                  /* xWaitForAllBits */ pdFALSE, timeout);
+  return (bits & WIFI_CONNECTED_BIT) != 0;
 }
 
 void lk_wifi(void) {
+  wifi_events = xEventGroupCreate();
+  assert(wifi_events);
+
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                              &lk_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
@@ -41,6 +210,9 @@ void lk_wifi(void) {
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  // Association state is cached in lk_wifi_cache, the driver doesn't need to
+  // write its config to flash on every boot
+  ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_start());
 
@@ -49,15 +221,78 @@ void lk_wifi(void) {
   memset(&wifi_config, 0, sizeof(wifi_config));
   strncpy((char *)wifi_config.sta.ssid, (char *)WIFI_SSID,
           sizeof(wifi_config.sta.ssid));
+
+  lk_wifi_cache cache;
+  auto cached = lk_wifi_cache_load(&cache);
+  auto connected = false;
+  if (cached) {
+    // Straight to the last AP on its channel, no scan and no PSK derivation
+    fast_connect = true;
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+    wifi_config.sta.channel = cache.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+    memcpy(wifi_config.sta.password, cache.pmk, sizeof(cache.pmk));
+
+    connected = lk_wifi_connect(&wifi_config,
+                                pdMS_TO_TICKS(WIFI_FAST_CONNECT_TIMEOUT_MS));
+    fast_connect = false;
+    if (!connected) {
+      ESP_LOGI(LOG_TAG, "Cached AP on channel %d failed, scanning",
+               cache.channel);
+      esp_wifi_disconnect();
+      lk_wifi_cache_erase();
+      cached = false;
+    }
+  }
+
+  // Also what a lost AP is reconnected with, it may have moved
+  wifi_config.sta.bssid_set = false;
+  wifi_config.sta.channel = 0;
+  wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+  memset(wifi_config.sta.password, 0, sizeof(wifi_config.sta.password));
   strncpy((char *)wifi_config.sta.password, (char *)WIFI_PASSWORD,
           sizeof(wifi_config.sta.password));
 
-  ESP_ERROR_CHECK(esp_wifi_set_config(
-      static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
-  ESP_ERROR_CHECK(esp_wifi_connect());
+  if (!connected) {
+    // block until we get an IP address
+    while (!lk_wifi_connect(&wifi_config, portMAX_DELAY)) {
+    }
+  }
+
+  ESP_LOGI(LOG_TAG, "Got IP %lld ms after boot (%s connect)",
+           (long long)esp_timer_get_time() / 1000,
+           cached ? "fast" : "scan");
 
-  // block until we get an IP address
-  while (!g_wifi_connected) {
-    vTaskDelay(pdMS_TO_TICKS(200));
+  // Signaling only retries the websocket, the link itself is kept up here
+  reconnect_config = wifi_config;
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = lk_wifi_reconnect;
+  timer_args.name = "lk_wifi_reconnect";
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+  keep_connected = true;
+
+  // Off the critical path, the next boot gets the benefit
+  if (connected_ap.authmode != WIFI_AUTH_WPA2_PSK) {
+    ESP_LOGI(LOG_TAG, "Auth mode %d has no PSK, association not cached",
+             (int)connected_ap.authmode);
+    return;
+  }
+  if (!cached || cache.channel != connected_ap.channel ||
+      memcmp(cache.bssid, connected_ap.bssid, sizeof(cache.bssid)) != 0) {
+    if (!cached) {
+      cache.version = WIFI_CACHE_VERSION;
+      cache.credentials_hash = lk_wifi_credentials_hash();
+      cache.authmode = WIFI_AUTH_WPA2_PSK;
+      if (lk_wifi_derive_pmk(cache.pmk) != 0) {
+        ESP_LOGW(LOG_TAG, "Failed to derive PMK, association not cached");
+        return;
+      }
+    }
+    memcpy(cache.bssid, connected_ap.bssid, sizeof(cache.bssid));
+    cache.channel = connected_ap.channel;
+    lk_wifi_cache_store(&cache);
   }
 }